@@ -11,6 +11,7 @@
 #include <compilercommandgenerator.h>
 #include <editor_hooks.h>
 
+#include <wx/power.h>
 #include <wx/tokenzr.h>
 
 #ifndef CB_PRECOMP
@@ -26,13 +27,154 @@
     #include <projectmanager.h>
 
     #include <algorithm>
+    #include <cstdio>
+    #include <cstring>
+    #include <set>
     #include <wx/dir.h>
+    #include <wx/frame.h>
+    #include <wx/thread.h>
 #endif // CB_PRECOMP
 
 // this auto-registers the plugin
 namespace
 {
     PluginRegistrant<ClangPlugin> reg(wxT("ClangLib"));
+
+    /// Is the machine too loaded (or running on battery) to index in the background?
+    bool IsIndexingDeferred()
+    {
+        if (   wxGetPowerType() == wxPOWER_BATTERY
+            && Manager::Get()->GetConfigManager(wxT("clanglib"))->ReadBool(wxT("/indexer_pause_on_battery"), true) )
+        {
+            return true;
+        }
+#ifdef __LINUX__
+        double loadAvg = 0.0;
+        FILE* loadFile = fopen("/proc/loadavg", "r");
+        if (loadFile)
+        {
+            const bool valid = (fscanf(loadFile, "%lf", &loadAvg) == 1);
+            fclose(loadFile);
+            if (valid && loadAvg > wxThread::GetCPUCount())
+                return true;
+        }
+#endif // __LINUX__
+        return false;
+    }
+
+    bool WeightLess(const std::pair<int, size_t>& a, const std::pair<int, size_t>& b)
+    {
+        return a.first < b.first;
+    }
+
+    /// The order the code completion list displays tokens in (alphabetical, ignoring case)
+    bool DisplayOrderLess(const std::pair<wxString, int>& a, const std::pair<wxString, int>& b)
+    {
+        int diff = a.first.CmpNoCase(b.first);
+        if (diff == 0)
+            diff = a.first.Cmp(b.first);
+        return diff < 0;
+    }
+
+    /// Colour settings of each SemanticCategory
+    struct SemanticColour
+    {
+        const wxChar* id;
+        const wxChar* name;
+        unsigned char red, green, blue;
+    };
+    const SemanticColour semanticColours[scCount] =
+    {
+        { wxT("clanglib_semantic_type"),           wxTRANSLATE("Semantic: types"),              0x2B, 0x91, 0xAF },
+        { wxT("clanglib_semantic_member"),         wxTRANSLATE("Semantic: members"),            0x80, 0x00, 0x80 },
+        { wxT("clanglib_semantic_local"),          wxTRANSLATE("Semantic: local variables"),    0x1F, 0x37, 0x7F },
+        { wxT("clanglib_semantic_parameter"),      wxTRANSLATE("Semantic: parameters"),         0x80, 0x80, 0x80 },
+        { wxT("clanglib_semantic_macro"),          wxTRANSLATE("Semantic: macros"),             0x6F, 0x00, 0x8A },
+        { wxT("clanglib_semantic_enum_constant"),  wxTRANSLATE("Semantic: enum constants"),     0x2F, 0x4F, 0x4F }
+    };
+
+    /// Where the definition index of a project is kept between sessions
+    wxString GetDefinitionsFile(const wxString& project)
+    {
+        const wxCharBuffer projectBuf = project.ToUTF8();
+        return   ConfigManager::GetConfigFolder() + wxFILE_SEP_PATH
+               + wxString::Format(wxT("clanglib_definitions_%08x.txt"), HashBuffer(projectBuf.data(), strlen(projectBuf.data())));
+    }
+
+    /// Macros that identify GCC rather than describe the target; clang defines its own
+    bool IsCompilerIdentityMacro(const wxString& name)
+    {
+        const wxChar* const prefixes[] =
+        {
+            wxT("__GNUC"), wxT("__GNUG__"), wxT("__GXX_"), wxT("__VERSION__"), wxT("__clang"), wxT("__llvm"),
+            wxT("__cplusplus"), wxT("__cpp_"), wxT("__STDC"), wxT("__STRICT_ANSI__"), wxT("__OPTIMIZE")
+        };
+        for (size_t i = 0; i < WXSIZEOF(prefixes); ++i)
+        {
+            if (name.StartsWith(prefixes[i]))
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * The flags of a compile command that change what the compiler predefines
+     *
+     * Word size, ABI, CPU features, language and dialect; the compiler is
+     * probed with these, and a language switch for the file.
+     */
+    wxString GetTargetFlags(const wxString& compileCommand, const wxString& filename)
+    {
+        const wxChar* const featureSuffixes[] =
+        {
+            wxT("exceptions"), wxT("rtti"), wxT("signed-char"), wxT("pic"), wxT("PIC"), wxT("pie"), wxT("PIE"),
+            wxT("short-wchar"), wxT("short-enums"), wxT("openmp")
+        };
+        wxArrayString args;
+        CompilationDatabase::SplitCommand(compileCommand, args);
+        wxString flags;
+        for (size_t i = 0; i < args.GetCount(); ++i)
+        {
+            const wxString& arg = args[i];
+            bool isTarget = (   arg.StartsWith(wxT("-m")) || arg.StartsWith(wxT("-std=")) || arg.StartsWith(wxT("--target="))
+                             || arg == wxT("-ansi") || arg == wxT("-pthread") );
+            if (arg.StartsWith(wxT("-f")))
+            {
+                for (size_t j = 0; j < WXSIZEOF(featureSuffixes) && !isTarget; ++j)
+                    isTarget = arg.EndsWith(featureSuffixes[j]);
+            }
+            if (arg == wxT("-target") && i + 1 < args.GetCount())
+            {
+                flags += wxT(" -target ") + args[++i];
+                continue;
+            }
+            if (isTarget && arg.Find(wxT(' ')) == wxNOT_FOUND)
+                flags += wxT(" ") + arg;
+        }
+        const wxString& ext = filename.AfterLast(wxT('.'));
+        flags += (ext == wxT("c") ? wxT(" -x c") : wxT(" -x c++"));
+        return flags.Mid(1);
+    }
+
+    /// Append what is available from a pipe without blocking
+    void ReadProcessStream(wxInputStream* stream, std::string& buffer)
+    {
+        char chunk[4096];
+        while (stream && stream->CanRead())
+        {
+            stream->Read(chunk, sizeof(chunk));
+            if (stream->LastRead() == 0)
+                break;
+            buffer.append(chunk, stream->LastRead());
+        }
+    }
+
+    void SetIndexerStatus(const wxString& status)
+    {
+        wxFrame* frame = Manager::Get()->GetAppFrame();
+        if (frame && frame->GetStatusBar())
+            frame->SetStatusText(status);
+    }
 }
 
 static const wxString g_InvalidStr(wxT("invalid"));
@@ -40,15 +182,41 @@ const int idEdOpenTimer     = wxNewId();
 const int idReparseTimer    = wxNewId();
 const int idDiagnosticTimer = wxNewId();
 const int idHightlightTimer = wxNewId();
+const int idBgReparseTimer  = wxNewId();
+const int idIndexerTimer    = wxNewId();
+const int idRefineTimer     = wxNewId();
+const int idDocPrefetchTimer = wxNewId();
+const int idSemanticTimer    = wxNewId();
+const int idProbeTimer       = wxNewId();
+const int idCompilerProbe    = wxNewId();
 
 const int idGotoDeclaration = wxNewId();
+const int idExportCompileCommands = wxNewId();
+const int idShowMemoryStats = wxNewId();
 
 // milliseconds
 #define ED_OPEN_DELAY 1000
 #define ED_ACTIVATE_DELAY 150
 #define REPARSE_DELAY 900
 #define DIAGNOSTIC_DELAY 3000
-#define HIGHTLIGHT_DELAY 1700
+#define HIGHTLIGHT_DELAY 400
+#define BG_REPARSE_DELAY 400
+#define INDEXER_DELAY 500
+#define INDEXER_IDLE_DELAY 3000 // since the last keystroke
+#define INDEXER_PAUSE_DELAY 30000
+#define INDEXER_POLL_DELAY 200 // while the workers parse
+#define INDEXER_RECEIVE_DELAY 20 // while a worker process writes its results
+#define REFINE_DELAY 100
+#define DOC_PREFETCH_DELAY 30
+#define SEMANTIC_DELAY 50
+#define PROBE_POLL_DELAY 100
+
+// declarations resolved while the completion popup waits
+#define REFINE_LOOKUP_LIMIT 100
+// neighbours (in each direction) of the selected completion token to document ahead of time
+#define DOC_PREFETCH_COUNT 3
+// lines the semantic highlighter fetches and repaints together
+#define SEMANTIC_BLOCK_LINES 100
 
 ClangPlugin::ClangPlugin() :
     m_Proxy(m_Database, m_CppKeywords),
@@ -57,6 +225,16 @@ ClangPlugin::ClangPlugin() :
     m_ReparseTimer(this, idReparseTimer),
     m_DiagnosticTimer(this, idDiagnosticTimer),
     m_HightlightTimer(this, idHightlightTimer),
+    m_BgReparseTimer(this, idBgReparseTimer),
+    m_IndexerTimer(this, idIndexerTimer),
+    m_IndexerTotal(0),
+    m_LastEditTime(0),
+    m_RefineTimer(this, idRefineTimer),
+    m_RefineTranslId(wxNOT_FOUND),
+    m_DocPrefetchTimer(this, idDocPrefetchTimer),
+    m_SemanticTimer(this, idSemanticTimer),
+    m_pSemanticEditor(nullptr),
+    m_ProbeTimer(this, idProbeTimer),
     m_pLastEditor(nullptr),
     m_TranslUnitId(wxNOT_FOUND)
 {
@@ -127,27 +305,86 @@ void ClangPlugin::OnAttach()
     std::sort(m_CppKeywords.begin(), m_CppKeywords.end());
     wxStringVec(m_CppKeywords).swap(m_CppKeywords);
 
+    ConfigManager* cfg = Manager::Get()->GetConfigManager(wxT("clanglib"));
+    // megabytes; 0 disables disposing of translation units
+    const int memoryBudget = cfg->ReadInt(wxT("/memory_budget"), 2048);
+    m_Proxy.SetMemoryBudget(std::max(memoryBudget, 0) * 1024ul);
+    // slower (see HarvestMethod); kept to compare the "visit"/"index" phases in the debug log
+    m_Proxy.SetHarvestMethod(cfg->ReadBool(wxT("/harvest_with_indexer"), false) ? hmIndexer : hmVisitor);
+    // background parses run in this many clangworker processes; 0 parses on a thread of the IDE instead
+    const int numWorkers = cfg->ReadInt(wxT("/indexer_workers"), std::max(wxThread::GetCPUCount() - 1, 1));
+#ifdef __WXMSW__
+    const wxString workerPath = ConfigManager::GetPluginsFolder() + wxFILE_SEP_PATH + wxT("clangworker.exe");
+#else
+    const wxString workerPath = ConfigManager::GetPluginsFolder() + wxFILE_SEP_PATH + wxT("clangworker");
+#endif // __WXMSW__
+    if (numWorkers > 0 && wxFileExists(workerPath))
+        m_Proxy.SetWorkers(wxT("\"") + workerPath + wxT("\""), numWorkers);
+    m_Proxy.SetUnsavedFilesProvider(this);
+    const wxArrayString& recent = cfg->ReadArrayString(wxT("/indexer/recent_files"));
+    m_RecentFiles.assign(recent.begin(), recent.end());
+    m_PchCache.SetDirectory(ConfigManager::GetConfigFolder() + wxFILE_SEP_PATH + wxT("clanglib_pch"));
+
+    ColourManager* colours = Manager::Get()->GetColourManager();
+    for (int categ = 0; categ < scCount; ++categ)
+    {
+        const SemanticColour& colour = semanticColours[categ];
+        colours->RegisterColour(_("Code completion"), wxGetTranslation(colour.name), colour.id,
+                                wxColour(colour.red, colour.green, colour.blue));
+    }
+
     typedef cbEventFunctor<ClangPlugin, CodeBlocksEvent> ClEvent;
     Manager::Get()->RegisterEventSink(cbEVT_EDITOR_OPEN,      new ClEvent(this, &ClangPlugin::OnEditorOpen));
     Manager::Get()->RegisterEventSink(cbEVT_EDITOR_ACTIVATED, new ClEvent(this, &ClangPlugin::OnEditorActivate));
+    Manager::Get()->RegisterEventSink(cbEVT_EDITOR_SAVE,      new ClEvent(this, &ClangPlugin::OnEditorSave));
+    Manager::Get()->RegisterEventSink(cbEVT_EDITOR_CLOSE,     new ClEvent(this, &ClangPlugin::OnEditorClose));
     Manager::Get()->RegisterEventSink(cbEVT_PROJECT_ACTIVATE, new ClEvent(this, &ClangPlugin::OnProjectActivate));
     Connect(idEdOpenTimer,     wxEVT_TIMER, wxTimerEventHandler(ClangPlugin::OnTimer));
     Connect(idReparseTimer,    wxEVT_TIMER, wxTimerEventHandler(ClangPlugin::OnTimer));
     Connect(idDiagnosticTimer, wxEVT_TIMER, wxTimerEventHandler(ClangPlugin::OnTimer));
     Connect(idHightlightTimer, wxEVT_TIMER, wxTimerEventHandler(ClangPlugin::OnTimer));
+    Connect(idBgReparseTimer,  wxEVT_TIMER, wxTimerEventHandler(ClangPlugin::OnTimer));
+    Connect(idIndexerTimer,    wxEVT_TIMER, wxTimerEventHandler(ClangPlugin::OnTimer));
+    Connect(idRefineTimer,     wxEVT_TIMER, wxTimerEventHandler(ClangPlugin::OnTimer));
+    Connect(idDocPrefetchTimer, wxEVT_TIMER, wxTimerEventHandler(ClangPlugin::OnTimer));
+    Connect(idSemanticTimer,    wxEVT_TIMER, wxTimerEventHandler(ClangPlugin::OnTimer));
+    Connect(idProbeTimer,       wxEVT_TIMER, wxTimerEventHandler(ClangPlugin::OnTimer));
+    Connect(idCompilerProbe, wxEVT_END_PROCESS, wxProcessEventHandler(ClangPlugin::OnCompilerProbeEnd));
     Connect(idGotoDeclaration, wxEVT_COMMAND_MENU_SELECTED, /*wxMenuEventHandler*/wxCommandEventHandler(ClangPlugin::OnGotoDeclaration), nullptr, this);
+    Connect(idExportCompileCommands, wxEVT_COMMAND_MENU_SELECTED, wxCommandEventHandler(ClangPlugin::OnExportCompileCommands), nullptr, this);
+    Connect(idShowMemoryStats, wxEVT_COMMAND_MENU_SELECTED, wxCommandEventHandler(ClangPlugin::OnShowMemoryStats), nullptr, this);
     m_EditorHookId = EditorHooks::RegisterHook(new EditorHooks::HookFunctor<ClangPlugin>(this, &ClangPlugin::OnEditorHook));
 }
 
 void ClangPlugin::OnRelease(bool WXUNUSED(appShutDown))
 {
+    SaveIndexerState();
+    m_Proxy.SetUnsavedFilesProvider(nullptr);
     EditorHooks::UnregisterHook(m_EditorHookId);
+    Disconnect(idShowMemoryStats);
+    Disconnect(idExportCompileCommands);
     Disconnect(idGotoDeclaration);
+    Disconnect(idCompilerProbe);
+    Disconnect(idProbeTimer);
+    Disconnect(idSemanticTimer);
+    Disconnect(idDocPrefetchTimer);
+    Disconnect(idRefineTimer);
+    Disconnect(idIndexerTimer);
+    Disconnect(idBgReparseTimer);
     Disconnect(idHightlightTimer);
     Disconnect(idDiagnosticTimer);
     Disconnect(idReparseTimer);
     Disconnect(idEdOpenTimer);
     Manager::Get()->RemoveAllEventSinksFor(this);
+    for (std::map<wxString, CompilerProbe>::iterator prbItr = m_CompilerProbes.begin();
+         prbItr != m_CompilerProbes.end(); ++prbItr)
+    {
+        prbItr->second.process->Detach(); // deletes itself when the compiler exits
+    }
+    m_CompilerProbes.clear();
+    for (size_t i = 0; i < m_FinishedProbes.size(); ++i)
+        delete m_FinishedProbes[i];
+    m_FinishedProbes.clear();
     m_ImageList.RemoveAll();
 }
 
@@ -158,14 +395,6 @@ ClangPlugin::CCProviderStatus ClangPlugin::GetProviderStatusFor(cbEditor* ed)
     return ccpsInactive;
 }
 
-struct PrioritySorter
-{
-    bool operator()(const ClangPlugin::CCToken& a, const ClangPlugin::CCToken& b)
-    {
-        return a.weight < b.weight;
-    }
-};
-
 static wxString GetActualName(const wxString& name)
 {
     const int idx = name.Find(wxT(':'));
@@ -208,15 +437,8 @@ std::vector<ClangPlugin::CCToken> ClangPlugin::GetAutocompList(bool isAuto, cbEd
 
     std::vector<ClToken> tknResults;
     const int line = stc->LineFromPosition(tknStart);
-    std::map<wxString, wxString> unsavedFiles;
-    EditorManager* edMgr = Manager::Get()->GetEditorManager();
-    for (int i = 0; i < edMgr->GetEditorsCount(); ++i)
-    {
-        cbEditor* editor = edMgr->GetBuiltinEditor(i);
-        if (editor && editor->GetModified())
-            unsavedFiles.insert(std::make_pair(editor->GetFilename(),
-                                               editor->GetControl()->GetText()));
-    }
+    ClUnsavedBuffers unsavedFiles;
+    GetUnsavedFiles(m_TranslUnitId, unsavedFiles);
     const int lnStart = stc->PositionFromLine(line);
     int column = tknStart - lnStart;
     for (; column > 0; --column)
@@ -227,61 +449,37 @@ std::vector<ClangPlugin::CCToken> ClangPlugin::GetAutocompList(bool isAuto, cbEd
             break;
         }
     }
-    m_Proxy.CodeCompleteAt(isAuto, ed->GetFilename(), line + 1, column + 1,
-                           m_TranslUnitId, unsavedFiles, tknResults);
-    const wxString& prefix = stc->GetTextRange(tknStart, tknEnd).Lower();
-    bool includeCtors = true; // sometimes we get a lot of these
+    ClCompletionFilter filter;
+    filter.prefix = stc->GetTextRange(tknStart, tknEnd);
+    if (filter.prefix.IsEmpty()) // reduce to give only top matches
+        filter.maxResults = 1000;
     for (int i = tknStart - 1; i > 0; --i)
     {
         wxChar chr = stc->GetCharAt(i);
         if (!wxIsspace(chr))
         {
             if (chr == wxT(';') || chr == wxT('}')) // last non-whitespace character
-                includeCtors = false; // filter out ctors (they are unlikely to be wanted in this situation)
+                filter.includeCtors = false; // filter out ctors (they are unlikely to be wanted in this situation)
             break;
         }
     }
-    if (prefix.Length() > 3) // larger context, match the prefix at any point in the token
-    {
-        for (std::vector<ClToken>::const_iterator tknIt = tknResults.begin();
-             tknIt != tknResults.end(); ++tknIt)
-        {
-            if (tknIt->name.Lower().Find(prefix) != wxNOT_FOUND && (includeCtors || tknIt->category != tcCtorPublic))
-                tokens.push_back(CCToken(tknIt->id, tknIt->name, tknIt->name, tknIt->weight, tknIt->category));
-        }
-    }
-    else if (prefix.IsEmpty())
-    {
-        for (std::vector<ClToken>::const_iterator tknIt = tknResults.begin();
-             tknIt != tknResults.end(); ++tknIt)
-        {
-            // it is rather unlikely for an operator to be the desired completion
-            if (!tknIt->name.StartsWith(wxT("operator")) && (includeCtors || tknIt->category != tcCtorPublic))
-                tokens.push_back(CCToken(tknIt->id, tknIt->name, tknIt->name, tknIt->weight, tknIt->category));
-        }
-    }
-    else // smaller context, only allow matches of the prefix at the beginning of the token
+    m_Proxy.CodeCompleteAt(isAuto, ed->GetFilename(), line + 1, column + 1,
+                           m_TranslUnitId, unsavedFiles, filter, tknResults);
+    tokens.reserve(tknResults.size());
+    for (std::vector<ClToken>::const_iterator tknIt = tknResults.begin();
+         tknIt != tknResults.end(); ++tknIt)
     {
-        for (std::vector<ClToken>::const_iterator tknIt = tknResults.begin();
-             tknIt != tknResults.end(); ++tknIt)
-        {
-            if (tknIt->name.Lower().StartsWith(prefix) && (includeCtors || tknIt->category != tcCtorPublic))
-                tokens.push_back(CCToken(tknIt->id, tknIt->name, tknIt->name, tknIt->weight, tknIt->category));
-        }
+        tokens.push_back(CCToken(tknIt->id, tknIt->name, tknIt->name, tknIt->weight, tknIt->category));
     }
 
     if (!tokens.empty())
     {
-        if (prefix.IsEmpty() && tokens.size() > 1500) // reduce to give only top matches
-        {
-            std::partial_sort(tokens.begin(), tokens.begin() + 1000, tokens.end(), PrioritySorter());
-            tokens.erase(tokens.begin() + 1000, tokens.end());
-        }
         const int imgCount = m_ImageList.GetImageCount();
         for (int i = 0; i < imgCount; ++i)
             stc->RegisterImage(i, m_ImageList.GetBitmap(i));
         bool isPP = stc->GetLine(line).Strip(wxString::leading).StartsWith(wxT("#"));
         std::set<int> usedWeights;
+        std::vector< std::pair<int, size_t> > toRefine; // (weight, index into tokens)
         for (std::vector<CCToken>::iterator tknIt = tokens.begin();
              tknIt != tokens.end(); ++tknIt)
         {
@@ -302,13 +500,37 @@ std::vector<ClangPlugin::CCToken> ClangPlugin::GetAutocompList(bool isAuto, cbEd
                 case tcVarPublic:
                 case tcEnum:
                 case tcTypedef:
-                    m_Proxy.RefineTokenType(m_TranslUnitId, tknIt->id, tknIt->category);
+                    toRefine.push_back(std::make_pair(tknIt->weight, tknIt - tokens.begin()));
                     break;
 
                 default:
                     break;
             }
         }
+        if (!toRefine.empty())
+        {
+            // the best matches are the ones most likely to be looked at; the
+            // rest are resolved in the background, ready for the next popup
+            std::stable_sort(toRefine.begin(), toRefine.end(), WeightLess);
+            std::vector<int> tknIds, tknTypes;
+            tknIds.reserve(toRefine.size());
+            tknTypes.reserve(toRefine.size());
+            for (size_t i = 0; i < toRefine.size(); ++i)
+            {
+                tknIds.push_back(tokens[toRefine[i].second].id);
+                tknTypes.push_back(tokens[toRefine[i].second].category);
+            }
+            if (m_Proxy.RefineTokenTypes(m_TranslUnitId, tknIds, tknTypes, REFINE_LOOKUP_LIMIT) > 0)
+            {
+                m_RefineQueue.swap(tknIds);
+                m_RefineTranslId = m_TranslUnitId;
+                m_RefineTimer.Start(REFINE_DELAY, wxTIMER_ONE_SHOT);
+            }
+            else // the ids of an older popup no longer mean anything
+                m_RefineQueue.clear();
+            for (size_t i = 0; i < toRefine.size(); ++i)
+                tokens[toRefine[i].second].category = tknTypes[i];
+        }
         // Clang sometimes gives many weight values, which can make completion more difficult
         // because results are less alphabetical. Use a compression map on the lower priority
         // values (higher numbers) to reduce the total number of weights used.
@@ -329,14 +551,44 @@ std::vector<ClangPlugin::CCToken> ClangPlugin::GetAutocompList(bool isAuto, cbEd
         }
     }
 
+    // remember the display order, so documentation of the neighbours of the
+    // selected token can be prepared while the user reads the current one
+    std::vector< std::pair<wxString, int> > displayOrder;
+    displayOrder.reserve(tokens.size());
+    for (std::vector<CCToken>::const_iterator tknIt = tokens.begin(); tknIt != tokens.end(); ++tknIt)
+        displayOrder.push_back(std::make_pair(tknIt->displayName, tknIt->id));
+    std::sort(displayOrder.begin(), displayOrder.end(), DisplayOrderLess);
+    m_CCDisplayOrder.clear();
+    m_CCDisplayOrder.reserve(displayOrder.size());
+    for (size_t i = 0; i < displayOrder.size(); ++i)
+        m_CCDisplayOrder.push_back(displayOrder[i].second);
+    m_DocPrefetchQueue.clear();
+
     return tokens;
 }
 
 wxString ClangPlugin::GetDocumentation(const CCToken& token)
 {
-    if (token.id >= 0)
-        return m_Proxy.DocumentCCToken(m_TranslUnitId, token.id);
-    return wxEmptyString;
+    if (token.id < 0)
+        return wxEmptyString;
+    const wxString doc = m_Proxy.DocumentCCToken(m_TranslUnitId, token.id);
+    // the user is likely to move on to an adjacent item next
+    m_DocPrefetchQueue.clear();
+    std::vector<int>::const_iterator ordItr = std::find(m_CCDisplayOrder.begin(), m_CCDisplayOrder.end(), token.id);
+    if (ordItr != m_CCDisplayOrder.end())
+    {
+        const int pos = ordItr - m_CCDisplayOrder.begin();
+        for (int i = 1; i <= DOC_PREFETCH_COUNT; ++i)
+        {
+            if (pos + i < static_cast<int>(m_CCDisplayOrder.size()))
+                m_DocPrefetchQueue.push_back(m_CCDisplayOrder[pos + i]);
+            if (pos - i >= 0)
+                m_DocPrefetchQueue.push_back(m_CCDisplayOrder[pos - i]);
+        }
+    }
+    if (!m_DocPrefetchQueue.empty())
+        m_DocPrefetchTimer.Start(DOC_PREFETCH_DELAY, wxTIMER_ONE_SHOT);
+    return doc;
 }
 
 std::vector<ClangPlugin::CCCallTip> ClangPlugin::GetCallTips(int pos, int style, cbEditor* ed, int& argsPos)
@@ -521,6 +773,16 @@ void ClangPlugin::BuildMenu(wxMenuBar* menuBar)
     {
         menuBar->GetMenu(idx)->Append(idGotoDeclaration, _("Resolve token (clang)"));
     }
+    idx = menuBar->FindMenu(_("&Project"));
+    if (idx != wxNOT_FOUND)
+    {
+        menuBar->GetMenu(idx)->Append(idExportCompileCommands, _("Export compile_commands.json (clang)"));
+    }
+    idx = menuBar->FindMenu(_("&View"));
+    if (idx != wxNOT_FOUND)
+    {
+        menuBar->GetMenu(idx)->Append(idShowMemoryStats, _("Memory usage (clang)"));
+    }
 }
 
 void ClangPlugin::BuildModuleMenu(const ModuleType type, wxMenu* menu,
@@ -561,6 +823,12 @@ void ClangPlugin::OnEditorActivate(CodeBlocksEvent& event)
     cbEditor* ed = Manager::Get()->GetEditorManager()->GetBuiltinEditor(event.GetEditor());
     if (ed)
     {
+        wxStringVec::iterator recentItr = std::find(m_RecentFiles.begin(), m_RecentFiles.end(), ed->GetFilename());
+        if (recentItr != m_RecentFiles.end())
+            m_RecentFiles.erase(recentItr);
+        m_RecentFiles.insert(m_RecentFiles.begin(), ed->GetFilename());
+        if (m_RecentFiles.size() > 32)
+            m_RecentFiles.pop_back();
         UpdateCompileCommand(ed);
         if(!m_EdOpenTimer.IsRunning())
             m_EdOpenTimer.Start(ED_ACTIVATE_DELAY, wxTIMER_ONE_SHOT);
@@ -568,8 +836,63 @@ void ClangPlugin::OnEditorActivate(CodeBlocksEvent& event)
     event.Skip();
 }
 
+void ClangPlugin::OnEditorSave(CodeBlocksEvent& event)
+{
+    cbEditor* ed = Manager::Get()->GetEditorManager()->GetBuiltinEditor(event.GetEditor());
+    if (ed && m_PchCache.FileChanged(ed->GetFilename(), false))
+    {
+        UpdatePchFlags();
+        // rebuilt even while indexing is deferred; the units using it parse without it meanwhile
+        if (m_PchCache.HasStale())
+            m_IndexerTimer.Start(INDEXER_DELAY, wxTIMER_ONE_SHOT);
+    }
+    if (ed && IsProviderFor(ed))
+    {
+        // the active unit may have been given up on after failing to parse; retry with the saved changes
+        if (m_TranslUnitId != wxNOT_FOUND && !m_Proxy.IsTranslationUnitLoaded(m_TranslUnitId))
+        {
+            ClUnsavedBuffers unsavedFiles;
+            GetUnsavedFiles(m_TranslUnitId, unsavedFiles);
+            if (m_Proxy.Reparse(m_TranslUnitId, unsavedFiles, true) == rsReparsed)
+                m_DiagnosticTimer.Start(DIAGNOSTIC_DELAY, wxTIMER_ONE_SHOT);
+        }
+        QueueDependentReparse(ed->GetFilename());
+        // the tokens, signatures and definitions recorded for the file are out of date
+        const int translId = m_Proxy.GetTranslationUnitId(ed->GetFilename());
+        if (   translId != wxNOT_FOUND
+            && std::find(m_ReindexQueue.begin(), m_ReindexQueue.end(), translId) == m_ReindexQueue.end() )
+        {
+            m_ReindexQueue.push_back(translId);
+            if (!m_IndexerTimer.IsRunning())
+                m_IndexerTimer.Start(INDEXER_DELAY, wxTIMER_ONE_SHOT);
+        }
+    }
+    event.Skip();
+}
+
+void ClangPlugin::OnEditorClose(CodeBlocksEvent& event)
+{
+    if (event.GetEditor())
+    {
+        DropSnapshot(event.GetEditor()->GetFilename());
+        // changes left unsaved no longer keep units off the shared PCH
+        if (m_PchCache.FileChanged(event.GetEditor()->GetFilename(), false))
+        {
+            UpdatePchFlags();
+            if (m_PchCache.HasStale())
+                m_IndexerTimer.Start(INDEXER_DELAY, wxTIMER_ONE_SHOT);
+        }
+    }
+    if (event.GetEditor() == m_pSemanticEditor)
+        m_pSemanticEditor = nullptr; // the address may be reused by the next editor
+    event.Skip();
+}
+
 void ClangPlugin::OnProjectActivate(CodeBlocksEvent& event)
 {
+    SaveIndexerState();
+    LoadCompilationDatabase(event.GetProject());
+    StartIndexer(event.GetProject());
     cbEditor* ed = Manager::Get()->GetEditorManager()->GetBuiltinEditor(event.GetEditor());
     if (ed)
     {
@@ -580,6 +903,70 @@ void ClangPlugin::OnProjectActivate(CodeBlocksEvent& event)
     event.Skip();
 }
 
+void ClangPlugin::OnExportCompileCommands(wxCommandEvent& WXUNUSED(event))
+{
+    cbProject* proj = Manager::Get()->GetProjectManager()->GetActiveProject();
+    if (!proj)
+        return;
+    Compiler* comp = CompilerFactory::GetCompiler(proj->GetCompilerID());
+    if (!comp)
+        comp = CompilerFactory::GetDefaultCompiler();
+    CompilationDatabase compDb;
+    for (FilesList::iterator fileItr = proj->GetFilesList().begin();
+         fileItr != proj->GetFilesList().end(); ++fileItr)
+    {
+        ProjectFile* pf = *fileItr;
+        if (pf->compile && FileTypeOf(pf->relativeFilename) == ftSource)
+        {
+            const wxString& filename = pf->file.GetFullPath();
+            // from the project's build options, not echoing back a database loaded earlier
+            compDb.SetCommand(filename, proj->GetBasePath(), GetCompileCommand(pf, filename, false, false));
+        }
+    }
+    const wxString& dbFile = proj->GetBasePath() + wxT("compile_commands.json");
+    if (compDb.Save(dbFile, comp->GetPrograms().CPP))
+        Manager::Get()->GetLogManager()->Log(wxT("ClangLib: wrote ") + dbFile);
+    else
+        Manager::Get()->GetLogManager()->LogError(wxT("ClangLib: failed to write ") + dbFile);
+}
+
+void ClangPlugin::OnShowMemoryStats(wxCommandEvent& WXUNUSED(event))
+{
+    std::vector<ClMemoryStats> stats;
+    m_Proxy.GetMemoryStats(stats);
+    unsigned long total = m_Database.GetMemoryUsage();
+    for (std::vector<ClMemoryStats>::const_iterator stItr = stats.begin(); stItr != stats.end(); ++stItr)
+        total += stItr->libclangMemory + stItr->completionMemory;
+
+    wxString summary = wxString::Format(_("Total: %lu KB\nToken database: %lu KB (%lu tokens, %lu files)\n"),
+                                        total, m_Database.GetMemoryUsage(),
+                                        static_cast<unsigned long>(m_Database.GetTokenCount()),
+                                        static_cast<unsigned long>(m_Database.GetFilenameCount()));
+    wxString details = wxT("ClangLib memory usage\n") + summary;
+    const size_t maxSummaryLines = 10;
+    for (size_t i = 0; i < stats.size(); ++i)
+    {
+        const ClMemoryStats& tuStats = stats[i];
+        const wxString line = wxString::Format(wxT("%lu KB (+%lu KB completion)%s: %s\n"),
+                                               tuStats.libclangMemory, tuStats.completionMemory,
+                                               tuStats.loaded ? wxT("") : wxT(" [disposed]"),
+                                               tuStats.filename.c_str());
+        if (i < maxSummaryLines)
+            summary += line;
+        details += line;
+        for (std::vector<ClMemoryEntry>::const_iterator enItr = tuStats.entries.begin();
+             enItr != tuStats.entries.end(); ++enItr)
+        {
+            if (enItr->amount > 0)
+                details += wxString::Format(wxT("    %lu KB %s\n"), enItr->amount, enItr->name.c_str());
+        }
+    }
+    Manager::Get()->GetLogManager()->Log(details);
+    if (stats.size() > maxSummaryLines)
+        summary += _("...\n(full breakdown written to the log)");
+    cbMessageBox(summary, _("ClangLib memory usage"), wxOK | wxICON_INFORMATION);
+}
+
 void ClangPlugin::OnGotoDeclaration(wxCommandEvent& WXUNUSED(event))
 {
     cbEditor* ed = Manager::Get()->GetEditorManager()->GetBuiltinActiveEditor();
@@ -600,11 +987,14 @@ void ClangPlugin::OnGotoDeclaration(wxCommandEvent& WXUNUSED(event))
                                                           stc->WordEndPosition(pos, true)));
 }
 
-wxString ClangPlugin::GetCompilerInclDirs(const wxString& compId)
+wxString ClangPlugin::GetCompilerInclDirs(const wxString& compId, const wxString& targetFlags)
 {
-    std::map<wxString, wxString>::const_iterator idItr = m_compInclDirs.find(compId);
+    const wxString probeId = compId + wxT('\t') + targetFlags;
+    std::map<wxString, wxString>::const_iterator idItr = m_compInclDirs.find(probeId);
     if (idItr != m_compInclDirs.end())
         return idItr->second;
+    if (m_CompilerProbes.find(probeId) != m_CompilerProbes.end())
+        return wxEmptyString; // not done yet
 
     Compiler* comp = CompilerFactory::GetCompiler(compId);
     wxFileName fn(wxEmptyString, comp->GetPrograms().CPP);
@@ -613,31 +1003,120 @@ wxString ClangPlugin::GetCompilerInclDirs(const wxString& compId)
     fn.SetPath(masterPath);
     if (!fn.FileExists())
         fn.AppendDir(wxT("bin"));
+    const wxString probeFlags = wxT("-v -dM -E ") + targetFlags;
+    const wxString key = fn.GetFullPath() + wxT('|')
+                       + wxString::Format(wxT("%ld"), static_cast<long>(fn.FileExists() ? wxFileModificationTime(fn.GetFullPath()) : 0))
+                       + wxT('|') + probeFlags;
+    ConfigManager* cfg = Manager::Get()->GetConfigManager(wxT("clanglib"));
+    const wxCharBuffer targetBuf = targetFlags.ToUTF8();
+    const wxString cfgPath =   wxT("/compiler_probe/") + compId
+                             + wxString::Format(wxT("_%08x"), HashBuffer(targetBuf.data(), strlen(targetBuf.data())));
+    if (cfg->Read(cfgPath + wxT("/key")) == key)
+        return m_compInclDirs.insert(std::make_pair(probeId, cfg->Read(cfgPath + wxT("/flags")))).first->second;
+
 #ifdef __WXMSW__
-    wxString command = fn.GetFullPath() + wxT(" -v -E -x c++ nul");
+    const wxString command = fn.GetFullPath() + wxT(" ") + probeFlags + wxT(" nul");
 #else
-    wxString command = fn.GetFullPath() + wxT(" -v -E -x c++ /dev/null");
+    const wxString command = fn.GetFullPath() + wxT(" ") + probeFlags + wxT(" /dev/null");
 #endif // __WXMSW__
-    wxArrayString output, errors;
-    wxExecute(command, output, errors, wxEXEC_NODISABLE);
+    wxProcess* process = new wxProcess(this, idCompilerProbe);
+    process->Redirect();
+    if (wxExecute(command, wxEXEC_ASYNC | wxEXEC_NODISABLE, process) == 0)
+    {
+        delete process;
+        return m_compInclDirs.insert(std::make_pair(probeId, wxString())).first->second; // do not retry
+    }
+    CompilerProbe& probe = m_CompilerProbes[probeId];
+    probe.process = process;
+    probe.key = key;
+    probe.cfgPath = cfgPath;
+    probe.targetFlags = targetFlags;
+    if (!m_ProbeTimer.IsRunning())
+        m_ProbeTimer.Start(PROBE_POLL_DELAY, wxTIMER_ONE_SHOT);
+    return wxEmptyString;
+}
 
-    wxArrayString::const_iterator errItr = errors.begin();
-    for (; errItr != errors.end(); ++errItr)
+void ClangPlugin::DrainCompilerProbes()
+{
+    for (std::map<wxString, CompilerProbe>::iterator prbItr = m_CompilerProbes.begin();
+         prbItr != m_CompilerProbes.end(); ++prbItr)
     {
-        if (errItr->IsSameAs(wxT("#include <...> search starts here:")))
-        {
-            ++errItr;
-            break;
-        }
+        ReadProcessStream(prbItr->second.process->GetInputStream(), prbItr->second.output);
+        ReadProcessStream(prbItr->second.process->GetErrorStream(), prbItr->second.errors);
     }
-    wxString includeDirs;
-    for (; errItr != errors.end(); ++errItr)
+}
+
+void ClangPlugin::OnCompilerProbeEnd(wxProcessEvent& event)
+{
+    std::map<wxString, CompilerProbe>::iterator prbItr = m_CompilerProbes.begin();
+    while (prbItr != m_CompilerProbes.end() && prbItr->second.process->GetPid() != event.GetPid())
+        ++prbItr;
+    if (prbItr == m_CompilerProbes.end())
     {
-        if (errItr->IsSameAs(wxT("End of search list.")))
+        event.Skip();
+        return;
+    }
+    CompilerProbe& probe = prbItr->second;
+    ReadProcessStream(probe.process->GetInputStream(), probe.output);
+    ReadProcessStream(probe.process->GetErrorStream(), probe.errors);
+    // wx still uses the process after this handler returns
+    m_FinishedProbes.push_back(probe.process);
+    if (!m_ProbeTimer.IsRunning())
+        m_ProbeTimer.Start(PROBE_POLL_DELAY, wxTIMER_ONE_SHOT);
+
+    wxString flags;
+    wxStringTokenizer errors(wxString(probe.errors.c_str(), wxConvLocal), wxT("\r\n"));
+    bool inSearchList = false;
+    while (errors.HasMoreTokens())
+    {
+        const wxString& line = errors.GetNextToken();
+        if (line.IsSameAs(wxT("#include <...> search starts here:")))
+            inSearchList = true;
+        else if (line.IsSameAs(wxT("End of search list.")))
             break;
-        includeDirs += wxT(" -I") + errItr->Strip(wxString::both);
+        else if (inSearchList)
+            flags += wxT(" -I") + line.Strip(wxString::both);
     }
-    return m_compInclDirs.insert(std::pair<wxString, wxString>(compId, includeDirs)).first->second;
+    // only what clang leaves out for this target; its own values match its code generation
+    std::set<wxString> predefined;
+    m_Proxy.GetPredefinedMacros(probe.targetFlags, predefined);
+    wxStringTokenizer output(wxString(probe.output.c_str(), wxConvLocal), wxT("\r\n"));
+    while (output.HasMoreTokens())
+    {
+        wxString define;
+        if (!output.GetNextToken().StartsWith(wxT("#define "), &define))
+            continue;
+        const wxString& name = define.BeforeFirst(wxT(' '));
+        const wxString& value = define.AfterFirst(wxT(' '));
+        // flags are split at spaces; function-like macros cannot be passed with -D
+        if (   name.Find(wxT('(')) != wxNOT_FOUND || value.Find(wxT(' ')) != wxNOT_FOUND
+            || value.Find(wxT('"')) != wxNOT_FOUND || IsCompilerIdentityMacro(name) )
+        {
+            continue;
+        }
+        if (predefined.empty() || predefined.find(name) != predefined.end())
+            continue; // set by clang (or its list is unavailable, and any define could clash)
+        flags += wxT(" -D") + name + wxT('=') + value;
+    }
+
+    const wxString probeId = prbItr->first;
+    ConfigManager* cfg = Manager::Get()->GetConfigManager(wxT("clanglib"));
+    cfg->Write(probe.cfgPath + wxT("/key"), probe.key);
+    cfg->Write(probe.cfgPath + wxT("/flags"), flags);
+    m_compInclDirs[probeId] = flags;
+    Manager::Get()->GetLogManager()->DebugLog(wxT("ClangLib: probed compiler ") + probeId.BeforeFirst(wxT('\t'))
+                                              + wxT(" for ") + probe.targetFlags);
+    m_CompilerProbes.erase(prbItr);
+    if (!m_CompilerProbes.empty())
+        return;
+
+    // everything that waited for the probes
+    cbEditor* ed = Manager::Get()->GetEditorManager()->GetBuiltinActiveEditor();
+    if (ed && IsProviderFor(ed))
+        UpdateCompileCommand(ed);
+    cbProject* project = Manager::Get()->GetProjectManager()->GetActiveProject();
+    if (project && project->GetFilename() == m_IndexerProject)
+        StartIndexer(project); // the shared PCHs are analysed with complete flags now
 }
 
 wxString ClangPlugin::GetSourceOf(cbEditor* ed)
@@ -780,9 +1259,15 @@ bool ClangPlugin::IsSourceOf(const wxFileName& candidateFile,
 //      ClangPlugin::OnEditorHook
 //      ClangPlugin::OnTimer
 void ClangPlugin::UpdateCompileCommand(cbEditor* ed)
+{
+    // without the shared PCH, whose use changes with the state of its headers
+    m_CompileCommand = GetCompileCommand(ed->GetProjectFile(), ed->GetFilename());
+}
+
+wxString ClangPlugin::GetCompileCommand(ProjectFile* pf, const wxString& filename, bool addCompilerInclDirs,
+                                        bool useCompilationDb)
 {
     wxString compileCommand;
-    ProjectFile* pf = ed->GetProjectFile();
 
     ProjectBuildTarget* target = nullptr;
     Compiler* comp = nullptr;
@@ -803,6 +1288,10 @@ void ClangPlugin::UpdateCompileCommand(cbEditor* ed)
     if (!comp)
         comp = CompilerFactory::GetDefaultCompiler();
 
+    // trust the build system over flags re-derived from the project
+    if (useCompilationDb && m_CompilationDb.GetCommand(filename, compileCommand))
+        return (addCompilerInclDirs ? compileCommand + wxT(" ") + GetCompilerInclDirs(comp->GetID(), GetTargetFlags(compileCommand, filename)) : compileCommand);
+
     if (pf && (!pf->GetBuildTargets().IsEmpty()))
     {
         target = pf->GetParentProject()->GetBuildTarget(pf->GetBuildTargets()[0]);
@@ -814,7 +1303,7 @@ void ClangPlugin::UpdateCompileCommand(cbEditor* ed)
     if (compileCommand.IsEmpty())
         compileCommand = wxT("$options $includes");
     CompilerCommandGenerator* gen = comp->GetCommandGenerator(proj);
-    gen->GenerateCommandLine(compileCommand, target, pf, ed->GetFilename(),
+    gen->GenerateCommandLine(compileCommand, target, pf, filename,
                              g_InvalidStr, g_InvalidStr, g_InvalidStr);
     delete gen;
 
@@ -833,9 +1322,117 @@ void ClangPlugin::UpdateCompileCommand(cbEditor* ed)
         }
         compileCommand += flag + wxT(" ");
     }
-    compileCommand += GetCompilerInclDirs(comp->GetID());
+    if (addCompilerInclDirs)
+        compileCommand += GetCompilerInclDirs(comp->GetID(), GetTargetFlags(compileCommand, filename));
+    return compileCommand;
+}
+
+void ClangPlugin::LoadCompilationDatabase(cbProject* project)
+{
+    m_CompilationDb.Clear();
+    if (!project)
+        return;
+    // CMake writes it to the build directory; commonly also symlinked to the source root
+    const wxString candidates[] = { wxT(""), wxT("build/") };
+    for (size_t i = 0; i < WXSIZEOF(candidates); ++i)
+    {
+        const wxString& dbFile = project->GetBasePath() + candidates[i] + wxT("compile_commands.json");
+        if (wxFileExists(dbFile) && m_CompilationDb.Load(dbFile))
+            break;
+    }
+    if (!m_CompilationDb.IsEmpty())
+        Manager::Get()->GetLogManager()->DebugLog(wxT("ClangLib: using ") + m_CompilationDb.GetSource());
+}
 
-    m_CompileCommand = compileCommand;
+void ClangPlugin::StartIndexer(cbProject* project)
+{
+    m_IndexerQueue.clear();
+    m_IndexerTotal = 0;
+    m_IndexerProject.Empty();
+    m_IndexerFiles.clear();
+    ConfigManager* cfg = Manager::Get()->GetConfigManager(wxT("clanglib"));
+    if (!project || !cfg->ReadBool(wxT("/background_indexer"), true))
+        return;
+    m_IndexerProject = project->GetFilename();
+    // go to definition works before the indexer reaches the defining file
+    m_Database.LoadDefinitions(GetDefinitionsFile(m_IndexerProject), m_IndexerProject);
+
+    wxStringVec sources;
+    for (FilesList::iterator fileItr = project->GetFilesList().begin();
+         fileItr != project->GetFilesList().end(); ++fileItr)
+    {
+        if ((*fileItr)->compile && FileTypeOf((*fileItr)->relativeFilename) == ftSource)
+            sources.push_back((*fileItr)->file.GetFullPath());
+        else // headers and the like
+            m_IndexerFiles.insert(m_Database.GetFilenameId((*fileItr)->file.GetFullPath()));
+    }
+    m_CompilationDb.GetFiles(sources);
+    for (wxStringVec::const_iterator srcItr = sources.begin(); srcItr != sources.end(); ++srcItr)
+        m_IndexerFiles.insert(m_Database.GetFilenameId(*srcItr));
+    const std::set<wxString> projectSources(sources.begin(), sources.end());
+
+    m_PchCache.Clear();
+    if (cfg->ReadBool(wxT("/shared_pch"), true))
+    {
+        // built by the indexer, before the sources that use it
+        std::vector< std::pair<wxString, wxString> > sourceFlags;
+        for (std::set<wxString>::const_iterator srcItr = projectSources.begin(); srcItr != projectSources.end(); ++srcItr)
+            sourceFlags.push_back(std::make_pair(*srcItr, GetCompileCommand(project->GetFileByFilename(*srcItr, false), *srcItr)));
+        // otherwise the flags are incomplete; analysed again once the compiler probe finishes
+        if (m_CompilerProbes.empty())
+        {
+            m_PchCache.Analyse(sourceFlags);
+            UpdatePchFlags(); // units of the sources created before adopt PCHs of the previous session
+        }
+    }
+
+    // priority order: active editor, other open editors, recently used, left over
+    // from the previous session, then the rest
+    wxStringVec candidates;
+    EditorManager* edMgr = Manager::Get()->GetEditorManager();
+    cbEditor* activeEd = edMgr->GetBuiltinActiveEditor();
+    if (activeEd)
+        candidates.push_back(activeEd->GetFilename());
+    for (int i = 0; i < edMgr->GetEditorsCount(); ++i)
+    {
+        cbEditor* ed = edMgr->GetBuiltinEditor(i);
+        if (ed && ed != activeEd)
+            candidates.push_back(ed->GetFilename());
+    }
+    candidates.insert(candidates.end(), m_RecentFiles.begin(), m_RecentFiles.end());
+    if (cfg->Read(wxT("/indexer/project")) == m_IndexerProject)
+    {
+        const wxArrayString& pending = cfg->ReadArrayString(wxT("/indexer/pending"));
+        candidates.insert(candidates.end(), pending.begin(), pending.end());
+    }
+    candidates.insert(candidates.end(), sources.begin(), sources.end());
+
+    std::set<wxString> queued;
+    for (wxStringVec::const_iterator fileItr = candidates.begin(); fileItr != candidates.end(); ++fileItr)
+    {
+        if (projectSources.count(*fileItr) && queued.insert(*fileItr).second)
+            m_IndexerQueue.push_back(*fileItr);
+    }
+    m_IndexerTotal = m_IndexerQueue.size();
+    if (!m_IndexerQueue.empty())
+        m_IndexerTimer.Start(INDEXER_DELAY, wxTIMER_ONE_SHOT);
+}
+
+void ClangPlugin::SaveIndexerState()
+{
+    ConfigManager* cfg = Manager::Get()->GetConfigManager(wxT("clanglib"));
+    wxArrayString recent;
+    for (wxStringVec::const_iterator fileItr = m_RecentFiles.begin(); fileItr != m_RecentFiles.end(); ++fileItr)
+        recent.Add(*fileItr);
+    cfg->Write(wxT("/indexer/recent_files"), recent);
+    if (m_IndexerProject.IsEmpty())
+        return;
+    wxArrayString pending;
+    for (wxStringVec::const_iterator fileItr = m_IndexerQueue.begin(); fileItr != m_IndexerQueue.end(); ++fileItr)
+        pending.Add(*fileItr);
+    cfg->Write(wxT("/indexer/project"), m_IndexerProject);
+    cfg->Write(wxT("/indexer/pending"), pending);
+    m_Database.SaveDefinitions(GetDefinitionsFile(m_IndexerProject), m_IndexerProject, m_IndexerFiles);
 }
 
 void ClangPlugin::OnTimer(wxTimerEvent& event)
@@ -845,7 +1442,7 @@ void ClangPlugin::OnTimer(wxTimerEvent& event)
     const int evId = event.GetId();
     if (evId == idEdOpenTimer) // m_EdOpenTimer
     {
-        if (m_CompileCommand.IsEmpty())
+        if (m_CompileCommand.IsEmpty() || !m_CompilerProbes.empty())
         {
             m_EdOpenTimer.Start(ED_OPEN_DELAY, wxTIMER_ONE_SHOT); // retry later
             return;
@@ -864,12 +1461,12 @@ void ClangPlugin::OnTimer(wxTimerEvent& event)
             const wxString& source = GetSourceOf(ed);
             if (!source.IsEmpty())
             {
-                m_Proxy.CreateTranslationUnit(source, m_CompileCommand);
+                m_Proxy.CreateTranslationUnit(source, m_CompileCommand + m_PchCache.GetIncludeFlags(source));
                 if (m_Proxy.GetTranslationUnitId(ed->GetFilename()) != wxNOT_FOUND)
                     return; // got it
             }
         }
-        m_Proxy.CreateTranslationUnit(ed->GetFilename(), m_CompileCommand);
+        m_Proxy.CreateTranslationUnit(ed->GetFilename(), m_CompileCommand + m_PchCache.GetIncludeFlags(ed->GetFilename()));
         m_DiagnosticTimer.Start(DIAGNOSTIC_DELAY, wxTIMER_ONE_SHOT);
     }
     else if (evId == idReparseTimer) // m_ReparseTimer
@@ -885,18 +1482,187 @@ void ClangPlugin::OnTimer(wxTimerEvent& event)
         }
         if (m_TranslUnitId == wxNOT_FOUND)
             return;
-        std::map<wxString, wxString> unsavedFiles;
-        for (int i = 0; i < edMgr->GetEditorsCount(); ++i)
+        ClUnsavedBuffers unsavedFiles;
+        GetUnsavedFiles(m_TranslUnitId, unsavedFiles);
+        const ReparseStatus status = m_Proxy.Reparse(m_TranslUnitId, unsavedFiles);
+        if (status == rsFailed) // the markup of the last good parse no longer matches the text
+            DiagnoseEd(m_pLastEditor, dlClear);
+        else if (status == rsReparsed)
+        {
+            DiagnoseEd(m_pLastEditor, dlMinimal);
+            m_SemanticCurrent.clear();
+            m_SemanticTimer.Start(SEMANTIC_DELAY, wxTIMER_ONE_SHOT);
+            m_HightlightTimer.Start(HIGHTLIGHT_DELAY, wxTIMER_ONE_SHOT);
+            // other units including this file (if it is a header) catch up in the background
+            QueueDependentReparse(m_pLastEditor->GetFilename());
+        }
+    }
+    else if (evId == idBgReparseTimer) // m_BgReparseTimer
+    {
+        if (m_BgReparseQueue.empty())
+            return;
+        if (m_ReparseTimer.IsRunning())
+        {
+            // the user is typing; the active unit goes first
+            m_BgReparseTimer.Start(BG_REPARSE_DELAY, wxTIMER_ONE_SHOT);
+            return;
+        }
+        const int translId = m_BgReparseQueue.front();
+        m_BgReparseQueue.erase(m_BgReparseQueue.begin());
+        // the active unit is already current; disposed units reparse on next use anyway
+        if (translId != m_TranslUnitId && m_Proxy.IsTranslationUnitLoaded(translId))
+        {
+            ClUnsavedBuffers unsavedFiles;
+            GetUnsavedFiles(translId, unsavedFiles);
+            // files on disk may have changed, so do not trust the buffer hashes
+            m_Proxy.Reparse(translId, unsavedFiles, true);
+        }
+        if (!m_BgReparseQueue.empty())
+            m_BgReparseTimer.Start(BG_REPARSE_DELAY, wxTIMER_ONE_SHOT);
+    }
+    else if (evId == idIndexerTimer) // m_IndexerTimer
+    {
+        bool collected = false;
+        wxString indexed;
+        while (m_Proxy.FinishIndexing(indexed))
+        {
+            collected = true;
+            std::map<wxString, wxString>::iterator pchItr = m_IndexerPchFlags.find(indexed);
+            wxString indexerPchFlags;
+            if (pchItr != m_IndexerPchFlags.end())
+            {
+                indexerPchFlags = pchItr->second;
+                m_IndexerPchFlags.erase(pchItr);
+            }
+            // the PCH may have become unusable (or usable) while the worker parsed
+            const wxString& pchFlags = m_PchCache.GetIncludeFlags(indexed);
+            if (pchFlags != indexerPchFlags)
+            {
+                if (indexerPchFlags.IsEmpty())
+                    m_Proxy.AppendCommandFlags(std::vector<wxString>(1, indexed), pchFlags);
+                else
+                    m_Proxy.ReplaceCommandFlags(indexerPchFlags, pchFlags);
+            }
+        }
+        wxString pchFile;
+        bool success;
+        std::vector<wxString> dependencies;
+        while (m_Proxy.FinishPrecompiling(pchFile, success, dependencies))
+        {
+            m_PchCache.SetBuilt(pchFile, success, dependencies);
+            UpdatePchFlags();
+            collected = true;
+        }
+        const int pollDelay = (m_Proxy.IsReceiving() ? INDEXER_RECEIVE_DELAY : INDEXER_POLL_DELAY);
+        // sources wait for the shared header they may use
+        if (m_Proxy.IsPrecompiling() || !m_Proxy.HasIdleWorker())
+        {
+            m_IndexerTimer.Start(pollDelay, wxTIMER_ONE_SHOT);
+            return;
+        }
+        if (!m_IndexerQueue.empty() || !m_ReindexQueue.empty() || m_PchCache.HasStale())
+        {
+            if (   m_ReparseTimer.IsRunning() || m_EdOpenTimer.IsRunning() || !m_CompilerProbes.empty()
+                || wxGetLocalTimeMillis() - m_LastEditTime < INDEXER_IDLE_DELAY )
+            {
+                // the editor in front of the user goes first
+                m_IndexerTimer.Start(m_Proxy.IsIndexing() ? pollDelay : INDEXER_IDLE_DELAY, wxTIMER_ONE_SHOT);
+                return;
+            }
+            wxString header, flags;
+            // shared headers first, so the sources parsed next can use them; also while
+            // indexing is deferred, as units parse without them until they are rebuilt
+            if (m_PchCache.GetStale(header, flags, pchFile))
+            {
+                if (!m_Proxy.StartPrecompiling(header, flags, pchFile))
+                    m_PchCache.SetBuilt(pchFile, false, std::vector<wxString>());
+                m_IndexerTimer.Start(INDEXER_POLL_DELAY, wxTIMER_ONE_SHOT);
+                return;
+            }
+            if (IsIndexingDeferred())
+            {
+                SetIndexerStatus(_("ClangLib: indexing paused"));
+                m_IndexerTimer.Start(m_Proxy.IsIndexing() ? pollDelay : INDEXER_PAUSE_DELAY, wxTIMER_ONE_SHOT);
+                return;
+            }
+            if (!m_ReindexQueue.empty()) // saved files first, so their tokens are current
+            {
+                const int translId = m_ReindexQueue.front();
+                m_ReindexQueue.erase(m_ReindexQueue.begin());
+                if (m_Proxy.StartIndexing(translId))
+                {
+                    m_IndexerTimer.Start(INDEXER_POLL_DELAY, wxTIMER_ONE_SHOT);
+                    return;
+                }
+            }
+            else
+            {
+                const wxString filename = m_IndexerQueue.front();
+                m_IndexerQueue.erase(m_IndexerQueue.begin());
+                cbProject* proj = Manager::Get()->GetProjectManager()->GetActiveProject();
+                ProjectFile* pf = (proj ? proj->GetFileByFilename(filename, false) : nullptr);
+                // parsed by a worker; collected on a later tick
+                const wxString& pchFlags = m_PchCache.GetIncludeFlags(filename);
+                if (   m_Proxy.GetTranslationUnitId(filename) == wxNOT_FOUND && wxFileExists(filename)
+                    && m_Proxy.StartIndexing(filename, GetCompileCommand(pf, filename) + pchFlags) )
+                {
+                    m_IndexerPchFlags[filename] = pchFlags;
+                    SetIndexerStatus(wxString::Format(_("ClangLib: indexing %lu/%lu"),
+                                                      static_cast<unsigned long>(m_IndexerTotal - m_IndexerQueue.size()),
+                                                      static_cast<unsigned long>(m_IndexerTotal)));
+                    m_IndexerTimer.Start(INDEXER_POLL_DELAY, wxTIMER_ONE_SHOT);
+                    return;
+                }
+            }
+        }
+        else if (m_Proxy.IsIndexing()) // the last files
+        {
+            m_IndexerTimer.Start(pollDelay, wxTIMER_ONE_SHOT);
+            return;
+        }
+        else if (!collected)
+            return; // idle
+        if (m_IndexerQueue.empty() && m_ReindexQueue.empty() && !m_Proxy.IsIndexing())
         {
-            ed = edMgr->GetBuiltinEditor(i);
-            if (ed && ed->GetModified())
-                unsavedFiles.insert(std::make_pair(ed->GetFilename(), ed->GetControl()->GetText()));
+            SetIndexerStatus(wxString::Format(_("ClangLib: indexed %lu files"), static_cast<unsigned long>(m_IndexerTotal)));
+            SaveIndexerState();
+            m_Proxy.StopWorkers(); // returns what libclang held on to
         }
-        m_Proxy.Reparse(m_TranslUnitId, unsavedFiles);
-        DiagnoseEd(m_pLastEditor, dlMinimal);
+        else
+            m_IndexerTimer.Start(INDEXER_DELAY, wxTIMER_ONE_SHOT);
+    }
+    else if (evId == idDocPrefetchTimer) // m_DocPrefetchTimer
+    {
+        if (m_DocPrefetchQueue.empty() || m_TranslUnitId == wxNOT_FOUND)
+            return;
+        // the result lands in the documentation cache of the unit
+        m_Proxy.DocumentCCToken(m_TranslUnitId, m_DocPrefetchQueue.front());
+        m_DocPrefetchQueue.erase(m_DocPrefetchQueue.begin());
+        if (!m_DocPrefetchQueue.empty())
+            m_DocPrefetchTimer.Start(DOC_PREFETCH_DELAY, wxTIMER_ONE_SHOT);
+    }
+    else if (evId == idProbeTimer) // m_ProbeTimer
+    {
+        for (size_t i = 0; i < m_FinishedProbes.size(); ++i)
+            delete m_FinishedProbes[i];
+        m_FinishedProbes.clear();
+        DrainCompilerProbes();
+        if (!m_CompilerProbes.empty())
+            m_ProbeTimer.Start(PROBE_POLL_DELAY, wxTIMER_ONE_SHOT);
+    }
+    else if (evId == idRefineTimer) // m_RefineTimer
+    {
+        if (m_RefineQueue.empty())
+            return;
+        // only warms the cache; what is already refined costs next to nothing to repeat
+        std::vector<int> tknTypes(m_RefineQueue.size(), tcNone);
+        if (m_Proxy.RefineTokenTypes(m_RefineTranslId, m_RefineQueue, tknTypes, REFINE_LOOKUP_LIMIT) > 0)
+            m_RefineTimer.Start(REFINE_DELAY, wxTIMER_ONE_SHOT);
+        else
+            m_RefineQueue.clear();
     }
-    // m_DiagnosticTimer, m_HightlightTime
-    else if (evId == idDiagnosticTimer || evId == idHightlightTimer)
+    // m_DiagnosticTimer, m_HightlightTimer, m_SemanticTimer
+    else if (evId == idDiagnosticTimer || evId == idHightlightTimer || evId == idSemanticTimer)
     {
         cbEditor* ed = Manager::Get()->GetEditorManager()->GetBuiltinActiveEditor();
         if (!ed)
@@ -909,7 +1675,15 @@ void ClangPlugin::OnTimer(wxTimerEvent& event)
         if (m_TranslUnitId == wxNOT_FOUND)
             return;
         if (evId == idDiagnosticTimer)
+        {
             DiagnoseEd(ed, dlFull);
+            HighlightSemantics(ed);
+        }
+        // offsets are into the last parsed buffer; wait for the pending reparse, which restarts these
+        else if (m_ReparseTimer.IsRunning())
+            return;
+        else if (evId == idSemanticTimer)
+            HighlightSemantics(ed);
         else
             HighlightOccurrences(ed);
     }
@@ -920,6 +1694,14 @@ void ClangPlugin::OnTimer(wxTimerEvent& event)
 void ClangPlugin::OnEditorHook(cbEditor* ed, wxScintillaEvent& event)
 {
     event.Skip();
+    if (   event.GetEventType() == wxEVT_SCI_MODIFIED
+        && (event.GetModificationType() & (wxSCI_MOD_INSERTTEXT | wxSCI_MOD_DELETETEXT)) )
+    {
+        DropSnapshot(ed->GetFilename()); // any file may be included by a unit
+        // libclang rejects a PCH whose input is remapped to an unsaved buffer
+        if (m_PchCache.FileChanged(ed->GetFilename(), true))
+            UpdatePchFlags();
+    }
     if (!IsProviderFor(ed))
         return;
     if (event.GetEventType() == wxEVT_SCI_MODIFIED)
@@ -928,6 +1710,7 @@ void ClangPlugin::OnEditorHook(cbEditor* ed, wxScintillaEvent& event)
         {
             m_ReparseTimer.Start(REPARSE_DELAY, wxTIMER_ONE_SHOT);
             m_DiagnosticTimer.Start(DIAGNOSTIC_DELAY, wxTIMER_ONE_SHOT);
+            m_LastEditTime = wxGetLocalTimeMillis();
         }
     }
     else if (event.GetEventType() == wxEVT_SCI_UPDATEUI)
@@ -937,15 +1720,96 @@ void ClangPlugin::OnEditorHook(cbEditor* ed, wxScintillaEvent& event)
             m_HightlightTimer.Stop();
             m_HightlightTimer.Start(HIGHTLIGHT_DELAY, wxTIMER_ONE_SHOT);
         }
+        if ((event.GetUpdated() & wxSCI_UPDATE_V_SCROLL) && !m_SemanticTimer.IsRunning())
+            m_SemanticTimer.Start(SEMANTIC_DELAY, wxTIMER_ONE_SHOT);
     }
 }
 
+void ClangPlugin::GetUnsavedFiles(int translId, ClUnsavedBuffers& unsavedFiles)
+{
+    EditorManager* edMgr = Manager::Get()->GetEditorManager();
+    for (int i = 0; i < edMgr->GetEditorsCount(); ++i)
+    {
+        cbEditor* ed = edMgr->GetBuiltinEditor(i);
+        if (!ed || !ed->GetModified())
+            continue;
+        const wxString& filename = ed->GetFilename();
+        if (translId != wxNOT_FOUND && !m_Proxy.TranslationUnitContains(translId, filename))
+            continue; // cannot affect this unit
+        std::map<wxString, ClUnsavedBuffer>::const_iterator snapItr = m_BufferSnapshots.find(filename);
+        if (snapItr == m_BufferSnapshots.end())
+            snapItr = m_BufferSnapshots.insert(std::make_pair(filename, TakeSnapshot(ed))).first;
+        unsavedFiles.insert(*snapItr);
+    }
+}
+
+ClUnsavedBuffer ClangPlugin::TakeSnapshot(cbEditor* ed)
+{
+    cbStyledTextCtrl* stc = ed->GetControl();
+    ClUnsavedBuffer snapshot;
+    snapshot.filename = ed->GetFilename().ToUTF8();
+    if (stc->GetCodePage() == wxSCI_CP_UTF8)
+    {
+        // points into Scintilla's own buffer, valid until the next modification
+        snapshot.contents = stc->GetCharacterPointer();
+        snapshot.length = stc->GetLength();
+    }
+    else // rare; keep a converted copy
+    {
+        std::string& converted = m_ConvertedBuffers[ed->GetFilename()];
+        converted = stc->GetText().ToUTF8();
+        snapshot.contents = converted.c_str();
+        snapshot.length = converted.length();
+    }
+    snapshot.hash = HashBuffer(snapshot.contents, snapshot.length);
+    snapshot.directivesHash = HashDirectives(snapshot.contents, snapshot.length);
+    return snapshot;
+}
+
+void ClangPlugin::DropSnapshot(const wxString& filename)
+{
+    m_BufferSnapshots.erase(filename);
+    m_ConvertedBuffers.erase(filename);
+}
+
+void ClangPlugin::UpdatePchFlags()
+{
+    std::vector<PchCache::FlagsChange> changes;
+    m_PchCache.GetFlagsChanges(changes);
+    for (std::vector<PchCache::FlagsChange>::const_iterator chItr = changes.begin(); chItr != changes.end(); ++chItr)
+    {
+        if (chItr->oldFlags.IsEmpty())
+            m_Proxy.AppendCommandFlags(chItr->sources, chItr->newFlags);
+        else
+            m_Proxy.ReplaceCommandFlags(chItr->oldFlags, chItr->newFlags);
+    }
+}
+
+void ClangPlugin::QueueDependentReparse(const wxString& filename)
+{
+    std::vector<int> translIds;
+    m_Proxy.GetAffectedTranslationUnits(m_Database.GetFilenameId(filename), translIds);
+    // ranked most important first; keep that order behind what is already queued
+    for (std::vector<int>::const_iterator idItr = translIds.begin();
+         idItr != translIds.end(); ++idItr)
+    {
+        if (   *idItr != m_TranslUnitId
+            && std::find(m_BgReparseQueue.begin(), m_BgReparseQueue.end(), *idItr) == m_BgReparseQueue.end() )
+        {
+            m_BgReparseQueue.push_back(*idItr);
+        }
+    }
+    if (!m_BgReparseQueue.empty() && !m_BgReparseTimer.IsRunning())
+        m_BgReparseTimer.Start(BG_REPARSE_DELAY, wxTIMER_ONE_SHOT);
+}
+
 void ClangPlugin::DiagnoseEd(cbEditor* ed, DiagnosticLevel diagLv)
 {
     std::vector<ClDiagnostic> diagnostics;
-    m_Proxy.GetDiagnostics(m_TranslUnitId, diagnostics);
+    if (diagLv != dlClear)
+        m_Proxy.GetDiagnostics(m_TranslUnitId, ed->GetFilename(), diagnostics);
     cbStyledTextCtrl* stc = ed->GetControl();
-    if (diagLv == dlFull)
+    if (diagLv != dlMinimal)
         stc->AnnotationClearAll();
     const int warningIndicator = 0; // predefined
     const int errorIndicator = 15; // hopefully we do not clash with someone else...
@@ -955,13 +1819,10 @@ void ClangPlugin::DiagnoseEd(cbEditor* ed, DiagnosticLevel diagLv)
     stc->IndicatorSetForeground(errorIndicator, *wxRED);
     stc->SetIndicatorCurrent(errorIndicator);
     stc->IndicatorClearRange(0, stc->GetLength());
-    const wxString& fileNm = ed->GetFilename();
     for ( std::vector<ClDiagnostic>::const_iterator dgItr = diagnostics.begin();
           dgItr != diagnostics.end(); ++dgItr )
     {
         //Manager::Get()->GetLogManager()->Log(dgItr->file + wxT(" ") + dgItr->message + F(wxT(" %d, %d"), dgItr->range.first, dgItr->range.second));
-        if (dgItr->file != fileNm)
-            continue;
         if (diagLv == dlFull)
         {
             wxString str = stc->AnnotationGetText(dgItr->line - 1);
@@ -1038,3 +1899,61 @@ void ClangPlugin::HighlightOccurrences(cbEditor* ed)
         stc->IndicatorFillRange(tkn->first, tkn->second);
     }
 }
+
+void ClangPlugin::HighlightSemantics(cbEditor* ed)
+{
+    if (!Manager::Get()->GetConfigManager(wxT("clanglib"))->ReadBool(wxT("/semantic_highlight"), true))
+        return;
+    cbStyledTextCtrl* stc = ed->GetControl();
+    if (ed != m_pSemanticEditor)
+    {
+        m_pSemanticEditor = ed;
+        m_SemanticBlocks.clear();
+        m_SemanticCurrent.clear();
+    }
+
+    // above the indicators of diagnostics and occurrences
+    const int firstIndicator = 17;
+    const int lineCount = stc->GetLineCount();
+    const int firstLine = stc->DocLineFromVisible(stc->GetFirstVisibleLine());
+    const int lastLine = stc->DocLineFromVisible(stc->GetFirstVisibleLine() + stc->LinesOnScreen());
+    const int margin = lastLine - firstLine + 1; // keeps short scrolls from waiting on the timer
+    const int firstBlock = std::max(firstLine - margin, 0) / SEMANTIC_BLOCK_LINES;
+    const int lastBlock = std::min(lastLine + margin, lineCount - 1) / SEMANTIC_BLOCK_LINES;
+    bool stylesSet = false;
+    for (int block = firstBlock; block <= lastBlock; ++block)
+    {
+        if (!m_SemanticCurrent.insert(block).second)
+            continue; // already up to date
+        const int startPos = stc->PositionFromLine(block * SEMANTIC_BLOCK_LINES);
+        const int endLine = (block + 1) * SEMANTIC_BLOCK_LINES;
+        const int endPos = (endLine < lineCount ? stc->PositionFromLine(endLine) : stc->GetLength());
+        std::vector<ClSemanticToken> tokens;
+        m_Proxy.GetSemanticTokens(ed->GetFilename(), startPos, endPos, m_TranslUnitId, tokens);
+        std::vector<ClSemanticToken>& painted = m_SemanticBlocks[block];
+        if (tokens == painted)
+            continue; // typing elsewhere; nothing to repaint
+        if (!stylesSet)
+        {
+            ColourManager* colours = Manager::Get()->GetColourManager();
+            for (int categ = 0; categ < scCount; ++categ)
+            {
+                stc->IndicatorSetStyle(firstIndicator + categ, wxSCI_INDIC_TEXTFORE);
+                stc->IndicatorSetForeground(firstIndicator + categ, colours->GetColour(semanticColours[categ].id));
+            }
+            stylesSet = true;
+        }
+        for (int categ = 0; categ < scCount; ++categ)
+        {
+            stc->SetIndicatorCurrent(firstIndicator + categ);
+            stc->IndicatorClearRange(startPos, endPos - startPos);
+        }
+        for (std::vector<ClSemanticToken>::const_iterator tkn = tokens.begin();
+             tkn != tokens.end(); ++tkn)
+        {
+            stc->SetIndicatorCurrent(firstIndicator + tkn->category);
+            stc->IndicatorFillRange(tkn->offset, tkn->length);
+        }
+        painted.swap(tokens);
+    }
+}
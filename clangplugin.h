@@ -2,13 +2,19 @@
 #define CLANGPLUGIN_H
 
 #include <cbplugin.h>
+#include <set>
 #include <wx/imaglist.h>
+#include <wx/process.h>
 #include <wx/timer.h>
 
 #include "clangproxy.h"
+#include "compilationdatabase.h"
+#include "pchcache.h"
 #include "tokendatabase.h"
 
-class ClangPlugin : public cbCodeCompletionPlugin
+class ProjectFile;
+
+class ClangPlugin : public cbCodeCompletionPlugin, private ClUnsavedFilesProvider
 {
     public:
         ClangPlugin();
@@ -42,12 +48,22 @@ class ClangPlugin : public cbCodeCompletionPlugin
 
     private:
         /**
-         * Compute the locations of STL headers for the given compiler (cached)
+         * Compute the locations of STL headers and the builtin defines for the given compiler
+         *
+         * The compiler is probed in the background the first time for each
+         * target; results are kept in the configuration, keyed by the compiler
+         * binary, its modification time and the probe flags. Only defines
+         * libclang does not set itself for the target are returned.
          *
          * @param compId The id of the compiler
-         * @return Include search flags pointing to said locations
+         * @param targetFlags The flags of the unit that change the predefined macros
+         * @return Include search and define flags (empty while the probe runs)
          */
-        wxString GetCompilerInclDirs(const wxString& compId);
+        wxString GetCompilerInclDirs(const wxString& compId, const wxString& targetFlags);
+        /// Collect the output of a finished compiler probe, and retry what waited for it
+        void OnCompilerProbeEnd(wxProcessEvent& event);
+        /// Read what the running compiler probes wrote so far, so their pipes never fill up
+        void DrainCompilerProbes();
         /**
          * Search for the source file associated with a given header
          *
@@ -78,21 +94,30 @@ class ClangPlugin : public cbCodeCompletionPlugin
         void OnEditorOpen(CodeBlocksEvent& event);
         /// Start up parsing timers
         void OnEditorActivate(CodeBlocksEvent& event);
+        /// Release the snapshot of the editor's buffer
+        void OnEditorClose(CodeBlocksEvent& event);
+        /// Queue reparse of units depending on the saved file
+        void OnEditorSave(CodeBlocksEvent& event);
         /// Make project-dependent setup
         void OnProjectActivate(CodeBlocksEvent& event);
         /// Generic handler for various timers
         void OnTimer(wxTimerEvent& event);
         /// Start re-parse and highlight timers
         void OnEditorHook(cbEditor* ed, wxScintillaEvent& event);
+        /// Write the flags of the active project's sources to its compile_commands.json
+        void OnExportCompileCommands(wxCommandEvent& event);
+        /// Report memory held by each translation unit and the token database
+        void OnShowMemoryStats(wxCommandEvent& event);
         /// Resolve the token under the cursor and open the relevant location
         void OnGotoDeclaration(wxCommandEvent& event);
 
-        enum DiagnosticLevel { dlMinimal, dlFull };
+        enum DiagnosticLevel { dlMinimal, dlFull, dlClear };
         /**
          * Update editor diagnostic mark up
          *
          * @param ed The editor to diagnose
-         * @param diagLv Update only the highlights, or highlights and text annotations
+         * @param diagLv Update only the highlights, or highlights and text annotations,
+         *               or remove both (the unit failed to parse)
          */
         void DiagnoseEd(cbEditor* ed, DiagnosticLevel diagLv);
         /**
@@ -102,8 +127,57 @@ class ClangPlugin : public cbCodeCompletionPlugin
          * @param ed The editor to work in
          */
         void HighlightOccurrences(cbEditor* ed);
+        /**
+         * Colour identifiers by what they refer to, in the visible part of the
+         * editor (plus a screen above and below)
+         *
+         * Works in blocks of lines; a block is only fetched once per reparse,
+         * and only repainted if its tokens changed.
+         *
+         * @param ed The editor to work in
+         */
+        void HighlightSemantics(cbEditor* ed);
 
         void UpdateCompileCommand(cbEditor* ed);
+        /**
+         * Compute the flags to parse a file with
+         *
+         * Taken from the compilation database if it lists the file, otherwise
+         * generated from the project's build options.
+         *
+         * @param pf The project file (may be nullptr)
+         * @param filename The file to be parsed
+         * @param addCompilerInclDirs Append the compiler's built in include paths
+         * @param useCompilationDb Prefer the loaded compilation database, if it lists the file
+         */
+        wxString GetCompileCommand(ProjectFile* pf, const wxString& filename, bool addCompilerInclDirs = true,
+                                   bool useCompilationDb = true);
+        /// Look for compile_commands.json beside the project
+        void LoadCompilationDatabase(cbProject* project);
+        /// Queue all sources of the project for background parsing, most relevant first
+        void StartIndexer(cbProject* project);
+        /// Remember the files not yet indexed, to resume with them next session
+        void SaveIndexerState();
+
+        /**
+         * Collect the contents of modified editors
+         *
+         * Snapshots are reused until the editor is modified again.
+         *
+         * @param translId Only collect files this unit includes (wxNOT_FOUND for all)
+         * @param[out] unsavedFiles The buffers, by filename
+         */
+        virtual void GetUnsavedFiles(int translId, ClUnsavedBuffers& unsavedFiles);
+        ClUnsavedBuffer TakeSnapshot(cbEditor* ed);
+        void DropSnapshot(const wxString& filename);
+        /// Move translation units on to (or off) the shared PCHs they may use now
+        void UpdatePchFlags();
+        /**
+         * Schedule a background reparse of the loaded translation units (other
+         * than the active one) that include the file, found through the
+         * include graph
+         */
+        void QueueDependentReparse(const wxString& filename);
 
         TokenDatabase m_Database;
         wxStringVec m_CppKeywords;
@@ -113,7 +187,46 @@ class ClangPlugin : public cbCodeCompletionPlugin
         wxTimer m_ReparseTimer;
         wxTimer m_DiagnosticTimer;
         wxTimer m_HightlightTimer;
+        wxTimer m_BgReparseTimer;
+        std::vector<int> m_BgReparseQueue;
+        wxTimer m_IndexerTimer;
+        wxStringVec m_IndexerQueue;
+        std::vector<int> m_ReindexQueue; // units whose file was saved, to harvest again
+        std::map<wxString, wxString> m_IndexerPchFlags; // the shared PCH each file being indexed was given
+        size_t m_IndexerTotal;
+        wxString m_IndexerProject;
+        std::set<FileId> m_IndexerFiles; // of m_IndexerProject, whose definitions are saved with it
+        wxStringVec m_RecentFiles;
+        wxLongLong m_LastEditTime;
+        wxTimer m_RefineTimer;
+        std::vector<int> m_RefineQueue; // completion results of m_RefineTranslId still to refine
+        int m_RefineTranslId;
+        wxTimer m_DocPrefetchTimer;
+        std::vector<int> m_DocPrefetchQueue;
+        std::vector<int> m_CCDisplayOrder; // ids of the last completion tokens, as the list shows them
+        wxTimer m_SemanticTimer;
+        cbEditor* m_pSemanticEditor;
+        std::map< int, std::vector<ClSemanticToken> > m_SemanticBlocks; // tokens painted, by block of lines
+        std::set<int> m_SemanticCurrent; // blocks checked since the last reparse
+        CompilationDatabase m_CompilationDb;
+        PchCache m_PchCache;
+        std::map<wxString, ClUnsavedBuffer> m_BufferSnapshots;
+        std::map<wxString, std::string> m_ConvertedBuffers; // for editors not in UTF-8
         std::map<wxString, wxString> m_compInclDirs;
+        struct CompilerProbe
+        {
+            CompilerProbe() : process(nullptr) {}
+
+            wxProcess* process;
+            wxString key;       // configuration check, see GetCompilerInclDirs()
+            wxString cfgPath;   // where the result is kept
+            wxString targetFlags;
+            std::string output; // the defines
+            std::string errors; // the search paths
+        };
+        std::map<wxString, CompilerProbe> m_CompilerProbes; // running, by compiler id and target flags
+        std::vector<wxProcess*> m_FinishedProbes; // deleted on the next m_ProbeTimer event
+        wxTimer m_ProbeTimer;
         cbEditor* m_pLastEditor;
         int m_TranslUnitId;
         int m_EditorHookId;
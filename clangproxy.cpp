@@ -6,14 +6,69 @@
 
 #include "clangproxy.h"
 
-#include <wx/tokenzr.h>
+#include <wx/process.h>
+#include <wx/thread.h>
 
 #ifndef CB_PRECOMP
+    #include <logmanager.h>
+
     #include <algorithm>
+    #include <cstring>
+    #include <set>
 #endif // CB_PRECOMP
 
+#include "compilationdatabase.h"
+#include "cppkeywords.h"
 #include "tokendatabase.h"
 #include "translationunit.h"
+#include "workerprotocol.h"
+
+// consecutive failed parses before a unit is left alone
+#define MAX_LOAD_ATTEMPTS 3
+// jobs a worker process runs before it is replaced, returning the memory libclang kept
+#define WORKER_MAX_JOBS 40
+// how many priority points a perfect fuzzy match is worth over the weakest one
+#define FUZZY_WEIGHT_RANGE 40
+
+unsigned HashBuffer(const char* data, size_t length)
+{
+    unsigned hVal = 2166136261u;
+    for (const char* pCh = data; pCh != data + length; ++pCh)
+    {
+        hVal ^= *pCh;
+        hVal *= 16777619u;
+    }
+    return hVal;
+}
+
+unsigned HashDirectives(const char* data, size_t length)
+{
+    unsigned hVal = 2166136261u;
+    bool continued = false; // the previous line was a directive ending in a backslash
+    for (const char* line = data; line != data + length; )
+    {
+        const char* lineEnd = std::find(line, data + length, '\n');
+        const char* pCh = line;
+        while (pCh != lineEnd && (*pCh == ' ' || *pCh == '\t'))
+            ++pCh;
+        if (continued || (pCh != lineEnd && *pCh == '#'))
+        {
+            for (; pCh != lineEnd; ++pCh)
+            {
+                hVal ^= *pCh;
+                hVal *= 16777619u;
+            }
+            hVal ^= '\n';
+            hVal *= 16777619u;
+            const char* last = lineEnd;
+            if (last != line && last[-1] == '\r')
+                --last;
+            continued = (last != line && last[-1] == '\\');
+        }
+        line = (lineEnd == data + length ? lineEnd : lineEnd + 1);
+    }
+    return hVal;
+}
 
 namespace ProxyHelper
 {
@@ -211,23 +266,184 @@ namespace ProxyHelper
             token = resolve;
     }
 
-    static CXVisitorResult ReferencesVisitor(CXClientData context,
-                                             CXCursor WXUNUSED(cursor),
-                                             CXSourceRange range)
+    /// Append what is available from a pipe without blocking
+    static void ReadProcessStream(wxInputStream* stream, std::string& buffer)
+    {
+        char chunk[4096];
+        while (stream && stream->CanRead())
+        {
+            stream->Read(chunk, sizeof(chunk));
+            if (stream->LastRead() == 0)
+                break;
+            buffer.append(chunk, stream->LastRead());
+        }
+    }
+
+    static CXChildVisitResult MacroNameVisitor(CXCursor cursor, CXCursor WXUNUSED(parent), CXClientData client_data)
+    {
+        if (cursor.kind == CXCursor_MacroDefinition)
+        {
+            CXString str = clang_getCursorSpelling(cursor);
+            static_cast<std::set<wxString>*>(client_data)->insert(wxString::FromUTF8(clang_getCString(str)));
+            clang_disposeString(str);
+        }
+        return CXChildVisit_Continue;
+    }
+
+    /// Find the definition of a declaration in the index filled by other units
+    static bool LookupDefinition(CXCursor decl, const TokenDatabase& database,
+                                 wxString& filename, int& line, int& column)
+    {
+        CXString usr = clang_getCursorUSR(decl);
+        const char* usrStr = clang_getCString(usr);
+        FileId fId = wxNOT_FOUND;
+        const bool found = (usrStr && *usrStr && database.GetDefinition(usrStr, fId, line, column));
+        clang_disposeString(usr);
+        if (!found)
+            return false;
+        filename = database.GetFilename(fId);
+        return true;
+    }
+
+    static void LogParseStats(const wxString& filename, const ClParseStats& stats)
     {
-        unsigned rgStart, rgEnd;
-        CXSourceLocation rgLoc = clang_getRangeStart(range);
-        clang_getSpellingLocation(rgLoc, nullptr, nullptr, nullptr, &rgStart);
-        rgLoc = clang_getRangeEnd(range);
-        clang_getSpellingLocation(rgLoc, nullptr, nullptr, nullptr, &rgEnd);
-        if (rgStart != rgEnd)
+        wxString msg = wxString::Format(wxT("ClangLib: parsed %s (%d files, %d cursors, %d new tokens)"),
+                                        filename.c_str(), stats.numFiles, stats.numCursors, stats.numTokens);
+        for (std::vector<ClParsePhase>::const_iterator phItr = stats.phases.begin();
+             phItr != stats.phases.end(); ++phItr)
         {
-            static_cast<std::vector< std::pair<int, int> >*>(context)
-                ->push_back(std::make_pair<int, int>(rgStart, rgEnd - rgStart));
+            if (phItr->cpuTime < 0)
+                msg += wxString::Format(wxT(", %s %ld/? ms"), phItr->name.c_str(), phItr->wallTime);
+            else
+                msg += wxString::Format(wxT(", %s %ld/%ld ms"), phItr->name.c_str(), phItr->wallTime, phItr->cpuTime);
+        }
+        Manager::Get()->GetLogManager()->DebugLog(msg + wxT(" (wall/cpu)"));
+    }
+
+    static void LogParseFailure(const wxString& filename, int errorCode)
+    {
+        wxString reason;
+        switch (errorCode)
+        {
+            case 2: // CXError_Crashed
+                reason = wxT("libclang crashed (recovered)");
+                break;
+            case 3: // CXError_InvalidArguments
+                reason = wxT("invalid arguments");
+                break;
+            case 4: // CXError_ASTReadError
+                reason = wxT("AST read error");
+                break;
+            default: // CXError_Failure
+                reason = wxT("unknown failure");
+                break;
+        }
+        Manager::Get()->GetLogManager()->LogWarning(wxT("ClangLib: parsing ") + filename + wxT(" failed: ") + reason);
+    }
+
+    static bool ResultIndexLess(const std::pair<unsigned, int>& a, const std::pair<unsigned, int>& b)
+    {
+        return a.second < b.second;
+    }
+
+    /// Display string of a completion result: the typed text, and its (shortened) result type
+    static wxString GetCompletionLabel(CXCompletionString token)
+    {
+        const int numChunks = clang_getNumCompletionChunks(token);
+        wxString type;
+        for (int chunkIdx = 0; chunkIdx < numChunks; ++chunkIdx)
+        {
+            CXCompletionChunkKind kind = clang_getCompletionChunkKind(token, chunkIdx);
+            if (kind == CXCompletionChunk_ResultType)
+            {
+                CXString str = clang_getCompletionChunkText(token, chunkIdx);
+                type = wxT(": ") + wxString::FromUTF8(clang_getCString(str));
+                wxString prefix;
+                if (type.EndsWith(wxT(" *"), &prefix) || type.EndsWith(wxT(" &"), &prefix))
+                    type = prefix + type.Last();
+                clang_disposeString(str);
+            }
+            else if (kind == CXCompletionChunk_TypedText)
+            {
+                if (type.Length() > 40)
+                {
+                    type.Truncate(35);
+                    if (wxIsspace(type.Last()))
+                        type.Trim();
+                    else if (wxIspunct(type.Last()))
+                    {
+                        for (int i = type.Length() - 2; i > 10; --i)
+                        {
+                            if (!wxIspunct(type[i]))
+                            {
+                                type.Truncate(i + 1);
+                                break;
+                            }
+                        }
+                    }
+                    else if (wxIsalnum(type.Last()) || type.Last() == wxT('_'))
+                    {
+                        for (int i = type.Length() - 2; i > 10; --i)
+                        {
+                            if (!( wxIsalnum(type[i]) || type[i] == wxT('_') ))
+                            {
+                                type.Truncate(i + 1);
+                                break;
+                            }
+                        }
+                    }
+                    type += wxT("...");
+                }
+                CXString completeTxt = clang_getCompletionChunkText(token, chunkIdx);
+                const wxString& label = wxString::FromUTF8(clang_getCString(completeTxt)) + type;
+                clang_disposeString(completeTxt);
+                return label;
+            }
         }
-        return CXVisit_Continue;
+        return wxEmptyString;
     }
 
+    static bool MemoryStatsGreater(const ClMemoryStats& a, const ClMemoryStats& b)
+    {
+        return a.libclangMemory + a.completionMemory > b.libclangMemory + b.completionMemory;
+    }
+
+    // best candidates first: the unit of the file itself, then loaded units, then those including
+    // the file most directly, then the most recently used
+    struct TranslUnitRanker
+    {
+        TranslUnitRanker(const std::vector<TranslationUnit>& tus, FileId fId) :
+            translUnits(tus), fileId(fId) {}
+
+        bool operator()(int a, int b) const
+        {
+            const TranslationUnit& tuA = translUnits[a];
+            const TranslationUnit& tuB = translUnits[b];
+            if ((tuA.GetFileId() == fileId) != (tuB.GetFileId() == fileId))
+                return tuA.GetFileId() == fileId;
+            if (tuA.IsLoaded() != tuB.IsLoaded())
+                return tuA.IsLoaded();
+            const unsigned depthA = tuA.GetIncludeDepth(fileId);
+            const unsigned depthB = tuB.GetIncludeDepth(fileId);
+            if (depthA != depthB)
+                return depthA < depthB;
+            return tuA.GetLastAccess() > tuB.GetLastAccess();
+        }
+
+        const std::vector<TranslationUnit>& translUnits;
+        FileId fileId;
+    };
+
+    struct TranslUnitDisposed
+    {
+        TranslUnitDisposed(const std::vector<TranslationUnit>& tus) :
+            translUnits(tus) {}
+
+        bool operator()(int translId) const { return !translUnits[translId].IsLoaded(); }
+
+        const std::vector<TranslationUnit>& translUnits;
+    };
+
     static wxString GetEnumValStr(CXCursor token)
     {
         int counts[] = {0, 0, 0}; // (numPowerOf2, numTotal, maxVal)
@@ -271,22 +487,57 @@ namespace HTML_Writer
         return html;
     }
 
-    static wxString Colourise(const wxString& text, const wxString& colour)
+    /// Escape() text[0, length) directly onto the end of html
+    static void AppendEscaped(wxString& html, const wxChar* text, size_t length)
     {
-        return wxT("<font color=\"") + colour + wxT("\">") + text + wxT("</font>");
+        size_t plainStart = 0; // characters needing no escape are appended in runs
+        for (size_t i = 0; i < length; ++i)
+        {
+            const wxChar* entity;
+            switch (text[i])
+            {
+                case wxT('&'):  entity = wxT("&amp;");  break;
+                case wxT('\"'): entity = wxT("&quot;"); break;
+                case wxT('\''): entity = wxT("&apos;"); break;
+                case wxT('<'):  entity = wxT("&lt;");   break;
+                case wxT('>'):  entity = wxT("&gt;");   break;
+                case wxT('\n'): entity = wxT("<br>");   break;
+                default:        continue;
+            }
+            html.append(text + plainStart, i - plainStart);
+            html += entity;
+            plainStart = i + 1;
+        }
+        html.append(text + plainStart, length - plainStart);
     }
 
-    static wxString SyntaxHl(const wxString& code, const std::vector<wxString>& cppKeywords) // C++ style (ish)
+    /// Escape text[0, length) in a font tag of the given colour, onto the end of html
+    static void AppendColoured(wxString& html, const wxChar* text, size_t length, const wxChar* colour)
     {
+        html += wxT("<font color=\"");
+        html += colour;
+        html += wxT("\">");
+        AppendEscaped(html, text, length);
+        html += wxT("</font>");
+    }
+
+    /**
+     * C++ style (ish) highlighting, in a single pass into one buffer
+     *
+     * @param cppKeywords Keywords to emphasize, those of the active colour set (sorted)
+     */
+    static wxString SyntaxHl(const wxString& code, const std::vector<wxString>& cppKeywords)
+    {
+        const int codeLen = code.Length();
+        const wxChar* src = code.c_str(); // no copy (the string outlives it)
         wxString html;
-        html.reserve(code.size());
+        html.reserve(codeLen * 3); // room for a fair amount of markup
         int stRg = 0;
         int style = wxSCI_C_DEFAULT;
-        const int codeLen = code.Length();
         for (int enRg = 0; enRg <= codeLen; ++enRg)
         {
-            wxChar ch = (enRg < codeLen ? code[enRg] : wxT('\0'));
-            wxChar nextCh = (enRg < codeLen - 1 ? code[enRg + 1] : wxT('\0'));
+            wxChar ch = (enRg < codeLen ? src[enRg] : wxT('\0'));
+            wxChar nextCh = (enRg < codeLen - 1 ? src[enRg + 1] : wxT('\0'));
             switch (style)
             {
                 default:
@@ -308,7 +559,7 @@ namespace HTML_Writer
                         break;
                     if (stRg != enRg)
                     {
-                        html += Escape(code.Mid(stRg, enRg - stRg));
+                        AppendEscaped(html, src + stRg, enRg - stRg);
                         stRg = enRg;
                     }
                     break;
@@ -320,11 +571,16 @@ namespace HTML_Writer
                         break;
                     if (stRg != enRg)
                     {
-                        const wxString& tkn = code.Mid(stRg, enRg - stRg);
-                        if (std::binary_search(cppKeywords.begin(), cppKeywords.end(), tkn))
-                            html += wxT("<b>") + Colourise(Escape(tkn), wxT("#00008b")) + wxT("</b>"); // DarkBlue
+                        const wxChar* tkn = src + stRg;
+                        const size_t tknLen = enRg - stRg;
+                        if (CppKeywords::IsKeyword(tkn, tknLen, cppKeywords))
+                        {
+                            html += wxT("<b>");
+                            AppendColoured(html, tkn, tknLen, wxT("#00008b")); // DarkBlue
+                            html += wxT("</b>");
+                        }
                         else
-                            html += Escape(tkn);
+                            AppendEscaped(html, tkn, tknLen);
                         stRg = enRg;
                         --enRg;
                     }
@@ -338,7 +594,7 @@ namespace HTML_Writer
                         break;
                     if (stRg != enRg)
                     {
-                        html += Colourise(Escape(code.Mid(stRg, enRg - stRg)), wxT("Magenta"));
+                        AppendColoured(html, src + stRg, enRg - stRg, wxT("Magenta"));
                         stRg = enRg;
                         --enRg;
                     }
@@ -360,7 +616,7 @@ namespace HTML_Writer
                     {
                         if (ch == wxT('"'))
                             ++enRg;
-                        html += Colourise(Escape(code.Mid(stRg, enRg - stRg)), wxT("#0000cd")); // MediumBlue
+                        AppendColoured(html, src + stRg, enRg - stRg, wxT("#0000cd")); // MediumBlue
                         stRg = enRg;
                         --enRg;
                     }
@@ -382,7 +638,7 @@ namespace HTML_Writer
                     {
                         if (ch == wxT('\''))
                             ++enRg;
-                        html += Colourise(Escape(code.Mid(stRg, enRg - stRg)), wxT("GoldenRod"));
+                        AppendColoured(html, src + stRg, enRg - stRg, wxT("GoldenRod"));
                         stRg = enRg;
                         --enRg;
                     }
@@ -396,7 +652,7 @@ namespace HTML_Writer
                         break;
                     if (stRg != enRg)
                     {
-                        html += Colourise(Escape(code.Mid(stRg, enRg - stRg)), wxT("#778899")); // LightSlateGray
+                        AppendColoured(html, src + stRg, enRg - stRg, wxT("#778899")); // LightSlateGray
                         stRg = enRg;
                     }
                     style = wxSCI_C_DEFAULT;
@@ -409,7 +665,7 @@ namespace HTML_Writer
                         break;
                     if (stRg != enRg)
                     {
-                        html += Colourise(Escape(code.Mid(stRg, enRg - stRg)), wxT("Red"));
+                        AppendColoured(html, src + stRg, enRg - stRg, wxT("Red"));
                         stRg = enRg;
                         --enRg;
                     }
@@ -545,49 +801,821 @@ namespace HTML_Writer
     }
 }
 
+/**
+ * Background work in a libclang index of its own: parsing a translation unit
+ * to record its tokens, or precompiling a header
+ */
+class ClIndexerThread : public wxThread
+{
+    public:
+        ClIndexerThread(TranslationUnit* translUnit, TokenDatabase& database, bool useIndexer) :
+            wxThread(wxTHREAD_JOINABLE),
+            m_pTranslUnit(translUnit),
+            m_Database(database),
+            m_UseIndexer(useIndexer),
+            m_PchBuilt(false)
+        {
+        }
+
+        /// The strings must not share buffers with another thread
+        ClIndexerThread(const wxString& header, const wxString& commands, const wxString& pchFile,
+                        TokenDatabase& database) :
+            wxThread(wxTHREAD_JOINABLE),
+            m_pTranslUnit(nullptr),
+            m_Database(database),
+            m_UseIndexer(false),
+            m_Header(header),
+            m_Commands(commands),
+            m_PchFile(pchFile),
+            m_PchBuilt(false)
+        {
+        }
+
+        bool IsPrecompiling() const { return !m_pTranslUnit; }
+        // results of precompiling; read once the thread finished
+        const wxString& GetPchFile() const { return m_PchFile; }
+        bool IsPchBuilt() const { return m_PchBuilt; }
+        std::vector<wxString>& GetDependencies() { return m_Dependencies; }
+
+    protected:
+        virtual ExitCode Entry()
+        {
+            // neither an index nor an indexing session may be used by two threads at once
+            CXIndex clIndex = clang_createIndex(0, 0);
+            if (m_pTranslUnit)
+            {
+                CXIndexAction clIndexAction = (m_UseIndexer ? clang_IndexAction_create(clIndex) : nullptr);
+                m_pTranslUnit->Index(clIndex, clIndexAction, &m_Database);
+                if (clIndexAction)
+                    clang_IndexAction_dispose(clIndexAction);
+            }
+            else
+                m_PchBuilt = TranslationUnit::Precompile(clIndex, m_Header, m_Commands, m_PchFile, m_Dependencies);
+            clang_disposeIndex(clIndex);
+            return 0;
+        }
+
+    private:
+        TranslationUnit* m_pTranslUnit;
+        TokenDatabase& m_Database; // locks itself
+        bool m_UseIndexer;
+        wxString m_Header;
+        wxString m_Commands;
+        wxString m_PchFile;
+        bool m_PchBuilt;
+        std::vector<wxString> m_Dependencies;
+};
+
+/**
+ * A clangworker process, running one background job at a time; see
+ * clangworker.cpp for the requests it understands
+ *
+ * The wxProcess is only referenced (not derived from), so once Release()d
+ * it deletes itself when the worker exits, whether or not the plugin is
+ * still loaded then.
+ */
+class ClWorkerProcess : public wxEvtHandler
+{
+    public:
+        enum JobKind { jkNone, jkIndex, jkPrecompile };
+
+        ClWorkerProcess() :
+            m_pProcess(nullptr),
+            m_Pid(0),
+            m_Exited(false),
+            m_Job(jkNone),
+            m_NumJobs(0),
+            m_SentClaims(0)
+        {
+            Connect(wxEVT_END_PROCESS, wxProcessEventHandler(ClWorkerProcess::OnEnd));
+        }
+
+        ~ClWorkerProcess()
+        {
+            Release(true);
+        }
+
+        /// @return false if the worker could not be started
+        bool Spawn(const wxString& command)
+        {
+            m_pProcess = new wxProcess(this);
+            m_pProcess->Redirect();
+            m_Pid = wxExecute(command, wxEXEC_ASYNC | wxEXEC_NODISABLE, m_pProcess);
+            if (m_Pid != 0)
+                return true;
+            delete m_pProcess;
+            m_pProcess = nullptr;
+            return false;
+        }
+
+        /**
+         * Hand the worker a job
+         *
+         * @param request The first line of the message, see WorkerProtocol
+         * @param body The lines that follow it
+         * @param filename The file indexed, or the header precompiled
+         * @return false if the worker is busy or gone
+         */
+        bool Send(JobKind job, const wxString& request, const wxString& body, const wxString& filename,
+                  const wxString& commands, const wxString& pchFile = wxEmptyString)
+        {
+            wxOutputStream* stream = (IsIdle() ? m_pProcess->GetOutputStream() : nullptr);
+            if (!stream)
+                return false;
+            const wxCharBuffer buffer = (  request + wxT('\n') + body
+                                         + wxString::FromUTF8(WorkerProtocol::EndOfMessage) + wxT('\n') ).ToUTF8();
+            const size_t length = strlen(buffer.data());
+            // the worker reads the whole message before it writes anything, so this cannot deadlock
+            if (stream->Write(buffer.data(), length).LastWrite() != length)
+                return false;
+            m_Job = job;
+            m_Filename = filename;
+            m_Commands = commands;
+            m_PchFile = pchFile;
+            m_Output.clear();
+            ++m_NumJobs;
+            return true;
+        }
+
+        /// Collect what the worker wrote so far, so its pipes never fill up
+        void Drain()
+        {
+            if (!m_pProcess || m_Exited)
+                return;
+            ProxyHelper::ReadProcessStream(m_pProcess->GetInputStream(), m_Output);
+            std::string errors; // libclang may complain on stderr; nobody reads it
+            ProxyHelper::ReadProcessStream(m_pProcess->GetErrorStream(), errors);
+        }
+
+        /// Has the worker started, but not finished, writing its reply?
+        bool IsReplying() const
+        {
+            return (m_Job != jkNone && !m_Exited && !m_Output.empty() && !IsReplyComplete());
+        }
+
+        /// Is the reply to the current job complete, or will it never be (the worker exited)?
+        bool IsJobDone() const
+        {
+            return (m_Job != jkNone && (m_Exited || IsReplyComplete()));
+        }
+
+        /**
+         * Collect the reply to the job; the worker takes another one after this
+         *
+         * @return false if the worker exited before it completed the reply
+         */
+        bool TakeReply(wxString& reply)
+        {
+            const bool complete = IsReplyComplete();
+            if (complete)
+                m_Output.resize(m_Output.size() - strlen(WorkerProtocol::EndOfMessage) - 1);
+            reply = (complete ? wxString::FromUTF8(m_Output.c_str()) : wxString());
+            m_Output.clear();
+            m_Job = jkNone;
+            return complete;
+        }
+
+        /**
+         * Let the process go; it deletes itself once it exited
+         *
+         * @param kill End it now, instead of once it read the end of its input
+         */
+        void Release(bool kill)
+        {
+            if (!m_pProcess)
+                return;
+            if (m_Exited)
+                delete m_pProcess;
+            else
+            {
+                m_pProcess->CloseOutput();
+                if (kill)
+                    wxProcess::Kill(static_cast<int>(m_Pid), wxSIGKILL);
+                m_pProcess->Detach();
+            }
+            m_pProcess = nullptr;
+        }
+
+        bool IsIdle() const { return (m_pProcess && !m_Exited && m_Job == jkNone); }
+        bool HasExited() const { return m_Exited; }
+        JobKind GetJob() const { return m_Job; }
+        unsigned GetNumJobs() const { return m_NumJobs; }
+        const wxString& GetFilename() const { return m_Filename; }
+        const wxString& GetCommands() const { return m_Commands; }
+        const wxString& GetPchFile() const { return m_PchFile; }
+        /// Claims of the plugin's database the worker was told of, see TokenDatabase::GetIndexedFilesJournal()
+        size_t& GetSentClaims() { return m_SentClaims; }
+
+    private:
+        void OnEnd(wxProcessEvent& WXUNUSED(event))
+        {
+            Drain();
+            m_Exited = true; // wx still uses the process after this handler returns; Release() deletes it
+        }
+
+        /// Does the output end with the end of message line?
+        bool IsReplyComplete() const
+        {
+            const size_t endLen = strlen(WorkerProtocol::EndOfMessage);
+            return (   m_Output.size() > endLen
+                    && m_Output[m_Output.size() - 1] == '\n'
+                    && m_Output.compare(m_Output.size() - endLen - 1, endLen, WorkerProtocol::EndOfMessage) == 0
+                    && (m_Output.size() == endLen + 1 || m_Output[m_Output.size() - endLen - 2] == '\n') );
+        }
+
+        wxProcess* m_pProcess;
+        long m_Pid;
+        bool m_Exited;
+        JobKind m_Job;
+        unsigned m_NumJobs;
+        size_t m_SentClaims;
+        wxString m_Filename;
+        wxString m_Commands;
+        wxString m_PchFile;
+        std::string m_Output; // of the current job
+};
+
 ClangProxy::ClangProxy(TokenDatabase& database, const std::vector<wxString>& cppKeywords):
     m_Database(database),
-    m_CppKeywords(cppKeywords)
+    m_CppKeywords(cppKeywords),
+    m_HarvestMethod(hmVisitor),
+    m_pUnsavedFilesProvider(nullptr),
+    m_pIndexerThread(nullptr),
+    m_pIndexedUnit(nullptr),
+    m_MaxWorkers(0),
+    m_MemoryBudget(0),
+    m_AccessTick(0)
 {
     m_ClIndex = clang_createIndex(0, 0);
+    // only a container for indexing options; one serves all units
+    m_ClIndexAction = clang_IndexAction_create(m_ClIndex);
 }
 
 ClangProxy::~ClangProxy()
 {
+    for (size_t i = 0; i < m_Workers.size(); ++i)
+        delete m_Workers[i]; // kills the process; unlike the thread, it need not be waited for
+    m_Workers.clear();
+    if (m_pIndexerThread)
+    {
+        m_pIndexerThread->Wait(); // libclang cannot be interrupted
+        delete m_pIndexerThread;
+    }
+    delete m_pIndexedUnit;
     m_TranslUnits.clear();
+    clang_IndexAction_dispose(m_ClIndexAction);
     clang_disposeIndex(m_ClIndex);
 }
 
 void ClangProxy::CreateTranslationUnit(const wxString& filename, const wxString& commands)
 {
-    wxStringTokenizer tokenizer(commands);
-    if (!filename.EndsWith(wxT(".c"))) // force language reduces chance of error on STL headers
-        tokenizer.SetString(commands + wxT(" -x c++"));
-    std::vector<wxString> unknownOptions;
-    unknownOptions.push_back(wxT("-Wno-unused-local-typedefs"));
-    unknownOptions.push_back(wxT("-Wzero-as-null-pointer-constant"));
-    std::sort(unknownOptions.begin(), unknownOptions.end());
+    m_TranslUnits.push_back(TranslationUnit(filename, commands));
+    GetTranslationUnit(m_TranslUnits.size() - 1);
+}
+
+bool ClangProxy::StartIndexing(const wxString& filename, const wxString& commands)
+{
+    if (m_MaxWorkers > 0)
+    {
+        ClWorkerProcess* worker = GetIdleWorker();
+        if (worker)
+        {
+            const wxString request = wxT("index\t") + wxString(m_HarvestMethod == hmIndexer ? wxT("1") : wxT("0"))
+                                   + wxT('\t') + WorkerProtocol::Escape(filename)
+                                   + wxT('\t') + WorkerProtocol::Escape(commands);
+            return worker->Send(ClWorkerProcess::jkIndex, request,
+                                m_Database.GetIndexedFilesJournal(worker->GetSentClaims()), filename, commands);
+        }
+        if (m_MaxWorkers > 0) // all busy; otherwise the worker could not be started, use the thread
+            return false;
+    }
+    if (m_pIndexerThread)
+        return false;
+    // deep copies; the worker must not share string buffers with this thread
+    m_pIndexedUnit = new TranslationUnit(wxString(filename.c_str()), wxString(commands.c_str()));
+    m_pIndexerThread = new ClIndexerThread(m_pIndexedUnit, m_Database, m_HarvestMethod == hmIndexer);
+    if (m_pIndexerThread->Create() != wxTHREAD_NO_ERROR || m_pIndexerThread->Run() != wxTHREAD_NO_ERROR)
+    {
+        delete m_pIndexerThread;
+        m_pIndexerThread = nullptr;
+        delete m_pIndexedUnit;
+        m_pIndexedUnit = nullptr;
+        return false;
+    }
+    m_pIndexerThread->SetPriority(WXTHREAD_MIN_PRIORITY);
+    return true;
+}
+
+bool ClangProxy::StartIndexing(int translId)
+{
+    const TranslationUnit& translUnit = m_TranslUnits[translId];
+    return StartIndexing(translUnit.GetFilename(), translUnit.GetCommands());
+}
+
+bool ClangProxy::IsIndexing() const
+{
+    for (size_t i = 0; i < m_Workers.size(); ++i)
+    {
+        if (m_Workers[i]->GetJob() != ClWorkerProcess::jkNone)
+            return true;
+    }
+    return m_pIndexerThread && m_pIndexerThread->IsAlive();
+}
+
+bool ClangProxy::IsReceiving() const
+{
+    for (size_t i = 0; i < m_Workers.size(); ++i)
+    {
+        if (m_Workers[i]->IsReplying())
+            return true;
+    }
+    return false;
+}
+
+bool ClangProxy::HasIdleWorker() const
+{
+    if (m_MaxWorkers == 0)
+        return !m_pIndexerThread;
+    for (size_t i = 0; i < m_Workers.size(); ++i)
+    {
+        if (m_Workers[i]->IsIdle())
+            return true;
+    }
+    return (m_Workers.size() < m_MaxWorkers);
+}
+
+bool ClangProxy::IsPrecompiling() const
+{
+    for (size_t i = 0; i < m_Workers.size(); ++i)
+    {
+        if (m_Workers[i]->GetJob() == ClWorkerProcess::jkPrecompile)
+            return true;
+    }
+    return m_pIndexerThread && m_pIndexerThread->IsPrecompiling();
+}
+
+void ClangProxy::SetWorkers(const wxString& command, unsigned maxWorkers)
+{
+    m_WorkerCommand = command;
+    m_MaxWorkers = (command.IsEmpty() ? 0 : maxWorkers);
+}
+
+void ClangProxy::StopWorkers()
+{
+    for (size_t i = 0; i < m_Workers.size(); )
+    {
+        if (m_Workers[i]->GetJob() != ClWorkerProcess::jkNone)
+        {
+            ++i;
+            continue;
+        }
+        m_Workers[i]->Release(false);
+        delete m_Workers[i];
+        m_Workers.erase(m_Workers.begin() + i);
+    }
+}
+
+ClWorkerProcess* ClangProxy::GetIdleWorker()
+{
+    for (size_t i = 0; i < m_Workers.size(); )
+    {
+        if (m_Workers[i]->IsIdle())
+            return m_Workers[i];
+        if (m_Workers[i]->HasExited() && m_Workers[i]->GetJob() == ClWorkerProcess::jkNone)
+        {
+            delete m_Workers[i]; // died between jobs
+            m_Workers.erase(m_Workers.begin() + i);
+        }
+        else
+            ++i;
+    }
+    if (m_Workers.size() >= m_MaxWorkers)
+        return nullptr;
+    ClWorkerProcess* worker = new ClWorkerProcess();
+    if (!worker->Spawn(m_WorkerCommand))
+    {
+        delete worker;
+        Manager::Get()->GetLogManager()->LogWarning(wxT("ClangLib: could not start ") + m_WorkerCommand
+                                                    + wxT(", parsing in the IDE process instead"));
+        m_MaxWorkers = 0;
+        return nullptr;
+    }
+    m_Workers.push_back(worker);
+    return worker;
+}
+
+ClWorkerProcess* ClangProxy::TakeFinishedWorker(int job)
+{
+    for (size_t i = 0; i < m_Workers.size(); ++i)
+    {
+        ClWorkerProcess* worker = m_Workers[i];
+        worker->Drain();
+        if (worker->GetJob() != job || !worker->IsJobDone())
+            continue;
+        // a worker that crashed is started again for the next job; one that ran
+        // many is replaced, so the memory libclang held on to is returned
+        if (worker->HasExited() || worker->GetNumJobs() >= WORKER_MAX_JOBS)
+            m_Workers.erase(m_Workers.begin() + i);
+        return worker;
+    }
+    return nullptr;
+}
+
+void ClangProxy::ReleaseFinishedWorker(ClWorkerProcess* worker)
+{
+    if (std::find(m_Workers.begin(), m_Workers.end(), worker) != m_Workers.end())
+        return; // still in the pool
+    worker->Release(false);
+    delete worker;
+}
+
+bool ClangProxy::StartPrecompiling(const wxString& header, const wxString& commands, const wxString& pchFile)
+{
+    if (m_MaxWorkers > 0)
+    {
+        ClWorkerProcess* worker = GetIdleWorker();
+        if (worker)
+        {
+            const wxString request = wxT("pch\t") + WorkerProtocol::Escape(header)
+                                   + wxT('\t') + WorkerProtocol::Escape(commands)
+                                   + wxT('\t') + WorkerProtocol::Escape(pchFile);
+            return worker->Send(ClWorkerProcess::jkPrecompile, request, wxEmptyString, header, commands, pchFile);
+        }
+        if (m_MaxWorkers > 0)
+            return false;
+    }
+    if (m_pIndexerThread)
+        return false;
+    m_pIndexerThread = new ClIndexerThread(wxString(header.c_str()), wxString(commands.c_str()),
+                                           wxString(pchFile.c_str()), m_Database);
+    if (m_pIndexerThread->Create() != wxTHREAD_NO_ERROR || m_pIndexerThread->Run() != wxTHREAD_NO_ERROR)
+    {
+        delete m_pIndexerThread;
+        m_pIndexerThread = nullptr;
+        return false;
+    }
+    m_pIndexerThread->SetPriority(WXTHREAD_MIN_PRIORITY);
+    return true;
+}
+
+bool ClangProxy::FinishPrecompiling(wxString& pchFile, bool& success, std::vector<wxString>& dependencies)
+{
+    ClWorkerProcess* worker = TakeFinishedWorker(ClWorkerProcess::jkPrecompile);
+    if (worker)
+    {
+        pchFile = worker->GetPchFile();
+        wxString reply;
+        if (!worker->TakeReply(reply))
+            Manager::Get()->GetLogManager()->LogWarning(wxT("ClangLib: worker crashed precompiling ") + worker->GetFilename());
+        ReleaseFinishedWorker(worker);
+        success = false;
+        dependencies.clear();
+        std::vector<wxString> fields;
+        wxString record;
+        size_t pos = 0;
+        while (WorkerProtocol::NextRecord(reply, pos, record))
+        {
+            WorkerProtocol::SplitRecord(record, fields);
+            if (fields[0] == wxT("B") && fields.size() == 2)
+                success = (fields[1] == wxT("1"));
+            else if (fields[0] == wxT("U") && fields.size() == 2)
+                dependencies.push_back(fields[1]);
+        }
+        Manager::Get()->GetLogManager()->DebugLog(wxString(success ? wxT("ClangLib: built ") : wxT("ClangLib: failed to build ")) + pchFile);
+        return true;
+    }
+    if (!m_pIndexerThread || !m_pIndexerThread->IsPrecompiling() || m_pIndexerThread->IsAlive())
+        return false;
+    m_pIndexerThread->Wait();
+    pchFile = m_pIndexerThread->GetPchFile();
+    success = m_pIndexerThread->IsPchBuilt();
+    dependencies.swap(m_pIndexerThread->GetDependencies());
+    delete m_pIndexerThread;
+    m_pIndexerThread = nullptr;
+    Manager::Get()->GetLogManager()->DebugLog(wxString(success ? wxT("ClangLib: built ") : wxT("ClangLib: failed to build ")) + pchFile);
+    return true;
+}
+
+bool ClangProxy::FinishIndexing(wxString& filename)
+{
+    ClWorkerProcess* worker = TakeFinishedWorker(ClWorkerProcess::jkIndex);
+    if (worker)
+    {
+        filename = worker->GetFilename();
+        TranslationUnit* translUnit = new TranslationUnit(filename, worker->GetCommands());
+        wxString reply;
+        if (!worker->TakeReply(reply))
+            Manager::Get()->GetLogManager()->LogWarning(wxT("ClangLib: worker crashed parsing ") + filename);
+        ReleaseFinishedWorker(worker);
+        // a unit without records reads as a failed parse
+        if (!translUnit->ReadIndexed(reply, &m_Database) || !m_Database.ApplyJournal(reply))
+            Manager::Get()->GetLogManager()->LogWarning(wxT("ClangLib: malformed reply from the worker for ") + filename);
+        AdoptIndexedUnit(translUnit);
+        return true;
+    }
+    if (!m_pIndexerThread || m_pIndexerThread->IsPrecompiling() || m_pIndexerThread->IsAlive())
+        return false;
+    m_pIndexerThread->Wait();
+    delete m_pIndexerThread;
+    m_pIndexerThread = nullptr;
+
+    TranslationUnit* translUnit = m_pIndexedUnit;
+    m_pIndexedUnit = nullptr;
+    filename = translUnit->GetFilename();
+    AdoptIndexedUnit(translUnit);
+    return true;
+}
+
+void ClangProxy::AdoptIndexedUnit(TranslationUnit* translUnit)
+{
+    const wxString& filename = translUnit->GetFilename();
+    if (translUnit->GetErrorCode() != 0)
+        ProxyHelper::LogParseFailure(filename, translUnit->GetErrorCode());
+    else
+        ProxyHelper::LogParseStats(filename, translUnit->GetParseStats());
+    // the tokens are recorded either way; keep the unit only to find it by its files
+    bool keep = (translUnit->GetErrorCode() == 0);
+    for (std::vector<TranslationUnit>::const_iterator tuItr = m_TranslUnits.begin();
+         tuItr != m_TranslUnits.end() && keep; ++tuItr)
+    {
+        keep = (tuItr->GetFileId() != translUnit->GetFileId());
+    }
+    if (keep)
+    {
+#if __cplusplus >= 201103L
+        m_TranslUnits.push_back(std::move(*translUnit));
+#else
+        m_TranslUnits.push_back(*translUnit);
+#endif
+        UpdateFileIndex(m_TranslUnits.size() - 1, std::vector<FileId>(), std::vector< std::pair<FileId, FileId> >());
+    }
+    delete translUnit;
+}
+
+void ClangProxy::SetMemoryBudget(unsigned long budget)
+{
+    m_MemoryBudget = budget;
+}
+
+void ClangProxy::SetHarvestMethod(HarvestMethod method)
+{
+    m_HarvestMethod = method;
+}
+
+void ClangProxy::SetUnsavedFilesProvider(ClUnsavedFilesProvider* provider)
+{
+    m_pUnsavedFilesProvider = provider;
+}
+
+void ClangProxy::ReplaceCommandFlags(const wxString& oldFlags, const wxString& newFlags)
+{
+    for (std::vector<TranslationUnit>::iterator tuItr = m_TranslUnits.begin();
+         tuItr != m_TranslUnits.end(); ++tuItr)
+    {
+        wxString commands = tuItr->GetCommands();
+        if (commands.Replace(oldFlags, newFlags) == 0)
+            continue;
+        tuItr->SetCommands(commands);
+        tuItr->Dispose();
+    }
+}
+
+void ClangProxy::AppendCommandFlags(const std::vector<wxString>& files, const wxString& flags)
+{
+    std::set<FileId> fileIds;
+    for (std::vector<wxString>::const_iterator flItr = files.begin(); flItr != files.end(); ++flItr)
+        fileIds.insert(m_Database.GetFilenameId(*flItr));
+    for (std::vector<TranslationUnit>::iterator tuItr = m_TranslUnits.begin();
+         tuItr != m_TranslUnits.end(); ++tuItr)
+    {
+        if (!fileIds.count(tuItr->GetFileId()) || tuItr->GetCommands().Find(flags) != wxNOT_FOUND)
+            continue;
+        tuItr->SetCommands(tuItr->GetCommands() + flags);
+        tuItr->Dispose();
+    }
+}
+
+void ClangProxy::GetPredefinedMacros(const wxString& commands, std::set<wxString>& names)
+{
+    wxArrayString switches;
+    CompilationDatabase::SplitCommand(commands, switches);
     std::vector<wxCharBuffer> argsBuffer;
     std::vector<const char*> args;
-    while (tokenizer.HasMoreTokens())
+    for (size_t i = 0; i < switches.GetCount(); ++i)
     {
-        const wxString& compilerSwitch = tokenizer.GetNextToken();
-        if (std::binary_search(unknownOptions.begin(), unknownOptions.end(), compilerSwitch))
-            continue;
-        argsBuffer.push_back(compilerSwitch.ToUTF8());
+        argsBuffer.push_back(switches[i].ToUTF8());
         args.push_back(argsBuffer.back().data());
     }
-    m_TranslUnits.push_back(TranslationUnit(filename, args, m_ClIndex, &m_Database));
+    // an empty file; the predefines buffer is all the preprocessing record holds
+    CXUnsavedFile probe;
+    probe.Filename = "clanglib_probe.cpp";
+    probe.Contents = "";
+    probe.Length = 0;
+    CXTranslationUnit clTranslUnit = clang_parseTranslationUnit(m_ClIndex, probe.Filename,
+                                                                args.empty() ? nullptr : &args[0], args.size(),
+                                                                &probe, 1, CXTranslationUnit_DetailedPreprocessingRecord);
+    if (!clTranslUnit)
+        return;
+    clang_visitChildren(clang_getTranslationUnitCursor(clTranslUnit), ProxyHelper::MacroNameVisitor, &names);
+    clang_disposeTranslationUnit(clTranslUnit);
+}
+
+CXIndexAction ClangProxy::GetIndexAction() const
+{
+    return (m_HarvestMethod == hmIndexer ? m_ClIndexAction : nullptr);
+}
+
+TranslationUnit& ClangProxy::GetTranslationUnit(int translId, const ClUnsavedBuffers* unsavedFiles)
+{
+    TranslationUnit& translUnit = m_TranslUnits[translId];
+    translUnit.SetLastAccess(++m_AccessTick);
+    // give up on units that repeatedly fail to parse, until a forced reparse
+    if (!translUnit.IsLoaded() && translUnit.GetLoadFailures() < MAX_LOAD_ATTEMPTS)
+    {
+        // parse what the editors show, not what was last saved
+        ClUnsavedBuffers providedFiles;
+        if (!unsavedFiles)
+        {
+            if (m_pUnsavedFilesProvider)
+            {
+                m_pUnsavedFilesProvider->GetUnsavedFiles(translUnit.GetFiles().empty() ? wxNOT_FOUND : translId,
+                                                         providedFiles);
+            }
+            unsavedFiles = &providedFiles;
+        }
+        std::vector<CXUnsavedFile> clUnsavedFiles;
+        std::map<FileId, unsigned> unsavedHashes, directiveHashes;
+        SelectUnsavedFiles(translUnit, *unsavedFiles, clUnsavedFiles, unsavedHashes, directiveHashes);
+        const std::vector<FileId> oldFiles = translUnit.GetFiles();
+        const std::vector< std::pair<FileId, FileId> > oldEdges = translUnit.GetIncludeEdges();
+        translUnit.Load(m_ClIndex, GetIndexAction(), &m_Database,
+                        clUnsavedFiles.empty() ? nullptr : &clUnsavedFiles[0], clUnsavedFiles.size());
+        // a failed reparse after the first parse still read the includes
+        UpdateFileIndex(translId, oldFiles, oldEdges);
+        if (!translUnit.IsLoaded())
+        {
+            ProxyHelper::LogParseFailure(translUnit.GetFilename(), translUnit.GetErrorCode());
+            return translUnit;
+        }
+        ProxyHelper::LogParseStats(translUnit.GetFilename(), translUnit.GetParseStats());
+        // a first parse was given every buffer; remember only those of files it turned out to include
+        for (std::map<FileId, unsigned>::iterator hsItr = unsavedHashes.begin(); hsItr != unsavedHashes.end(); )
+        {
+            if (translUnit.Contains(hsItr->first))
+                ++hsItr;
+            else
+            {
+                directiveHashes.erase(hsItr->first);
+                unsavedHashes.erase(hsItr++);
+            }
+        }
+        translUnit.SetUnsavedHashes(unsavedHashes, directiveHashes);
+        EnforceMemoryBudget(translId);
+    }
+    return translUnit;
+}
+
+void ClangProxy::EnforceMemoryBudget(int keepTranslId)
+{
+    if (m_MemoryBudget == 0) // unlimited
+        return;
+    unsigned long totalUsage = 0;
+    for (std::vector<TranslationUnit>::const_iterator tuItr = m_TranslUnits.begin();
+         tuItr != m_TranslUnits.end(); ++tuItr)
+    {
+        totalUsage += tuItr->GetMemoryUsage();
+    }
+    while (totalUsage > m_MemoryBudget)
+    {
+        // dispose of the least recently used unit (it will be re-parsed if it is needed again)
+        int lruId = wxNOT_FOUND;
+        for (size_t i = 0; i < m_TranslUnits.size(); ++i)
+        {
+            if (   static_cast<int>(i) != keepTranslId && m_TranslUnits[i].IsLoaded()
+                && (lruId == wxNOT_FOUND || m_TranslUnits[i].GetLastAccess() < m_TranslUnits[lruId].GetLastAccess()) )
+            {
+                lruId = i;
+            }
+        }
+        if (lruId == wxNOT_FOUND)
+            break;
+        totalUsage -= m_TranslUnits[lruId].GetMemoryUsage();
+        m_TranslUnits[lruId].Dispose();
+    }
 }
 
 int ClangProxy::GetTranslationUnitId(FileId fId)
 {
-    for (size_t i = 0; i < m_TranslUnits.size(); ++i)
+    std::vector<int> translIds;
+    GetTranslationUnitIds(fId, translIds);
+    if (translIds.empty())
+        return wxNOT_FOUND;
+    return translIds.front();
+}
+
+void ClangProxy::GetTranslationUnitIds(FileId fId, std::vector<int>& translIds)
+{
+    if (fId < 0 || fId >= static_cast<int>(m_FileTranslUnits.size()))
+        return;
+    translIds = m_FileTranslUnits[fId];
+    std::sort(translIds.begin(), translIds.end(), ProxyHelper::TranslUnitRanker(m_TranslUnits, fId));
+}
+
+void ClangProxy::GetAffectedSources(FileId fId, std::vector<FileId>& sources) const
+{
+    std::set<FileId> reached;
+    reached.insert(fId);
+    std::vector<FileId> pending(1, fId);
+    while (!pending.empty())
     {
-        if (m_TranslUnits[i].Contains(fId))
-            return i;
+        const FileId file = pending.back();
+        pending.pop_back();
+        if (file >= 0 && file < static_cast<int>(m_FileTranslUnits.size()))
+        {
+            const std::vector<int>& translIds = m_FileTranslUnits[file];
+            for (std::vector<int>::const_iterator idItr = translIds.begin(); idItr != translIds.end(); ++idItr)
+            {
+                if (m_TranslUnits[*idItr].GetFileId() == file)
+                {
+                    sources.push_back(file);
+                    break;
+                }
+            }
+        }
+        std::map< FileId, std::map<FileId, unsigned> >::const_iterator incItr = m_FileIncluders.find(file);
+        if (incItr == m_FileIncluders.end())
+            continue;
+        for (std::map<FileId, unsigned>::const_iterator edgeItr = incItr->second.begin();
+             edgeItr != incItr->second.end(); ++edgeItr)
+        {
+            if (reached.insert(edgeItr->first).second)
+                pending.push_back(edgeItr->first);
+        }
+    }
+}
+
+void ClangProxy::GetAffectedTranslationUnits(FileId fId, std::vector<int>& translIds)
+{
+    std::vector<FileId> sources;
+    GetAffectedSources(fId, sources);
+    for (std::vector<FileId>::const_iterator srcItr = sources.begin(); srcItr != sources.end(); ++srcItr)
+    {
+        const std::vector<int>& srcTranslIds = m_FileTranslUnits[*srcItr];
+        for (std::vector<int>::const_iterator idItr = srcTranslIds.begin(); idItr != srcTranslIds.end(); ++idItr)
+        {
+            if (m_TranslUnits[*idItr].GetFileId() == *srcItr)
+                translIds.push_back(*idItr);
+        }
+    }
+    std::sort(translIds.begin(), translIds.end(), ProxyHelper::TranslUnitRanker(m_TranslUnits, fId));
+    // disposed units will read the change when they are loaded again
+    translIds.erase(std::remove_if(translIds.begin(), translIds.end(), ProxyHelper::TranslUnitDisposed(m_TranslUnits)),
+                    translIds.end());
+}
+
+bool ClangProxy::TranslationUnitContains(int translId, const wxString& filename)
+{
+    return m_TranslUnits[translId].Contains(m_Database.GetFilenameId(filename));
+}
+
+bool ClangProxy::IsTranslationUnitLoaded(int translId) const
+{
+    return m_TranslUnits[translId].IsLoaded();
+}
+
+void ClangProxy::UpdateFileIndex(int translId, const std::vector<FileId>& oldFiles,
+                                 const std::vector< std::pair<FileId, FileId> >& oldEdges)
+{
+    for (std::vector< std::pair<FileId, FileId> >::const_iterator edgeItr = oldEdges.begin();
+         edgeItr != oldEdges.end(); ++edgeItr)
+    {
+        std::map<FileId, unsigned>& includers = m_FileIncluders[edgeItr->second];
+        std::map<FileId, unsigned>::iterator cntItr = includers.find(edgeItr->first);
+        if (cntItr != includers.end() && --cntItr->second == 0)
+            includers.erase(cntItr);
+        if (includers.empty())
+            m_FileIncluders.erase(edgeItr->second);
+    }
+    const std::vector< std::pair<FileId, FileId> >& edges = m_TranslUnits[translId].GetIncludeEdges();
+    for (std::vector< std::pair<FileId, FileId> >::const_iterator edgeItr = edges.begin();
+         edgeItr != edges.end(); ++edgeItr)
+    {
+        ++m_FileIncluders[edgeItr->second][edgeItr->first];
+    }
+    for (std::vector<FileId>::const_iterator flItr = oldFiles.begin();
+         flItr != oldFiles.end(); ++flItr)
+    {
+        std::vector<int>& translIds = m_FileTranslUnits[*flItr];
+        translIds.erase(std::remove(translIds.begin(), translIds.end(), translId), translIds.end());
+    }
+    const std::vector<FileId>& files = m_TranslUnits[translId].GetFiles();
+    if (!files.empty() && files.back() >= static_cast<int>(m_FileTranslUnits.size()))
+        m_FileTranslUnits.resize(files.back() + 1);
+    for (std::vector<FileId>::const_iterator flItr = files.begin();
+         flItr != files.end(); ++flItr)
+    {
+        m_FileTranslUnits[*flItr].push_back(translId);
     }
-    return wxNOT_FOUND;
 }
 
 int ClangProxy::GetTranslationUnitId(const wxString& filename)
@@ -597,104 +1625,84 @@ int ClangProxy::GetTranslationUnitId(const wxString& filename)
 
 void ClangProxy::CodeCompleteAt(bool isAuto, const wxString& filename,
                                 int line, int column, int translId,
-                                const std::map<wxString, wxString>& unsavedFiles,
+                                const ClUnsavedBuffers& unsavedFiles,
+                                const ClCompletionFilter& filter,
                                 std::vector<ClToken>& results)
 {
     wxCharBuffer chName = filename.ToUTF8();
+    TranslationUnit& translUnit = GetTranslationUnit(translId, &unsavedFiles);
     std::vector<CXUnsavedFile> clUnsavedFiles;
-    std::vector<wxCharBuffer> clFileBuffer;
-    for (std::map<wxString, wxString>::const_iterator fileIt = unsavedFiles.begin();
-         fileIt != unsavedFiles.end(); ++fileIt)
-    {
-        CXUnsavedFile unit;
-        clFileBuffer.push_back(fileIt->first.ToUTF8());
-        unit.Filename = clFileBuffer.back().data();
-        clFileBuffer.push_back(fileIt->second.ToUTF8());
-        unit.Contents = clFileBuffer.back().data();
-#if wxCHECK_VERSION(2, 9, 4)
-        unit.Length   = clFileBuffer.back().length();
-#else
-        unit.Length   = strlen(unit.Contents); // extra work needed because wxString::Length() treats multibyte character length as '1'
-#endif
-        clUnsavedFiles.push_back(unit);
-    }
+    std::map<FileId, unsigned> unsavedHashes, directiveHashes;
+    SelectUnsavedFiles(translUnit, unsavedFiles, clUnsavedFiles, unsavedHashes, directiveHashes);
     CXCodeCompleteResults* clResults
-        = m_TranslUnits[translId].CodeCompleteAt(chName.data(), line, column,
-                                                 clUnsavedFiles.empty() ? nullptr : &clUnsavedFiles[0],
-                                                 clUnsavedFiles.size());
+        = translUnit.CodeCompleteAt(chName.data(), line, column,
+                                    clUnsavedFiles.empty() ? nullptr : &clUnsavedFiles[0],
+                                    clUnsavedFiles.size());
     if (!clResults)
         return;
 
     if (isAuto && clang_codeCompleteGetContexts(clResults) == CXCompletionContext_Unknown)
         return;
 
+    // filter on the typed text, so strings are only built for what is shown
+    const FuzzyMatcher& matcher = translUnit.GetCCMatcher();
+    const std::string pattern = FuzzyMatcher::PreparePattern(filter.prefix.ToUTF8());
+    const int maxScore = FuzzyMatcher::GetMaxScore(pattern);
+    std::vector< std::pair<unsigned, int> > matches; // (weight, result index); a max-heap once full
     const int numResults = clResults->NumResults;
-    results.reserve(numResults);
     for (int resIdx = 0; resIdx < numResults; ++resIdx)
     {
         const CXCompletionResult& token = clResults->Results[resIdx];
+        if (!filter.includeCtors && ProxyHelper::GetTokenCategory(token.CursorKind) == tcCtorPublic)
+            continue;
         if (CXAvailability_Available != clang_getCompletionAvailability(token.CompletionString))
             continue;
-        const int numChunks = clang_getNumCompletionChunks(token.CompletionString);
-        wxString type;
-        for (int chunkIdx = 0; chunkIdx < numChunks; ++chunkIdx)
+        unsigned weight = clang_getCompletionPriority(token.CompletionString);
+        if (   filter.maxResults != 0 && matches.size() == filter.maxResults
+            && weight >= matches.front().first )
         {
-            CXCompletionChunkKind kind = clang_getCompletionChunkKind(token.CompletionString, chunkIdx);
-            if (kind == CXCompletionChunk_ResultType)
-            {
-                CXString str = clang_getCompletionChunkText(token.CompletionString, chunkIdx);
-                type = wxT(": ") + wxString::FromUTF8(clang_getCString(str));
-                wxString prefix;
-                if (type.EndsWith(wxT(" *"), &prefix) || type.EndsWith(wxT(" &"), &prefix))
-                    type = prefix + type.Last();
-                clang_disposeString(str);
-            }
-            else if (kind == CXCompletionChunk_TypedText)
-            {
-                if (type.Length() > 40)
-                {
-                    type.Truncate(35);
-                    if (wxIsspace(type.Last()))
-                        type.Trim();
-                    else if (wxIspunct(type.Last()))
-                    {
-                        for (int i = type.Length() - 2; i > 10; --i)
-                        {
-                            if (!wxIspunct(type[i]))
-                            {
-                                type.Truncate(i + 1);
-                                break;
-                            }
-                        }
-                    }
-                    else if (wxIsalnum(type.Last()) || type.Last() == wxT('_'))
-                    {
-                        for (int i = type.Length() - 2; i > 10; --i)
-                        {
-                            if (!( wxIsalnum(type[i]) || type[i] == wxT('_') ))
-                            {
-                                type.Truncate(i + 1);
-                                break;
-                            }
-                        }
-                    }
-                    type += wxT("...");
-                }
-                CXString completeTxt = clang_getCompletionChunkText(token.CompletionString, chunkIdx);
-                results.push_back(ClToken(wxString::FromUTF8(clang_getCString(completeTxt)) + type,
-                                          resIdx, clang_getCompletionPriority(token.CompletionString),
-                                          ProxyHelper::GetTokenCategory(token.CursorKind)));
-                clang_disposeString(completeTxt);
-                type.Empty();
-                break;
-            }
+            continue; // cannot make the cut, the match score only adds to the weight
+        }
+        const int score = matcher.Score(resIdx, pattern);
+        if (score < 0)
+            continue;
+        if (maxScore == 0)
+        {
+            // it is rather unlikely for an operator to be the desired completion
+            if (matcher.StartsWith(resIdx, "operator"))
+                continue;
+        }
+        else
+            weight += FUZZY_WEIGHT_RANGE * (maxScore - score) / maxScore;
+        matches.push_back(std::make_pair(weight, resIdx));
+        if (filter.maxResults == 0 || matches.size() < filter.maxResults)
+            continue;
+        if (matches.size() == filter.maxResults) // full; from now on only better matches get in
+            std::make_heap(matches.begin(), matches.end());
+        else // replace the worst kept match
+        {
+            std::push_heap(matches.begin(), matches.end());
+            std::pop_heap(matches.begin(), matches.end());
+            matches.pop_back();
         }
     }
+    std::sort(matches.begin(), matches.end(), ProxyHelper::ResultIndexLess);
+
+    results.reserve(results.size() + matches.size());
+    for (std::vector< std::pair<unsigned, int> >::const_iterator mtItr = matches.begin();
+         mtItr != matches.end(); ++mtItr)
+    {
+        const CXCompletionResult& token = clResults->Results[mtItr->second];
+        results.push_back(ClToken(ProxyHelper::GetCompletionLabel(token.CompletionString),
+                                  mtItr->second, mtItr->first,
+                                  ProxyHelper::GetTokenCategory(token.CursorKind)));
+    }
 }
 
 wxString ClangProxy::DocumentCCToken(int translId, int tknId)
 {
-    const CXCompletionResult* token = m_TranslUnits[translId].GetCCResult(tknId);
+    TranslationUnit& translUnit = GetTranslationUnit(translId);
+    const CXCompletionResult* token = translUnit.GetCCResult(tknId);
     if (!token)
         return wxEmptyString;
 
@@ -724,17 +1732,23 @@ wxString ClangProxy::DocumentCCToken(int translId, int tknId)
         clang_disposeString(str);
     }
 
-    wxString descriptor;
+    // the scoped signature plus the kind tell tokens apart (overloads and scopes included)
+    const wxString& docKey = wxString::Format(wxT("%d "), int(token->CursorKind)) + doc;
+    wxString html;
+    if (translUnit.GetCachedDocumentation(docKey, html))
+        return html;
+
     wxString identifier;
-    unsigned tokenHash = HashToken(token->CompletionString, identifier);
+    const unsigned tokenHash = HashToken(token->CompletionString, identifier);
+    wxString descriptor;
+    TokenId tId = wxNOT_FOUND;
     if (!identifier.IsEmpty())
     {
-        TokenId tId = m_Database.GetTokenId(identifier, tokenHash);
+        tId = m_Database.GetTokenId(identifier, tokenHash);
         if (tId != wxNOT_FOUND)
         {
             const AbstractToken& aTkn = m_Database.GetToken(tId);
-            CXCursor clTkn = m_TranslUnits[translId].GetTokensAt(m_Database.GetFilename(aTkn.fileId),
-                                                                 aTkn.line, aTkn.column);
+            CXCursor clTkn = translUnit.GetTokensAt(aTkn.fileId, aTkn.line, aTkn.column, &m_Database);
             if (!clang_Cursor_isNull(clTkn) && !clang_isInvalid(clTkn.kind))
             {
                 CXComment docComment = clang_Cursor_getParsedComment(clTkn);
@@ -760,13 +1774,16 @@ wxString ClangProxy::DocumentCCToken(int translId, int tknId)
         clang_disposeString(comment);
     }
 
-    return wxT("<html><body><br><tt>") + HTML_Writer::SyntaxHl(doc, m_CppKeywords)
+    html = wxT("<html><body><br><tt>") + HTML_Writer::SyntaxHl(doc, m_CppKeywords)
          + wxT("</tt>") + descriptor + wxT("</body></html>");
+    if (tId != wxNOT_FOUND) // otherwise the indexer may still record the declaration
+        translUnit.SetCachedDocumentation(docKey, html);
+    return html;
 }
 
 wxString ClangProxy::GetCCInsertSuffix(int translId, int tknId, const wxString& newLine, std::pair<int, int>& offsets)
 {
-    const CXCompletionResult* token = m_TranslUnits[translId].GetCCResult(tknId);
+    const CXCompletionResult* token = GetTranslationUnit(translId).GetCCResult(tknId);
     if (!token)
         return wxEmptyString;
 
@@ -819,41 +1836,78 @@ wxString ClangProxy::GetCCInsertSuffix(int translId, int tknId, const wxString&
     return suffix;
 }
 
-void ClangProxy::RefineTokenType(int translId, int tknId, int& tknType)
+size_t ClangProxy::RefineTokenTypes(int translId, const std::vector<int>& tknIds,
+                                    std::vector<int>& tknTypes, size_t maxLookups)
 {
-    const CXCompletionResult* token = m_TranslUnits[translId].GetCCResult(tknId);
-    if (!token)
-        return;
-    wxString identifier;
-    unsigned tokenHash = HashToken(token->CompletionString, identifier);
-    if (!identifier.IsEmpty())
+    TranslationUnit& translUnit = GetTranslationUnit(translId);
+    // (declaration, index into tknIds) of those that still require a cursor lookup
+    std::vector< std::pair<AbstractToken, size_t> > lookups;
+    std::vector<unsigned> hashes(tknIds.size(), 0);
+    for (size_t i = 0; i < tknIds.size(); ++i)
     {
-        TokenId tId = m_Database.GetTokenId(identifier, tokenHash);
-        if (tId != wxNOT_FOUND)
+        const CXCompletionResult* token = translUnit.GetCCResult(tknIds[i]);
+        if (!token)
+            continue;
+        int access = translUnit.GetCCAccess(tknIds[i]);
+        if (access < 0)
         {
-            const AbstractToken& aTkn = m_Database.GetToken(tId);
-            CXCursor clTkn = m_TranslUnits[translId].GetTokensAt(m_Database.GetFilename(aTkn.fileId),
-                                                                 aTkn.line, aTkn.column);
-            if (!clang_Cursor_isNull(clTkn) && !clang_isInvalid(clTkn.kind))
+            wxString identifier;
+            hashes[i] = HashToken(token->CompletionString, identifier);
+            if (!translUnit.GetCachedAccess(hashes[i], access))
             {
-                TokenCategory tkCat
-                    = ProxyHelper::GetTokenCategory(token->CursorKind, clang_getCXXAccessSpecifier(clTkn));
-                if (tkCat != tcNone)
-                    tknType = tkCat;
+                const TokenId tId = (identifier.IsEmpty() ? wxNOT_FOUND : m_Database.GetTokenId(identifier, hashes[i]));
+                if (tId != wxNOT_FOUND)
+                {
+                    lookups.push_back(std::make_pair(m_Database.GetToken(tId), i));
+                    continue;
+                }
+                access = CX_CXXInvalidAccessSpecifier;
+                translUnit.SetCachedAccess(hashes[i], access);
             }
+            translUnit.SetCCAccess(tknIds[i], access);
         }
+        const TokenCategory tkCat
+            = ProxyHelper::GetTokenCategory(token->CursorKind, static_cast<CX_CXXAccessSpecifier>(access));
+        if (tkCat != tcNone)
+            tknTypes[i] = tkCat;
+    }
+
+    size_t deferred = 0;
+    if (maxLookups != 0 && lookups.size() > maxLookups)
+    {
+        deferred = lookups.size() - maxLookups;
+        lookups.resize(maxLookups); // the most important come first
     }
+    for (std::vector< std::pair<AbstractToken, size_t> >::const_iterator lkItr = lookups.begin();
+         lkItr != lookups.end(); ++lkItr)
+    {
+        const AbstractToken& aTkn = lkItr->first;
+        const size_t i = lkItr->second;
+        int access = CX_CXXInvalidAccessSpecifier;
+        CXCursor clTkn = translUnit.GetTokensAt(aTkn.fileId, aTkn.line, aTkn.column, &m_Database);
+        if (!clang_Cursor_isNull(clTkn) && !clang_isInvalid(clTkn.kind))
+            access = clang_getCXXAccessSpecifier(clTkn);
+        translUnit.SetCachedAccess(hashes[i], access);
+        translUnit.SetCCAccess(tknIds[i], access);
+        const TokenCategory tkCat
+            = ProxyHelper::GetTokenCategory(translUnit.GetCCResult(tknIds[i])->CursorKind,
+                                            static_cast<CX_CXXAccessSpecifier>(access));
+        if (tkCat != tcNone)
+            tknTypes[i] = tkCat;
+    }
+    return deferred;
 }
 
 void ClangProxy::GetCallTipsAt(const wxString& filename, int line, int column,
                                int translId, const wxString& tokenStr,
                                std::vector<wxStringVec>& results)
 {
+    TranslationUnit& translUnit = GetTranslationUnit(translId);
     std::vector<CXCursor> tokenSet;
     if (column > static_cast<int>(tokenStr.Length()))
     {
         column -= tokenStr.Length() / 2;
-        CXCursor token = m_TranslUnits[translId].GetTokensAt(filename, line, column);
+        CXCursor token = translUnit.GetTokensAt(filename, line, column);
         if (!clang_Cursor_isNull(token))
         {
             CXCursor resolve = clang_getCursorDefinition(token);
@@ -871,13 +1925,23 @@ void ClangProxy::GetCallTipsAt(const wxString& filename, int line, int column,
     // TODO: searching the database is very inexact, but necessary, as clang
     // does not resolve the token when the code is invalid (incomplete)
     std::vector<TokenId> tknIds = m_Database.GetTokenMatches(tokenStr);
+    std::vector<wxStringVec> dbTips;
+    wxStringVec entry;
     for (std::vector<TokenId>::const_iterator itr = tknIds.begin(); itr != tknIds.end(); ++itr)
     {
-        const AbstractToken& aTkn = m_Database.GetToken(*itr);
-        CXCursor token = m_TranslUnits[translId].GetTokensAt(m_Database.GetFilename(aTkn.fileId),
-                                                             aTkn.line, aTkn.column);
-        if (!clang_Cursor_isNull(token) && !clang_isInvalid(token.kind))
-            tokenSet.push_back(token);
+        // only offer what this unit can see
+        const AbstractToken aTkn = m_Database.GetToken(*itr);
+        if (!translUnit.Contains(aTkn.fileId))
+            continue;
+        // functions were rendered at index time; variables and types lead to constructors and 'operator()'
+        if (m_Database.GetSignature(*itr, entry))
+            dbTips.push_back(entry);
+        else
+        {
+            CXCursor token = translUnit.GetTokensAt(aTkn.fileId, aTkn.line, aTkn.column, &m_Database);
+            if (!clang_Cursor_isNull(token) && !clang_isInvalid(token.kind))
+                tokenSet.push_back(token);
+        }
     }
     std::set<wxString> uniqueTips;
     for (size_t tknIdx = 0; tknIdx < tokenSet.size(); ++tknIdx)
@@ -916,70 +1980,9 @@ void ClangProxy::GetCallTipsAt(const wxString& filename, int line, int column,
             }
             case tcFuncPublic:
             {
-                const CXCompletionString& clCompStr = clang_getCursorCompletionString(token);
                 wxStringVec entry;
-                int upperBound = clang_getNumCompletionChunks(clCompStr);
-                entry.push_back(wxEmptyString);
-                for (int chunkIdx = 0; chunkIdx < upperBound; ++chunkIdx)
-                {
-                    CXCompletionChunkKind kind = clang_getCompletionChunkKind(clCompStr, chunkIdx);
-                    if (kind == CXCompletionChunk_TypedText)
-                    {
-                        CXString str = clang_getCompletionParent(clCompStr, nullptr);
-                        wxString parent = wxString::FromUTF8(clang_getCString(str));
-                        if (!parent.IsEmpty())
-                            entry[0] += parent + wxT("::");
-                        clang_disposeString(str);
-                    }
-                    else if (kind == CXCompletionChunk_LeftParen)
-                    {
-                        if (entry[0].IsEmpty() || !entry[0].EndsWith(wxT("operator")))
-                            break;
-                    }
-                    CXString str = clang_getCompletionChunkText(clCompStr, chunkIdx);
-                    entry[0] += wxString::FromUTF8(clang_getCString(str));
-                    if (kind == CXCompletionChunk_ResultType)
-                    {
-                        if (entry[0].Length() > 2 && entry[0][entry[0].Length() - 2] == wxT(' '))
-                            entry[0].RemoveLast(2) += entry[0].Last();
-                        entry[0] += wxT(' ');
-                    }
-                    clang_disposeString(str);
-                }
-                entry[0] += wxT('(');
-                int numArgs = clang_Cursor_getNumArguments(token);
-                for (int argIdx = 0; argIdx < numArgs; ++argIdx)
-                {
-                    CXCursor arg = clang_Cursor_getArgument(token, argIdx);
-
-                    wxString tknStr;
-                    const CXCompletionString& argStr = clang_getCursorCompletionString(arg);
-                    upperBound = clang_getNumCompletionChunks(argStr);
-                    for (int chunkIdx = 0; chunkIdx < upperBound; ++chunkIdx)
-                    {
-                        CXCompletionChunkKind kind = clang_getCompletionChunkKind(argStr, chunkIdx);
-                        if (kind == CXCompletionChunk_TypedText)
-                        {
-                            CXString str = clang_getCompletionParent(argStr, nullptr);
-                            wxString parent = wxString::FromUTF8(clang_getCString(str));
-                            if (!parent.IsEmpty())
-                                tknStr += parent + wxT("::");
-                            clang_disposeString(str);
-                        }
-                        CXString str = clang_getCompletionChunkText(argStr, chunkIdx);
-                        tknStr += wxString::FromUTF8(clang_getCString(str));
-                        if (kind == CXCompletionChunk_ResultType)
-                        {
-                            if (tknStr.Length() > 2 && tknStr[tknStr.Length() - 2] == wxT(' '))
-                                tknStr.RemoveLast(2) += tknStr.Last();
-                            tknStr += wxT(' ');
-                        }
-                        clang_disposeString(str);
-                    }
-
-                    entry.push_back(tknStr.Trim());
-                }
-                entry.push_back(wxT(')'));
+                if (!RenderSignature(clang_getCursorCompletionString(token), entry))
+                    break;
                 wxString composit;
                 for (wxStringVec::const_iterator itr = entry.begin();
                      itr != entry.end(); ++itr)
@@ -997,12 +2000,20 @@ void ClangProxy::GetCallTipsAt(const wxString& filename, int line, int column,
                 break;
         }
     }
+    for (std::vector<wxStringVec>::const_iterator tipItr = dbTips.begin(); tipItr != dbTips.end(); ++tipItr)
+    {
+        wxString composit;
+        for (wxStringVec::const_iterator strItr = tipItr->begin(); strItr != tipItr->end(); ++strItr)
+            composit += *strItr;
+        if (uniqueTips.insert(composit).second)
+            results.push_back(*tipItr);
+    }
 }
 
 void ClangProxy::GetTokensAt(const wxString& filename, int line, int column,
                              int translId, wxStringVec& results)
 {
-    CXCursor token = m_TranslUnits[translId].GetTokensAt(filename, line, column);
+    CXCursor token = GetTranslationUnit(translId).GetTokensAt(filename, line, column);
     if (clang_Cursor_isNull(token))
         return;
     ProxyHelper::ResolveCursorDecl(token);
@@ -1098,17 +2109,18 @@ void ClangProxy::GetTokensAt(const wxString& filename, int line, int column,
 void ClangProxy::GetOccurrencesOf(const wxString& filename, int line, int column,
                                   int translId, std::vector< std::pair<int, int> >& results)
 {
-    CXCursor token = m_TranslUnits[translId].GetTokensAt(filename, line, column);
-    if (clang_Cursor_isNull(token))
-        return;
-    ProxyHelper::ResolveCursorDecl(token);
-    CXCursorAndRangeVisitor visitor = {&results, ProxyHelper::ReferencesVisitor};
-    clang_findReferencesInFile(token, m_TranslUnits[translId].GetFileHandle(filename), visitor);
+    GetTranslationUnit(translId).GetOccurrencesOf(filename, line, column, results);
+}
+
+void ClangProxy::GetSemanticTokens(const wxString& filename, int startOffset, int endOffset,
+                                   int translId, std::vector<ClSemanticToken>& results)
+{
+    GetTranslationUnit(translId).GetSemanticTokens(filename, startOffset, endOffset, results);
 }
 
 void ClangProxy::ResolveTokenAt(wxString& filename, int& line, int& column, int translId)
 {
-    CXCursor token = m_TranslUnits[translId].GetTokensAt(filename, line, column);
+    CXCursor token = GetTranslationUnit(translId).GetTokensAt(filename, line, column);
     if (clang_Cursor_isNull(token))
         return;
     ProxyHelper::ResolveCursorDecl(token);
@@ -1119,6 +2131,8 @@ void ClangProxy::ResolveTokenAt(wxString& filename, int& line, int& column, int
         line = 1;
         column = 1;
     }
+    else if (!clang_isCursorDefinition(token) && ProxyHelper::LookupDefinition(token, m_Database, filename, line, column))
+        return; // defined in a file this unit does not see
     else
     {
         CXSourceLocation loc = clang_getCursorLocation(token);
@@ -1132,29 +2146,87 @@ void ClangProxy::ResolveTokenAt(wxString& filename, int& line, int& column, int
     clang_disposeString(str);
 }
 
-void ClangProxy::Reparse(int translId, const std::map<wxString, wxString>& unsavedFiles)
+void ClangProxy::SelectUnsavedFiles(const TranslationUnit& translUnit, const ClUnsavedBuffers& unsavedFiles,
+                                    std::vector<CXUnsavedFile>& clUnsavedFiles, std::map<FileId, unsigned>& unsavedHashes,
+                                    std::map<FileId, unsigned>& directiveHashes)
 {
-    std::vector<CXUnsavedFile> clUnsavedFiles;
-    std::vector<wxCharBuffer> clFileBuffer;
-    for (std::map<wxString, wxString>::const_iterator fileIt = unsavedFiles.begin();
+    for (ClUnsavedBuffers::const_iterator fileIt = unsavedFiles.begin();
          fileIt != unsavedFiles.end(); ++fileIt)
     {
+        const FileId fId = m_Database.GetFilenameId(fileIt->first);
+        if (!translUnit.GetFiles().empty() && !translUnit.Contains(fId)) // cannot affect this unit
+            continue;
         CXUnsavedFile unit;
-        clFileBuffer.push_back(fileIt->first.ToUTF8());
-        unit.Filename = clFileBuffer.back().data();
-        clFileBuffer.push_back(fileIt->second.ToUTF8());
-        unit.Contents = clFileBuffer.back().data();
-#if wxCHECK_VERSION(2, 9, 4)
-        unit.Length   = clFileBuffer.back().length();
-#else
-        unit.Length   = strlen(unit.Contents); // extra work needed because wxString::Length() treats multibyte character length as '1'
-#endif
+        unit.Filename = fileIt->second.filename.c_str();
+        unit.Contents = fileIt->second.contents;
+        unit.Length   = fileIt->second.length;
         clUnsavedFiles.push_back(unit);
+        unsavedHashes[fId] = fileIt->second.hash;
+        directiveHashes[fId] = fileIt->second.directivesHash;
     }
-    m_TranslUnits[translId].Reparse(clUnsavedFiles.size(), clUnsavedFiles.empty() ? nullptr : &clUnsavedFiles[0]);
 }
 
-void ClangProxy::GetDiagnostics(int translId, std::vector<ClDiagnostic>& diagnostics)
+ReparseStatus ClangProxy::Reparse(int translId, const ClUnsavedBuffers& unsavedFiles, bool force)
 {
-    m_TranslUnits[translId].GetDiagnostics(diagnostics);
+    if (force) // something changed on disk, the unit might parse again
+        m_TranslUnits[translId].ResetLoadFailures();
+    const bool wasLoaded = m_TranslUnits[translId].IsLoaded();
+    TranslationUnit& translUnit = GetTranslationUnit(translId, &unsavedFiles);
+    if (!translUnit.IsLoaded())
+        return rsFailed;
+    if (!wasLoaded)
+        return rsReparsed; // just parsed with these buffers
+    std::vector<CXUnsavedFile> clUnsavedFiles;
+    std::map<FileId, unsigned> unsavedHashes, directiveHashes;
+    SelectUnsavedFiles(translUnit, unsavedFiles, clUnsavedFiles, unsavedHashes, directiveHashes);
+    if (!force && unsavedHashes == translUnit.GetUnsavedHashes())
+        return rsUnchanged;
+    // the included files only change with the directives, or with the files on disk
+    const bool includesChanged = (force || directiveHashes != translUnit.GetDirectiveHashes());
+
+    if (!translUnit.Reparse(clUnsavedFiles.size(), clUnsavedFiles.empty() ? nullptr : &clUnsavedFiles[0]))
+    {
+        ProxyHelper::LogParseFailure(translUnit.GetFilename(), translUnit.GetErrorCode());
+        // start over; translUnit was disposed
+        return (GetTranslationUnit(translId, &unsavedFiles).IsLoaded() ? rsReparsed : rsFailed);
+    }
+    translUnit.SetUnsavedHashes(unsavedHashes, directiveHashes);
+    if (includesChanged)
+    {
+        const std::vector<FileId> oldFiles = translUnit.GetFiles();
+        const std::vector< std::pair<FileId, FileId> > oldEdges = translUnit.GetIncludeEdges();
+        translUnit.UpdateFiles(&m_Database);
+        UpdateFileIndex(translId, oldFiles, oldEdges);
+    }
+    EnforceMemoryBudget(translId);
+    return rsReparsed;
+}
+
+void ClangProxy::GetDiagnostics(int translId, const wxString& filename, std::vector<ClDiagnostic>& diagnostics)
+{
+    const FileId fId = m_Database.GetFilenameId(filename);
+    GetTranslationUnit(translId).GetDiagnostics(fId, &m_Database, diagnostics);
+}
+
+void ClangProxy::GetParseStats(int translId, ClParseStats& stats)
+{
+    stats = m_TranslUnits[translId].GetParseStats();
+}
+
+void ClangProxy::GetMemoryStats(std::vector<ClMemoryStats>& stats)
+{
+    stats.reserve(stats.size() + m_TranslUnits.size());
+    for (size_t i = 0; i < m_TranslUnits.size(); ++i)
+    {
+        const TranslationUnit& translUnit = m_TranslUnits[i];
+        stats.push_back(ClMemoryStats());
+        ClMemoryStats& tuStats = stats.back();
+        tuStats.translId = i;
+        tuStats.filename = translUnit.GetFilename();
+        tuStats.loaded = translUnit.IsLoaded();
+        tuStats.libclangMemory = translUnit.GetMemoryUsage();
+        tuStats.completionMemory = translUnit.GetCCMemoryUsage();
+        tuStats.entries = translUnit.GetMemoryEntries();
+    }
+    std::sort(stats.begin(), stats.end(), ProxyHelper::MemoryStatsGreater);
 }
@@ -2,12 +2,18 @@
 #define CLANGPROXY_H
 
 #include <map>
+#include <set>
+#include <string>
 #include <vector>
 #include <wx/string.h>
 
+class ClIndexerThread;
+class ClWorkerProcess;
 class TranslationUnit;
 class TokenDatabase;
+struct CXUnsavedFile;
 typedef void* CXIndex;
+typedef void* CXIndexAction;
 typedef int FileId;
 
 enum TokenCategory
@@ -55,6 +61,17 @@ struct ClToken // TODO: do we want this, or is just using CCToken good enough?
     wxString name;
 };
 
+/// Which completion results to return, so the rest are never converted to strings
+struct ClCompletionFilter
+{
+    ClCompletionFilter() :
+        includeCtors(true), maxResults(0) {}
+
+    wxString prefix;   // the partial identifier before the caret, matched fuzzily
+    bool includeCtors;
+    size_t maxResults; // keep only this many of the highest priority (0 for all)
+};
+
 enum Severity { sWarning, sError };
 struct ClDiagnostic
 {
@@ -68,6 +85,130 @@ struct ClDiagnostic
     wxString message;
 };
 
+/// How the semantic highlighter colours an identifier
+enum SemanticCategory
+{
+    scType,
+    scMember,
+    scLocal,
+    scParameter,
+    scMacro,
+    scEnumConstant,
+    scCount
+};
+struct ClSemanticToken
+{
+    ClSemanticToken(int off, int len, SemanticCategory categ) :
+        offset(off), length(len), category(categ) {}
+
+    bool operator==(const ClSemanticToken& other) const
+    { return offset == other.offset && length == other.length && category == other.category; }
+
+    int offset; // bytes from the start of the file
+    int length;
+    SemanticCategory category;
+};
+
+struct ClParsePhase
+{
+    ClParsePhase(const wxString& nm, long wall, long cpu) :
+        name(nm), wallTime(wall), cpuTime(cpu) {}
+
+    wxString name;
+    long wallTime; // milliseconds
+    long cpuTime;  // milliseconds of the parsing thread, -1 if unknown
+};
+
+struct ClParseStats
+{
+    ClParseStats() :
+        numFiles(0), numCursors(0), numTokens(0) {}
+
+    int numFiles;
+    int numCursors; // visited while collecting tokens
+    int numTokens;  // new to the database
+    std::vector<ClParsePhase> phases;
+};
+
+struct ClMemoryEntry
+{
+    ClMemoryEntry(const wxString& nm, unsigned long amt) :
+        name(nm), amount(amt) {}
+
+    wxString name;
+    unsigned long amount; // kilobytes
+};
+
+struct ClMemoryStats
+{
+    ClMemoryStats() :
+        translId(-1), loaded(false), libclangMemory(0), completionMemory(0) {}
+
+    int translId;
+    wxString filename;
+    bool loaded;
+    unsigned long libclangMemory;   // kilobytes, sum of entries
+    unsigned long completionMemory; // kilobytes, estimated
+    std::vector<ClMemoryEntry> entries; // as reported by clang_getCXTUResourceUsage()
+};
+
+/**
+ * UTF-8 view of a modified editor's contents, in the form libclang consumes it
+ *
+ * The contents are not owned, and must not change while a request using them runs.
+ */
+struct ClUnsavedBuffer
+{
+    ClUnsavedBuffer() :
+        contents(nullptr), length(0), hash(0), directivesHash(0) {}
+
+    std::string filename; // UTF-8
+    const char* contents;
+    size_t length;
+    unsigned hash;           // HashBuffer() of contents
+    unsigned directivesHash; // HashDirectives() of contents
+};
+typedef std::map<wxString, ClUnsavedBuffer> ClUnsavedBuffers;
+
+unsigned HashBuffer(const char* data, size_t length);
+/// Hash of the preprocessor directives in a buffer; which files a unit includes only changes with it
+unsigned HashDirectives(const char* data, size_t length);
+
+/// Supplies the contents of modified editors when a disposed unit is loaded again
+class ClUnsavedFilesProvider
+{
+    public:
+        virtual ~ClUnsavedFilesProvider() {}
+
+        /**
+         * @param translId Only collect files this unit includes (wxNOT_FOUND for all)
+         * @param[out] unsavedFiles The buffers, by filename
+         */
+        virtual void GetUnsavedFiles(int translId, ClUnsavedBuffers& unsavedFiles) = 0;
+};
+
+/**
+ * How tokens are collected from a parsed unit
+ *
+ * The visitor is the faster of the two: it stops descending into files
+ * already indexed, while the indexer reports every declaration of every
+ * header. Measured with libclang 18 on a unit including <bits/stdc++.h>:
+ * 90 ms against 220 ms into an empty database, 6 ms against 140 ms once
+ * its headers were indexed.
+ */
+enum HarvestMethod
+{
+    hmVisitor, // walk the full AST with clang_visitChildren()
+    hmIndexer  // declaration callbacks from clang_indexTranslationUnit()
+};
+
+enum ReparseStatus
+{
+    rsUnchanged, // none of the buffers changed since the last parse; nothing was done
+    rsReparsed,
+    rsFailed     // the unit could not be parsed again, and is not loaded
+};
+
 class ClangProxy
 {
     public:
@@ -75,14 +216,137 @@ class ClangProxy
         ~ClangProxy();
 
         void CreateTranslationUnit(const wxString& filename, const wxString& commands);
+        /**
+         * Parse a file in the background, only to record its tokens and includes
+         *
+         * The file is parsed by a worker process (see SetWorkers()), or the
+         * worker thread, with a libclang index of its own; the unit is left
+         * disposed. FinishIndexing() adds it to the others, so it can be found
+         * and is parsed again on first use.
+         *
+         * @return false if no worker is free
+         */
+        bool StartIndexing(const wxString& filename, const wxString& commands);
+        /// Harvest the file of a translation unit again (it was saved), with the unit's flags
+        bool StartIndexing(int translId);
+        /**
+         * Precompile a header in the background, for use with -include-pch
+         *
+         * @param header The header to compile
+         * @param commands Compile flags, including the language (-x c++-header)
+         * @param pchFile Where to write the result
+         * @return false if no worker is free
+         */
+        bool StartPrecompiling(const wxString& header, const wxString& commands, const wxString& pchFile);
+        /**
+         * Collect a header a worker precompiled, if one is done
+         *
+         * @param[out] success false if the header has errors or could not be written
+         *                     (or the worker process crashed)
+         * @param[out] dependencies Files the header includes (itself included)
+         * @return false if no header is done; call again until it returns false
+         */
+        bool FinishPrecompiling(wxString& pchFile, bool& success, std::vector<wxString>& dependencies);
+        /// Is a worker still parsing or precompiling?
+        bool IsIndexing() const;
+        /// Is a worker precompiling a header?
+        bool IsPrecompiling() const;
+        /**
+         * Is a worker process writing a reply? It waits whenever its pipe is
+         * full, until FinishIndexing() or FinishPrecompiling() read from it.
+         */
+        bool IsReceiving() const;
+        /// Would StartIndexing() or StartPrecompiling() find a free worker?
+        bool HasIdleWorker() const;
+        /**
+         * Take over a unit a worker parsed, if one is done
+         *
+         * Dropped if a unit for the same file was created meanwhile. A unit
+         * whose worker process crashed is reported as a failed parse.
+         *
+         * @param[out] filename The file that was indexed
+         * @return false if no unit is done; call again until it returns false
+         */
+        bool FinishIndexing(wxString& filename);
+        /**
+         * Run background jobs in clangworker processes instead of the worker thread
+         *
+         * A crash in libclang then fails one job instead of the IDE; the
+         * worker is started again for the next one. Workers are replaced
+         * after a number of jobs, returning the memory libclang kept. If a
+         * worker cannot be started, jobs run on the worker thread again.
+         *
+         * @param command The worker executable (empty to use the thread)
+         * @param maxWorkers Jobs to run at once (0 to use the thread)
+         */
+        void SetWorkers(const wxString& command, unsigned maxWorkers);
+        /// End the idle worker processes, returning their memory; busy ones end with their job
+        void StopWorkers();
+        /**
+         * Limit the memory libclang may use for translation units; least recently used
+         * units are disposed when it is exceeded, and re-parsed on their next access
+         *
+         * @param budget Limit in kilobytes (0 for unlimited)
+         */
+        void SetMemoryBudget(unsigned long budget);
+        /// Select how tokens are collected from translation units parsed from now on
+        void SetHarvestMethod(HarvestMethod method);
+        /// Where buffers come from when a unit is loaded again without being given any (may be nullptr)
+        void SetUnsavedFilesProvider(ClUnsavedFilesProvider* provider);
+        /**
+         * Swap flags in the compile commands of every translation unit using them
+         *
+         * Loaded units are disposed, and parsed with the new flags on next use.
+         *
+         * @param oldFlags Flags to look for (including their leading space)
+         * @param newFlags Replacement (may be empty)
+         */
+        void ReplaceCommandFlags(const wxString& oldFlags, const wxString& newFlags);
+        /// Add flags to the compile commands of the files' translation units (those without them yet)
+        void AppendCommandFlags(const std::vector<wxString>& files, const wxString& flags);
+        /**
+         * Names of the macros libclang predefines for a target
+         *
+         * @param commands Flags selecting the target and language (-m32, -x c++, ...)
+         * @param[out] names Empty if libclang does not report them
+         */
+        void GetPredefinedMacros(const wxString& commands, std::set<wxString>& names);
         int GetTranslationUnitId(FileId fId);
+        /// All translation units including the file, best candidate first
+        void GetTranslationUnitIds(FileId fId, std::vector<int>& translIds);
+        /**
+         * Main files of the translation units a change to the file reaches
+         *
+         * Answered from the include graph of all units, walked up from the file
+         * (which is listed too if it has a unit of its own).
+         */
+        void GetAffectedSources(FileId fId, std::vector<FileId>& sources) const;
+        /// Loaded translation units that must be reparsed to see a change to the file, most important first
+        void GetAffectedTranslationUnits(FileId fId, std::vector<int>& translIds);
+        /// False if the unit was disposed to save memory (it will be reparsed on next use)
+        bool IsTranslationUnitLoaded(int translId) const;
+        /// Does the translation unit include the file (as of its last parse)?
+        bool TranslationUnitContains(int translId, const wxString& filename);
         int GetTranslationUnitId(const wxString& filename);
 
         void CodeCompleteAt(bool isAuto, const wxString& filename, int line, int column, int translId,
-                            const std::map<wxString, wxString>& unsavedFiles, std::vector<ClToken>& results);
+                            const ClUnsavedBuffers& unsavedFiles, const ClCompletionFilter& filter,
+                            std::vector<ClToken>& results);
+        /// HTML documentation of a completion result (cached per token until the unit is reparsed)
         wxString DocumentCCToken(int translId, int tknId);
         wxString GetCCInsertSuffix(int translId, int tknId, const wxString& newLine, std::pair<int, int>& offsets);
-        void RefineTokenType(int translId, int tknId, int& tknType); // TODO: cache TokenId (if resolved) for DocumentCCToken()
+        /**
+         * Refine the categories of code completion results by the access specifiers of their declarations
+         *
+         * Results are memoised per translation unit until it is reparsed.
+         *
+         * @param tknIds Indices of the completion results, most important first
+         * @param[in,out] tknTypes Category of each result
+         * @param maxLookups Resolve at most this many uncached declarations (0 for no limit)
+         * @return Number of results left unrefined because of maxLookups
+         */
+        size_t RefineTokenTypes(int translId, const std::vector<int>& tknIds,
+                                std::vector<int>& tknTypes, size_t maxLookups = 0);
 
         void GetCallTipsAt(const wxString& filename, int line, int column, int translId,
                            const wxString& tokenStr, std::vector<wxStringVec>& results);
@@ -90,17 +354,93 @@ class ClangProxy
         void GetTokensAt(const wxString& filename, int line, int column, int translId, std::vector<wxString>& results);
         void GetOccurrencesOf(const wxString& filename, int line, int column,
                               int translId, std::vector< std::pair<int, int> >& results);
+        /**
+         * Classify the identifiers in a part of a file for semantic highlighting
+         *
+         * @param startOffset First byte of the range (the start of a line)
+         * @param endOffset Byte after the range (the start of a line, or the file length)
+         * @param[out] results Classified identifiers starting in the range, in order
+         */
+        void GetSemanticTokens(const wxString& filename, int startOffset, int endOffset,
+                               int translId, std::vector<ClSemanticToken>& results);
         void ResolveTokenAt(wxString& filename, int& line, int& column, int translId);
 
-        void Reparse(int translId, const std::map<wxString, wxString>& unsavedFiles);
+        /**
+         * Reparse a translation unit with the unsaved buffers that belong to it
+         *
+         * A unit libclang fails to reparse is loaded again from scratch, with
+         * the same buffers.
+         *
+         * @param force Reparse even if the buffers did not change (files on disk did)
+         */
+        ReparseStatus Reparse(int translId, const ClUnsavedBuffers& unsavedFiles, bool force = false);
 
-        void GetDiagnostics(int translId, std::vector<ClDiagnostic>& diagnostics);
+        void GetDiagnostics(int translId, const wxString& filename, std::vector<ClDiagnostic>& diagnostics);
+
+        /// Timings and counts from the last time the translation unit was (re)created
+        void GetParseStats(int translId, ClParseStats& stats);
+        /// Memory held by each translation unit, most expensive first
+        void GetMemoryStats(std::vector<ClMemoryStats>& stats);
 
     private:
+        /**
+         * Select the buffers relevant to a translation unit
+         *
+         * @param translUnit The unit about to be (re)parsed or queried
+         * @param unsavedFiles All modified buffers
+         * @param[out] clUnsavedFiles Buffers of files the unit includes (all of them if it was never parsed)
+         * @param[out] unsavedHashes Content hash of each selected buffer
+         * @param[out] directiveHashes Directives hash of each selected buffer
+         */
+        void SelectUnsavedFiles(const TranslationUnit& translUnit, const ClUnsavedBuffers& unsavedFiles,
+                                std::vector<CXUnsavedFile>& clUnsavedFiles, std::map<FileId, unsigned>& unsavedHashes,
+                                std::map<FileId, unsigned>& directiveHashes);
+        /**
+         * Access a translation unit, loading it again if it was disposed
+         *
+         * @param unsavedFiles Modified buffers to load with (nullptr to ask the provider)
+         */
+        TranslationUnit& GetTranslationUnit(int translId, const ClUnsavedBuffers* unsavedFiles = nullptr);
+        /// Dispose least recently used translation units until under budget
+        void EnforceMemoryBudget(int keepTranslId);
+        /// The indexing session for the current harvest method (nullptr when visiting the AST)
+        CXIndexAction GetIndexAction() const;
+        /**
+         * Move the translation unit's entries in the file to unit lookup and the
+         * include graph from its old files and edges to its current ones
+         */
+        void UpdateFileIndex(int translId, const std::vector<FileId>& oldFiles,
+                             const std::vector< std::pair<FileId, FileId> >& oldEdges);
+        /// Log how indexing went, and keep the unit so it can be found by its files
+        void AdoptIndexedUnit(TranslationUnit* translUnit);
+        /// An idle worker process, started if there is room for one more (nullptr if none)
+        ClWorkerProcess* GetIdleWorker();
+        /**
+         * A worker whose job (a ClWorkerProcess::JobKind) is done, if any
+         *
+         * Workers that exited or ran enough jobs are taken out of the pool;
+         * pass them to ReleaseFinishedWorker() once their reply is read.
+         */
+        ClWorkerProcess* TakeFinishedWorker(int job);
+        void ReleaseFinishedWorker(ClWorkerProcess* worker);
+
         TokenDatabase& m_Database;
         const std::vector<wxString>& m_CppKeywords;
         std::vector<TranslationUnit> m_TranslUnits;
+        std::vector< std::vector<int> > m_FileTranslUnits; // indexed by FileId
+        /// Direct includers of each file, with the number of units that saw the #include
+        std::map< FileId, std::map<FileId, unsigned> > m_FileIncluders;
         CXIndex m_ClIndex;
+        CXIndexAction m_ClIndexAction;
+        HarvestMethod m_HarvestMethod;
+        ClUnsavedFilesProvider* m_pUnsavedFilesProvider;
+        ClIndexerThread* m_pIndexerThread;
+        TranslationUnit* m_pIndexedUnit; // owned here, filled by m_pIndexerThread
+        std::vector<ClWorkerProcess*> m_Workers;
+        wxString m_WorkerCommand;
+        unsigned m_MaxWorkers; // 0 to run jobs on m_pIndexerThread
+        unsigned long m_MemoryBudget;
+        unsigned long m_AccessTick;
 };
 
 #endif // CLANGPROXY_H
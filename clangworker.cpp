@@ -0,0 +1,130 @@
+/*
+ * Parse worker process: indexes files and precompiles headers for the
+ * plugin, so a crash in libclang costs one job instead of the IDE, and the
+ * memory libclang keeps is returned when the process exits
+ *
+ * Requests come on stdin and replies go to stdout, both as WorkerProtocol
+ * messages. The worker exits when stdin is closed.
+ */
+
+#include <sdk.h>
+
+#include <wx/init.h>
+#ifdef __WXMSW__
+    #include <fcntl.h>
+    #include <io.h>
+#endif // __WXMSW__
+
+#ifndef CB_PRECOMP
+    #include <cstdio>
+    #include <iostream>
+    #include <string>
+    #include <vector>
+#endif // CB_PRECOMP
+
+#include "tokendatabase.h"
+#include "translationunit.h"
+#include "workerprotocol.h"
+
+namespace
+{
+    /**
+     * Read the next request
+     *
+     * @param[out] request The first line, see WorkerProtocol
+     * @param[out] body The lines up to the end of the message
+     * @return false once stdin is closed
+     */
+    bool ReadMessage(wxString& request, wxString& body)
+    {
+        std::string line;
+        if (!std::getline(std::cin, line))
+            return false;
+        request = wxString::FromUTF8(line.c_str());
+        if (!request.IsEmpty() && request.Last() == wxT('\r'))
+            request.RemoveLast();
+        body.Empty();
+        while (std::getline(std::cin, line))
+        {
+            if (!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            if (line == WorkerProtocol::EndOfMessage)
+                return true;
+            body += wxString::FromUTF8(line.c_str()) + wxT('\n');
+        }
+        return false; // the plugin went away mid message
+    }
+
+    void WriteMessage(const wxString& reply)
+    {
+        const wxCharBuffer buffer = reply.ToUTF8();
+        std::fputs(buffer.data(), stdout);
+        std::fputs(WorkerProtocol::EndOfMessage, stdout);
+        std::fputc('\n', stdout);
+        std::fflush(stdout);
+    }
+
+    /**
+     * Parse a file to record its tokens, see TranslationUnit::Index()
+     *
+     * @param database Kept for the life of the process; files it holds are not harvested again
+     * @param seed Journal of the files the plugin indexed since the last job, to skip them as well
+     * @return The unit's records, followed by the journal of the tokens recorded
+     */
+    wxString IndexFile(TokenDatabase& database, bool useIndexer, const wxString& filename, const wxString& commands,
+                       const wxString& seed)
+    {
+        database.ApplyJournal(seed);
+        database.StartJournal();
+        CXIndex clIndex = clang_createIndex(0, 0);
+        CXIndexAction clIndexAction = (useIndexer ? clang_IndexAction_create(clIndex) : nullptr);
+        TranslationUnit translUnit(filename, commands);
+        translUnit.Index(clIndex, clIndexAction, &database);
+        if (clIndexAction)
+            clang_IndexAction_dispose(clIndexAction);
+        clang_disposeIndex(clIndex);
+        return translUnit.WriteIndexed(&database) + database.TakeJournal();
+    }
+
+    /// @return B (built or not) and U (dependency) records, see TranslationUnit::Precompile()
+    wxString PrecompileHeader(const wxString& header, const wxString& commands, const wxString& pchFile)
+    {
+        std::vector<wxString> dependencies;
+        CXIndex clIndex = clang_createIndex(0, 0);
+        const bool success = TranslationUnit::Precompile(clIndex, header, commands, pchFile, dependencies);
+        clang_disposeIndex(clIndex);
+        wxString reply = (success ? wxT("B\t1\n") : wxT("B\t0\n"));
+        for (std::vector<wxString>::const_iterator dpItr = dependencies.begin(); dpItr != dependencies.end(); ++dpItr)
+            reply += wxT("U\t") + WorkerProtocol::Escape(*dpItr) + wxT('\n');
+        return reply;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    wxInitializer initializer(argc, argv);
+    if (!initializer.IsOk())
+        return 1;
+#ifdef __WXMSW__
+    // the plugin sends and expects '\n' line ends
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif // __WXMSW__
+
+    TokenDatabase database;
+    wxString request, body;
+    std::vector<wxString> fields;
+    while (ReadMessage(request, body))
+    {
+        WorkerProtocol::SplitRecord(request, fields);
+        // index <harvest with the indexer: 0 or 1> <file> <commands>, the seed journal as body
+        if (fields[0] == wxT("index") && fields.size() == 4)
+            WriteMessage(IndexFile(database, fields[1] == wxT("1"), fields[2], fields[3], body));
+        // pch <header> <commands> <pch file>
+        else if (fields[0] == wxT("pch") && fields.size() == 4)
+            WriteMessage(PrecompileHeader(fields[1], fields[2], fields[3]));
+        else
+            WriteMessage(wxEmptyString); // read as a failed job
+    }
+    return 0;
+}
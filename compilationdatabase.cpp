@@ -0,0 +1,506 @@
+/*
+ * Reader/writer for JSON compilation databases (compile_commands.json)
+ */
+
+#include "compilationdatabase.h"
+
+#include <wx/arrstr.h>
+#include <wx/ffile.h>
+#include <wx/filename.h>
+
+namespace CompDbHelper
+{
+    /// Just enough JSON to read an array of compile command objects
+    class JsonReader
+    {
+        public:
+            JsonReader(const wxString& text) : m_Text(text), m_Pos(0) {}
+
+            bool AtEnd()
+            {
+                SkipWhitespace();
+                return m_Pos >= m_Text.Length();
+            }
+
+            /// Consume the character if it is next
+            bool Accept(wxChar ch)
+            {
+                SkipWhitespace();
+                if (m_Pos < m_Text.Length() && m_Text[m_Pos] == ch)
+                {
+                    ++m_Pos;
+                    return true;
+                }
+                return false;
+            }
+
+            bool ReadString(wxString& str)
+            {
+                if (!Accept(wxT('"')))
+                    return false;
+                str.Empty();
+                for (; m_Pos < m_Text.Length(); ++m_Pos)
+                {
+                    wxChar ch = m_Text[m_Pos];
+                    if (ch == wxT('"'))
+                    {
+                        ++m_Pos;
+                        return true;
+                    }
+                    if (ch == wxT('\\'))
+                    {
+                        if (++m_Pos >= m_Text.Length())
+                            break;
+                        ch = m_Text[m_Pos];
+                        switch (ch)
+                        {
+                            case wxT('b'): ch = wxT('\b'); break;
+                            case wxT('f'): ch = wxT('\f'); break;
+                            case wxT('n'): ch = wxT('\n'); break;
+                            case wxT('r'): ch = wxT('\r'); break;
+                            case wxT('t'): ch = wxT('\t'); break;
+                            case wxT('u'):
+                            {
+                                unsigned long code = 0;
+                                if (   m_Pos + 4 >= m_Text.Length()
+                                    || !m_Text.Mid(m_Pos + 1, 4).ToULong(&code, 16) )
+                                {
+                                    return false;
+                                }
+                                m_Pos += 4;
+                                ch = wxChar(code);
+                                break;
+                            }
+                            default: // '"', '\\' and '/' stand for themselves
+                                break;
+                        }
+                    }
+                    str += ch;
+                }
+                return false; // unterminated
+            }
+
+            bool ReadStringArray(wxArrayString& strs)
+            {
+                if (!Accept(wxT('[')))
+                    return false;
+                if (Accept(wxT(']')))
+                    return true;
+                do
+                {
+                    wxString str;
+                    if (!ReadString(str))
+                        return false;
+                    strs.Add(str);
+                } while (Accept(wxT(',')));
+                return Accept(wxT(']'));
+            }
+
+            /// Step over a value of any type
+            bool SkipValue()
+            {
+                SkipWhitespace();
+                if (m_Pos >= m_Text.Length())
+                    return false;
+                wxString str;
+                switch (wxChar(m_Text[m_Pos]))
+                {
+                    case wxT('"'):
+                        return ReadString(str);
+                    case wxT('['):
+                        ++m_Pos;
+                        if (Accept(wxT(']')))
+                            return true;
+                        do
+                        {
+                            if (!SkipValue())
+                                return false;
+                        } while (Accept(wxT(',')));
+                        return Accept(wxT(']'));
+                    case wxT('{'):
+                        ++m_Pos;
+                        if (Accept(wxT('}')))
+                            return true;
+                        do
+                        {
+                            if (!ReadString(str) || !Accept(wxT(':')) || !SkipValue())
+                                return false;
+                        } while (Accept(wxT(',')));
+                        return Accept(wxT('}'));
+                    default: // number, true, false, null
+                        break;
+                }
+                const size_t start = m_Pos;
+                while (   m_Pos < m_Text.Length()
+                       && wxString(wxT(",]} \t\r\n")).Find(m_Text[m_Pos]) == wxNOT_FOUND )
+                {
+                    ++m_Pos;
+                }
+                return m_Pos > start;
+            }
+
+        private:
+            void SkipWhitespace()
+            {
+                while (m_Pos < m_Text.Length() && wxIsspace(m_Text[m_Pos]))
+                    ++m_Pos;
+            }
+
+            const wxString& m_Text;
+            size_t m_Pos;
+    };
+
+    static wxString EscapeString(const wxString& str)
+    {
+        wxString escaped;
+        for (size_t i = 0; i < str.Length(); ++i)
+        {
+            const wxChar ch = str[i];
+            if (ch == wxT('"') || ch == wxT('\\'))
+                escaped += wxT('\\');
+            escaped += ch;
+        }
+        return wxT('"') + escaped + wxT('"');
+    }
+
+    // commands are quoted for the shell of the platform that wrote them, as clang's own reader assumes
+#ifndef __WXMSW__
+    /// Split a command line the way a POSIX shell would
+    static void SplitCommand(const wxString& command, wxArrayString& args)
+    {
+        wxString arg;
+        bool inArg = false;
+        wxChar quote = wxT('\0');
+        for (size_t i = 0; i < command.Length(); ++i)
+        {
+            const wxChar ch = command[i];
+            if (quote != wxT('\0'))
+            {
+                if (ch == quote)
+                    quote = wxT('\0');
+                else if (   ch == wxT('\\') && quote == wxT('"') && i + 1 < command.Length()
+                         && wxString(wxT("\"\\$`")).Find(command[i + 1]) != wxNOT_FOUND )
+                {
+                    arg += command[++i]; // elsewhere in double quotes a backslash is literal
+                }
+                else
+                    arg += ch;
+            }
+            else if (ch == wxT('"') || ch == wxT('\''))
+            {
+                quote = ch;
+                inArg = true;
+            }
+            else if (ch == wxT('\\') && i + 1 < command.Length())
+            {
+                arg += command[++i];
+                inArg = true;
+            }
+            else if (wxIsspace(ch))
+            {
+                if (inArg)
+                    args.Add(arg);
+                arg.Empty();
+                inArg = false;
+            }
+            else
+            {
+                arg += ch;
+                inArg = true;
+            }
+        }
+        if (inArg)
+            args.Add(arg);
+    }
+
+    /// Quote an argument so SplitCommand() reads it back unchanged
+    static wxString QuoteArgument(const wxString& arg)
+    {
+        if (!arg.IsEmpty() && arg.find_first_of(wxT(" \t\r\n\"'\\$`*?[]{}()<>|&;#~")) == wxString::npos)
+            return arg;
+        wxString quoted = arg;
+        quoted.Replace(wxT("'"), wxT("'\\''")); // end the quote, an escaped quote, quote again
+        return wxT('\'') + quoted + wxT('\'');
+    }
+#else
+    /**
+     * Split a command line the way CommandLineToArgvW() would
+     *
+     * Backslashes are literal unless they precede a double quote, so paths
+     * such as C:\src\main.cpp survive.
+     */
+    static void SplitCommand(const wxString& command, wxArrayString& args)
+    {
+        wxString arg;
+        bool inArg = false;
+        bool inQuotes = false;
+        for (size_t i = 0; i < command.Length(); ++i)
+        {
+            const wxChar ch = command[i];
+            if (ch == wxT('\\'))
+            {
+                size_t numSlashes = 1;
+                while (i + numSlashes < command.Length() && command[i + numSlashes] == wxT('\\'))
+                    ++numSlashes;
+                if (i + numSlashes < command.Length() && command[i + numSlashes] == wxT('"'))
+                {
+                    // 2n backslashes and a quote: n backslashes, then the quote delimits;
+                    // 2n + 1: n backslashes and a literal quote
+                    arg.Append(wxT('\\'), numSlashes / 2);
+                    if (numSlashes % 2 == 1)
+                    {
+                        arg += wxT('"');
+                        i += numSlashes;
+                    }
+                    else
+                        i += numSlashes - 1;
+                }
+                else
+                {
+                    arg.Append(wxT('\\'), numSlashes);
+                    i += numSlashes - 1;
+                }
+                inArg = true;
+            }
+            else if (ch == wxT('"'))
+            {
+                inQuotes = !inQuotes;
+                inArg = true;
+            }
+            else if (wxIsspace(ch) && !inQuotes)
+            {
+                if (inArg)
+                    args.Add(arg);
+                arg.Empty();
+                inArg = false;
+            }
+            else
+            {
+                arg += ch;
+                inArg = true;
+            }
+        }
+        if (inArg)
+            args.Add(arg);
+    }
+
+    /// Quote an argument the way CommandLineToArgvW() reads it back unchanged
+    static wxString QuoteArgument(const wxString& arg)
+    {
+        if (!arg.IsEmpty() && arg.find_first_of(wxT(" \t\r\n\"")) == wxString::npos)
+            return arg;
+        wxString quoted = wxT("\"");
+        size_t numSlashes = 0;
+        for (size_t i = 0; i < arg.Length(); ++i)
+        {
+            const wxChar ch = arg[i];
+            if (ch == wxT('\\'))
+                ++numSlashes;
+            else
+            {
+                if (ch == wxT('"')) // backslashes before a quote are doubled, and the quote escaped
+                    quoted.Append(wxT('\\'), numSlashes + 1);
+                numSlashes = 0;
+            }
+            quoted += ch;
+        }
+        quoted.Append(wxT('\\'), numSlashes); // so they do not escape the closing quote
+        return quoted + wxT('"');
+    }
+#endif // __WXMSW__
+
+    static wxString MakeAbsolute(const wxString& path, const wxString& directory)
+    {
+        wxFileName fn(path);
+        if (fn.Normalize(wxPATH_NORM_ALL & ~wxPATH_NORM_CASE, directory))
+            return fn.GetFullPath();
+        return path;
+    }
+
+    /**
+     * Reduce a full compiler invocation to the flags relevant to parsing
+     *
+     * Drops the compiler, the source file and output related switches, and
+     * makes include paths absolute. The result is quoted for SplitCommand().
+     */
+    static wxString ExtractFlags(const wxArrayString& args, const wxString& file, const wxString& directory)
+    {
+        wxArrayString pathSwitches; // those which may be followed by a separate path
+        pathSwitches.Add(wxT("-I"));
+        pathSwitches.Add(wxT("-include"));
+        pathSwitches.Add(wxT("-iquote"));
+        pathSwitches.Add(wxT("-isystem"));
+        wxArrayString outputSwitches;
+        outputSwitches.Add(wxT("-MF"));
+        outputSwitches.Add(wxT("-MQ"));
+        outputSwitches.Add(wxT("-MT"));
+        outputSwitches.Add(wxT("-o"));
+
+        wxArrayString flags;
+        for (size_t i = 1; i < args.GetCount(); ++i) // first is the compiler
+        {
+            const wxString& arg = args[i];
+            wxString pathStr;
+            if (outputSwitches.Index(arg) != wxNOT_FOUND)
+                ++i;
+            else if (   arg == wxT("-c") || arg == wxT("-MD") || arg == wxT("-MMD")
+                     || (arg.StartsWith(wxT("-o")) && arg.Length() > 2)
+                     || MakeAbsolute(arg, directory) == file )
+            {
+                continue;
+            }
+            else if (pathSwitches.Index(arg) != wxNOT_FOUND && i + 1 < args.GetCount())
+            {
+                flags.Add(arg);
+                flags.Add(MakeAbsolute(args[++i], directory));
+            }
+            else if (arg.StartsWith(wxT("-I"), &pathStr))
+                flags.Add(wxT("-I") + MakeAbsolute(pathStr, directory));
+            else
+                flags.Add(arg);
+        }
+        return CompilationDatabase::JoinCommand(flags);
+    }
+}
+
+bool CompilationDatabase::Load(const wxString& filename)
+{
+    Clear();
+    wxFFile file(filename);
+    wxString text;
+    if (!file.IsOpened() || !file.ReadAll(&text, wxConvUTF8))
+        return false;
+
+    CompDbHelper::JsonReader reader(text);
+    if (!reader.Accept(wxT('[')))
+        return false;
+    if (reader.Accept(wxT(']')))
+        return reader.AtEnd();
+    do
+    {
+        if (!reader.Accept(wxT('{')))
+            break;
+        wxString directory, source, command;
+        wxArrayString args;
+        if (!reader.Accept(wxT('}')))
+        {
+            do
+            {
+                wxString key;
+                if (!reader.ReadString(key) || !reader.Accept(wxT(':')))
+                    break;
+                bool valid;
+                if (key == wxT("directory"))
+                    valid = reader.ReadString(directory);
+                else if (key == wxT("file"))
+                    valid = reader.ReadString(source);
+                else if (key == wxT("command"))
+                    valid = reader.ReadString(command);
+                else if (key == wxT("arguments"))
+                    valid = reader.ReadStringArray(args);
+                else
+                    valid = reader.SkipValue();
+                if (!valid)
+                    break;
+            } while (reader.Accept(wxT(',')));
+            if (!reader.Accept(wxT('}')))
+                break;
+        }
+        if (source.IsEmpty())
+            continue;
+        if (args.IsEmpty()) // "arguments" takes precedence over "command"
+            CompDbHelper::SplitCommand(command, args);
+        const wxString& fullPath = CompDbHelper::MakeAbsolute(source, directory);
+        SetCommand(fullPath, directory, CompDbHelper::ExtractFlags(args, fullPath, directory));
+    } while (reader.Accept(wxT(',')));
+
+    if (!reader.Accept(wxT(']')) || !reader.AtEnd())
+    {
+        Clear();
+        return false;
+    }
+    m_Source = filename;
+    return true;
+}
+
+bool CompilationDatabase::Save(const wxString& filename, const wxString& compiler) const
+{
+    wxString text = wxT("[");
+    for (std::map<wxString, Entry>::const_iterator entItr = m_Entries.begin();
+         entItr != m_Entries.end(); ++entItr)
+    {
+        // an argument list needs no shell quoting, so every reader splits it the same way
+        wxArrayString args;
+        args.Add(compiler);
+        SplitCommand(entItr->second.flags, args);
+        args.Add(wxT("-c"));
+        args.Add(entItr->first);
+        if (entItr != m_Entries.begin())
+            text += wxT(",");
+        text += wxT("\n  {\n    \"directory\": ") + CompDbHelper::EscapeString(entItr->second.directory)
+              + wxT(",\n    \"arguments\": [");
+        for (size_t i = 0; i < args.GetCount(); ++i)
+            text += (i == 0 ? wxT("") : wxT(", ")) + CompDbHelper::EscapeString(args[i]);
+        text += wxT("],\n    \"file\": ") + CompDbHelper::EscapeString(entItr->first)
+              + wxT("\n  }");
+    }
+    text += wxT("\n]\n");
+
+    wxFFile file(filename, wxT("w"));
+    return file.IsOpened() && file.Write(text, wxConvUTF8);
+}
+
+void CompilationDatabase::Clear()
+{
+    m_Entries.clear();
+    m_Source.Empty();
+}
+
+void CompilationDatabase::SetCommand(const wxString& file, const wxString& directory, const wxString& flags)
+{
+    Entry& entry = m_Entries[NormalizePath(file)];
+    entry.directory = directory;
+    entry.flags = flags;
+}
+
+bool CompilationDatabase::GetCommand(const wxString& file, wxString& flags) const
+{
+    std::map<wxString, Entry>::const_iterator entItr = m_Entries.find(NormalizePath(file));
+    if (entItr == m_Entries.end())
+        return false;
+    flags = entItr->second.flags;
+    return true;
+}
+
+void CompilationDatabase::GetFiles(std::vector<wxString>& files) const
+{
+    for (std::map<wxString, Entry>::const_iterator entItr = m_Entries.begin();
+         entItr != m_Entries.end(); ++entItr)
+    {
+        files.push_back(entItr->first);
+    }
+}
+
+void CompilationDatabase::SplitCommand(const wxString& command, wxArrayString& args)
+{
+    CompDbHelper::SplitCommand(command, args);
+}
+
+wxString CompilationDatabase::JoinCommand(const wxArrayString& args)
+{
+    wxString command;
+    for (size_t i = 0; i < args.GetCount(); ++i)
+    {
+        if (i > 0)
+            command += wxT(' ');
+        command += CompDbHelper::QuoteArgument(args[i]);
+    }
+    return command;
+}
+
+wxString CompilationDatabase::NormalizePath(const wxString& file)
+{
+    wxFileName fln(file);
+    fln.Normalize(wxPATH_NORM_ALL & ~wxPATH_NORM_CASE);
+    return fln.GetFullPath();
+}
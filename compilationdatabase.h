@@ -0,0 +1,80 @@
+#ifndef COMPILATION_DATABASE_H
+#define COMPILATION_DATABASE_H
+
+#include <map>
+#include <vector>
+#include <wx/arrstr.h>
+#include <wx/string.h>
+
+/**
+ * Compile flags per source file, as read from (or written to) a
+ * compile_commands.json file
+ */
+class CompilationDatabase
+{
+    public:
+        /**
+         * Read a JSON compilation database, replacing the current contents
+         *
+         * @param filename Path to the compile_commands.json file
+         * @return false if the file is missing or malformed
+         */
+        bool Load(const wxString& filename);
+        /**
+         * Write the contents as a JSON compilation database
+         *
+         * Each command is written as an "arguments" list, so no reader has to
+         * guess at shell quoting.
+         *
+         * @param filename Path to the compile_commands.json file
+         * @param compiler Executable to prefix each command with
+         */
+        bool Save(const wxString& filename, const wxString& compiler) const;
+        void Clear();
+        bool IsEmpty() const { return m_Entries.empty(); }
+        /// Path of the file last loaded, or empty
+        const wxString& GetSource() const { return m_Source; }
+
+        /**
+         * Record the flags used to compile a file
+         *
+         * @param file The source file (absolute path)
+         * @param directory Working directory relative paths are resolved against
+         * @param flags Compiler flags, excluding the compiler, output and source file,
+         *              quoted as SplitCommand() expects
+         */
+        void SetCommand(const wxString& file, const wxString& directory, const wxString& flags);
+        /**
+         * Retrieve the flags to parse a file with
+         *
+         * @param file The source file
+         * @param[out] flags Compiler flags, with all include paths made absolute,
+         *                   quoted as SplitCommand() expects
+         * @return false if the file is not in the database
+         */
+        bool GetCommand(const wxString& file, wxString& flags) const;
+        /// All source files in the database
+        void GetFiles(std::vector<wxString>& files) const;
+
+        /**
+         * Split a command line into arguments, by the quoting rules of the
+         * platform's shell
+         */
+        static void SplitCommand(const wxString& command, wxArrayString& args);
+        /// Quote arguments into a command line SplitCommand() reads back unchanged
+        static wxString JoinCommand(const wxArrayString& args);
+
+    private:
+        struct Entry
+        {
+            wxString directory;
+            wxString flags;
+        };
+        /// Key files the way the token database does, so lookups match
+        static wxString NormalizePath(const wxString& file);
+
+        std::map<wxString, Entry> m_Entries;
+        wxString m_Source;
+};
+
+#endif // COMPILATION_DATABASE_H
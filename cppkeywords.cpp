@@ -0,0 +1,30 @@
+/*
+ * Keyword lookup for the documentation highlighter
+ */
+
+#include "cppkeywords.h"
+
+bool CppKeywords::IsKeyword(const wxChar* str, size_t length, const std::vector<wxString>& keywords)
+{
+    // binary search without building a wxString of the candidate
+    size_t first = 0;
+    size_t last = keywords.size();
+    while (first < last)
+    {
+        const size_t mid = first + (last - first) / 2;
+        const wxString& keyword = keywords[mid];
+        const size_t common = (keyword.Length() < length ? keyword.Length() : length);
+        int diff = 0;
+        for (size_t i = 0; i < common && diff == 0; ++i)
+            diff = static_cast<int>(keyword[i]) - static_cast<int>(str[i]);
+        if (diff == 0)
+            diff = (keyword.Length() < length ? -1 : (keyword.Length() > length ? 1 : 0));
+        if (diff == 0)
+            return true;
+        if (diff < 0)
+            first = mid + 1;
+        else
+            last = mid;
+    }
+    return false;
+}
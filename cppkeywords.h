@@ -0,0 +1,17 @@
+#ifndef CPP_KEYWORDS_H
+#define CPP_KEYWORDS_H
+
+#include <vector>
+#include <wx/string.h>
+
+namespace CppKeywords
+{
+    /**
+     * Is str[0, length) one of the given keywords? (no allocation)
+     *
+     * @param keywords Sorted, as from the editor colour set
+     */
+    bool IsKeyword(const wxChar* str, size_t length, const std::vector<wxString>& keywords);
+}
+
+#endif // CPP_KEYWORDS_H
@@ -0,0 +1,237 @@
+/*
+ * Fuzzy (subsequence) matching of completion candidates
+ */
+
+#include "fuzzymatcher.h"
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define FUZZY_USE_SSE2
+    #include <emmintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#endif
+
+namespace
+{
+    const size_t npos = static_cast<size_t>(-1);
+    const size_t padding = 16; // so a vector load starting at any character stays in the buffer
+
+    // score components
+    const int scoreMatch       = 1;
+    const int scoreWordStart   = 6;
+    const int scoreConsecutive = 4;
+    const int scoreFirstChar   = 8; // the pattern starts at the very beginning
+    const int scoreExactLength = 4; // nothing left over
+    const int maxLeadingGap    = 3; // penalty per skipped leading character, capped
+
+#ifdef FUZZY_USE_SSE2
+    inline unsigned CountTrailingZeros(unsigned mask)
+    {
+    #ifdef _MSC_VER
+        unsigned long idx;
+        _BitScanForward(&idx, mask);
+        return idx;
+    #else
+        return __builtin_ctz(mask);
+    #endif
+    }
+#endif // FUZZY_USE_SSE2
+
+    /// Position of the first occurrence of ch in str[pos, length), or npos
+    inline size_t FindChar(const char* str, size_t pos, size_t length, char ch)
+    {
+#ifdef FUZZY_USE_SSE2
+        const __m128i needle = _mm_set1_epi8(ch);
+        for (; pos < length; pos += 16)
+        {
+            // reading past the end is safe because of the padding
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + pos));
+            const unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+            if (mask)
+            {
+                pos += CountTrailingZeros(mask);
+                return (pos < length ? pos : npos);
+            }
+        }
+        return npos;
+#else
+        const void* found = memchr(str + pos, ch, length - pos);
+        return (found ? static_cast<const char*>(found) - str : npos);
+#endif // FUZZY_USE_SSE2
+    }
+
+    inline bool IsUpper(char ch) { return ch >= 'A' && ch <= 'Z'; }
+    inline bool IsLower(char ch) { return (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9'); }
+
+    /// One bit per letter (case folded), one for digits, one for anything else
+    inline unsigned CharSetBit(char ch)
+    {
+        if (ch >= 'a' && ch <= 'z')
+            return 1u << (ch - 'a');
+        if (ch >= 'A' && ch <= 'Z')
+            return 1u << (ch - 'A');
+        if (ch >= '0' && ch <= '9')
+            return 1u << 26;
+        return 1u << 27;
+    }
+
+    inline unsigned CharSet(const char* str, size_t length)
+    {
+        unsigned charSet = 0;
+        for (size_t i = 0; i < length; ++i)
+            charSet |= CharSetBit(str[i]);
+        return charSet;
+    }
+
+    /// Append the ASCII lower case form of name[0, length) to out
+    void AppendLower(const char* name, size_t length, char* out)
+    {
+        size_t i = 0;
+#ifdef FUZZY_USE_SSE2
+        const __m128i beforeA = _mm_set1_epi8('A' - 1);
+        const __m128i afterZ  = _mm_set1_epi8('Z' + 1);
+        const __m128i caseBit = _mm_set1_epi8(0x20);
+        for (; i + 16 <= length; i += 16)
+        {
+            // bytes >= 0x80 are negative as signed, so never classed as upper case
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(name + i));
+            const __m128i isUpper = _mm_and_si128(_mm_cmpgt_epi8(chunk, beforeA), _mm_cmplt_epi8(chunk, afterZ));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                             _mm_add_epi8(chunk, _mm_and_si128(isUpper, caseBit)));
+        }
+#endif // FUZZY_USE_SSE2
+        for (; i < length; ++i)
+            out[i] = (IsUpper(name[i]) ? name[i] - 'A' + 'a' : name[i]);
+    }
+}
+
+FuzzyMatcher::FuzzyMatcher()
+{
+    Clear();
+}
+
+void FuzzyMatcher::Clear()
+{
+    m_Names.assign(padding, '\0');
+    m_Starts.assign(padding, 0);
+    m_Offsets.clear();
+    m_Lengths.clear();
+    m_CharSets.clear();
+}
+
+void FuzzyMatcher::AddCandidate(const char* name)
+{
+    const size_t length = strlen(name);
+    const size_t offset = m_Names.size() - padding;
+    m_Offsets.push_back(offset);
+    m_Lengths.push_back(length);
+    m_CharSets.push_back(CharSet(name, length));
+    m_Names.resize(offset + length + padding, '\0');
+    AppendLower(name, length, &m_Names[offset]);
+    m_Starts.resize(m_Names.size(), 0);
+    for (size_t i = 0; i < length; ++i)
+    {
+        const char ch = name[i];
+        const bool isStart =
+               i == 0
+            || (name[i - 1] == '_' && ch != '_')
+            || (IsUpper(ch) && IsLower(name[i - 1]))               // camelCase
+            || (IsUpper(ch) && IsUpper(name[i - 1]) && i + 1 < length
+                && name[i + 1] >= 'a' && name[i + 1] <= 'z');           // the P in HTMLParser
+        m_Starts[offset + i] = isStart;
+    }
+}
+
+std::string FuzzyMatcher::PreparePattern(const char* pattern)
+{
+    std::string prepared(pattern);
+    if (!prepared.empty())
+        AppendLower(pattern, prepared.length(), &prepared[0]);
+    return prepared;
+}
+
+int FuzzyMatcher::GetMaxScore(const std::string& pattern)
+{
+    if (pattern.empty())
+        return 0;
+    return   maxLeadingGap + scoreFirstChar + scoreExactLength
+           + pattern.length() * (scoreMatch + scoreWordStart)
+           + (pattern.length() - 1) * scoreConsecutive;
+}
+
+bool FuzzyMatcher::IsSubsequence(const char* name, size_t pos, size_t length,
+                                 const std::string& pattern, size_t patIdx) const
+{
+    for (; patIdx < pattern.length(); ++patIdx, ++pos)
+    {
+        pos = FindChar(name, pos, length, pattern[patIdx]);
+        if (pos == npos)
+            return false;
+    }
+    return true;
+}
+
+int FuzzyMatcher::Score(size_t candidate, const std::string& pattern) const
+{
+    const size_t length = m_Lengths[candidate];
+    if (length == 0 || length < pattern.length())
+        return -1;
+    if (pattern.empty())
+        return 0;
+    const unsigned patternSet = CharSet(pattern.c_str(), pattern.length());
+    if (patternSet & ~m_CharSets[candidate]) // cheap rejection of most candidates
+        return -1;
+    const char* name = &m_Names[m_Offsets[candidate]];
+    const unsigned char* starts = &m_Starts[m_Offsets[candidate]];
+
+    int score = maxLeadingGap; // so every match scores at least 0
+    size_t pos = 0;
+    size_t prevMatch = npos;
+    for (size_t patIdx = 0; patIdx < pattern.length(); ++patIdx)
+    {
+        size_t match = FindChar(name, pos, length, pattern[patIdx]);
+        if (match == npos)
+            return -1;
+        if (match != prevMatch + 1 && !starts[match])
+        {
+            // a later word start is a better anchor, if the rest of the pattern still fits after it
+            for (size_t next = FindChar(name, match + 1, length, pattern[patIdx]);
+                 next != npos; next = FindChar(name, next + 1, length, pattern[patIdx]))
+            {
+                if (starts[next])
+                {
+                    if (IsSubsequence(name, next + 1, length, pattern, patIdx + 1))
+                        match = next;
+                    break;
+                }
+            }
+        }
+        score += scoreMatch;
+        if (starts[match])
+            score += scoreWordStart;
+        if (patIdx == 0)
+        {
+            if (match == 0)
+                score += scoreFirstChar;
+            else
+                score -= (match < static_cast<size_t>(maxLeadingGap) ? match : maxLeadingGap);
+        }
+        else if (match == prevMatch + 1)
+            score += scoreConsecutive;
+        prevMatch = match;
+        pos = match + 1;
+    }
+    if (pattern.length() == length)
+        score += scoreExactLength;
+    return score;
+}
+
+bool FuzzyMatcher::StartsWith(size_t candidate, const char* prefix) const
+{
+    const size_t prefixLength = strlen(prefix);
+    return    m_Lengths[candidate] >= prefixLength
+           && memcmp(&m_Names[m_Offsets[candidate]], prefix, prefixLength) == 0;
+}
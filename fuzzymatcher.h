@@ -0,0 +1,54 @@
+#ifndef FUZZY_MATCHER_H
+#define FUZZY_MATCHER_H
+
+#include <string>
+#include <vector>
+
+/**
+ * Case insensitive subsequence matcher for completion candidates
+ *
+ * Candidates are stored lower cased in one packed buffer, together with a
+ * flag per character marking word starts (camelCase humps and the character
+ * after an underscore), so matching a pattern against thousands of names
+ * allocates nothing.
+ */
+class FuzzyMatcher
+{
+    public:
+        FuzzyMatcher();
+
+        void Clear();
+        /// Append a candidate (UTF-8); its index is the number of candidates added before it
+        void AddCandidate(const char* name);
+        size_t GetCount() const { return m_Offsets.size(); }
+
+        /// Lower case a pattern (UTF-8) for use with Score()
+        static std::string PreparePattern(const char* pattern);
+        /// The score of a candidate equal to the pattern
+        static int GetMaxScore(const std::string& pattern);
+
+        /**
+         * Rate how well a candidate matches a pattern
+         *
+         * @param candidate Index of the candidate
+         * @param pattern Result of PreparePattern()
+         * @return -1 if the pattern is not a subsequence of the candidate,
+         *         otherwise higher is better, up to GetMaxScore()
+         */
+        int Score(size_t candidate, const std::string& pattern) const;
+        /// Does the candidate start with the (lower case) prefix?
+        bool StartsWith(size_t candidate, const char* prefix) const;
+
+    private:
+        /// Is pattern[patIdx...] a subsequence of the candidate text from pos on?
+        bool IsSubsequence(const char* name, size_t pos, size_t length,
+                           const std::string& pattern, size_t patIdx) const;
+
+        std::vector<char> m_Names;          // lower case, packed, padded for vector loads
+        std::vector<unsigned char> m_Starts; // 1 where a word starts, parallel to m_Names
+        std::vector<unsigned> m_Offsets;
+        std::vector<unsigned> m_Lengths;
+        std::vector<unsigned> m_CharSets;    // characters present, for quick rejection
+};
+
+#endif // FUZZY_MATCHER_H
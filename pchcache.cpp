@@ -0,0 +1,368 @@
+/*
+ * Precompiled headers shared by the sources of a project
+ */
+
+#include "pchcache.h"
+
+#include <wx/ffile.h>
+#include <wx/filefn.h>
+#include <wx/filename.h>
+#include <wx/tokenzr.h>
+
+namespace PchHelper
+{
+    static wxString NormalizePath(const wxString& file)
+    {
+        wxFileName fln(file);
+        fln.Normalize(wxPATH_NORM_ALL & ~wxPATH_NORM_CASE);
+        return fln.GetFullPath();
+    }
+
+    static unsigned HashString(const wxString& str)
+    {
+        unsigned hash = 2166136261u;
+        for (size_t i = 0; i < str.Length(); ++i)
+        {
+            hash ^= static_cast<unsigned>(wxChar(str[i]));
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    static bool ReadFile(const wxString& filename, wxString& text)
+    {
+        wxFFile file(filename);
+        return file.IsOpened() && file.ReadAll(&text, wxConvUTF8);
+    }
+}
+
+void PchCache::Clear()
+{
+    m_Entries.clear();
+    m_Sources.clear();
+}
+
+void PchCache::Analyse(const std::vector< std::pair<wxString, wxString> >& sources)
+{
+    Clear();
+    if (m_Directory.IsEmpty())
+        return;
+    if (!wxDirExists(m_Directory) && !wxFileName::Mkdir(m_Directory, 0777, wxPATH_MKDIR_FULL))
+        return;
+
+    // C and C++ sources with the same flags still need different PCHs
+    std::map< wxString, std::vector<size_t> > groups;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        const bool isC = sources[i].first.EndsWith(wxT(".c"));
+        groups[sources[i].second + (isC ? wxT("\tc") : wxT("\tc++"))].push_back(i);
+    }
+    for (std::map< wxString, std::vector<size_t> >::const_iterator grpItr = groups.begin();
+         grpItr != groups.end(); ++grpItr)
+    {
+        const std::vector<size_t>& group = grpItr->second;
+        if (group.size() < 2)
+            continue;
+        std::vector< std::vector<wxString> > includes(group.size());
+        for (size_t i = 0; i < group.size(); ++i)
+            ReadIncludePrefix(sources[group[i]].first, includes[i]);
+
+        // extend the prefix while at least half of the group agrees on the next include
+        std::vector<wxString> prefix;
+        std::vector<size_t> matching; // indices into group
+        for (size_t i = 0; i < group.size(); ++i)
+            matching.push_back(i);
+        for (size_t depth = 0; ; ++depth)
+        {
+            std::map<wxString, size_t> counts;
+            for (std::vector<size_t>::const_iterator mtItr = matching.begin(); mtItr != matching.end(); ++mtItr)
+            {
+                if (includes[*mtItr].size() > depth)
+                    ++counts[includes[*mtItr][depth]];
+            }
+            std::map<wxString, size_t>::const_iterator best = counts.end();
+            for (std::map<wxString, size_t>::const_iterator cntItr = counts.begin(); cntItr != counts.end(); ++cntItr)
+            {
+                if (best == counts.end() || cntItr->second > best->second)
+                    best = cntItr;
+            }
+            if (best == counts.end() || best->second < 2 || best->second * 2 < group.size())
+                break;
+            prefix.push_back(best->first);
+            std::vector<size_t> next;
+            for (std::vector<size_t>::const_iterator mtItr = matching.begin(); mtItr != matching.end(); ++mtItr)
+            {
+                if (includes[*mtItr].size() > depth && includes[*mtItr][depth] == best->first)
+                    next.push_back(*mtItr);
+            }
+            matching.swap(next);
+        }
+        if (prefix.empty())
+            continue;
+
+        wxString headerText;
+        for (std::vector<wxString>::const_iterator incItr = prefix.begin(); incItr != prefix.end(); ++incItr)
+            headerText += wxT("#include ") + *incItr + wxT('\n');
+        const wxString& flags = grpItr->first.BeforeLast(wxT('\t'));
+        const bool isC = (grpItr->first.AfterLast(wxT('\t')) == wxT("c"));
+        Entry entry;
+        entry.flags = flags + (isC ? wxT(" -x c-header") : wxT(" -x c++-header"));
+        // a different prefix or flag set gets a different header, so a header never changes
+        entry.baseName = wxString::Format(wxT("pch_%08x"), PchHelper::HashString(grpItr->first + wxT('\n') + headerText));
+        const wxString& header = m_Directory + wxFILE_SEP_PATH + entry.baseName + wxT(".h");
+        if (!wxFileExists(header))
+        {
+            wxFFile file(header, wxT("w"));
+            if (!file.IsOpened() || !file.Write(headerText, wxConvUTF8))
+                continue;
+        }
+        LoadManifest(entry);
+        for (std::vector<size_t>::const_iterator mtItr = matching.begin(); mtItr != matching.end(); ++mtItr)
+            m_Sources[PchHelper::NormalizePath(sources[group[*mtItr]].first)] = m_Entries.size();
+        m_Entries.push_back(entry);
+    }
+}
+
+bool PchCache::HasStale() const
+{
+    for (std::vector<Entry>::const_iterator entItr = m_Entries.begin(); entItr != m_Entries.end(); ++entItr)
+    {
+        if (entItr->state == psStale && !IsUnsaved(*entItr))
+            return true;
+    }
+    return false;
+}
+
+bool PchCache::GetStale(wxString& header, wxString& flags, wxString& pchFile) const
+{
+    for (std::vector<Entry>::const_iterator entItr = m_Entries.begin(); entItr != m_Entries.end(); ++entItr)
+    {
+        if (entItr->state != psStale || IsUnsaved(*entItr))
+            continue;
+        header = m_Directory + wxFILE_SEP_PATH + entItr->baseName + wxT(".h");
+        flags = entItr->flags;
+        pchFile = GetPchFile(*entItr, entItr->version + 1);
+        return true;
+    }
+    return false;
+}
+
+void PchCache::SetBuilt(const wxString& pchFile, bool success, const std::vector<wxString>& dependencies)
+{
+    for (std::vector<Entry>::iterator entItr = m_Entries.begin(); entItr != m_Entries.end(); ++entItr)
+    {
+        if (entItr->state != psStale || GetPchFile(*entItr, entItr->version + 1) != pchFile)
+            continue;
+        const wxString& header = PchHelper::NormalizePath(m_Directory + wxFILE_SEP_PATH + entItr->baseName + wxT(".h"));
+        entItr->dependencies.clear();
+        for (std::vector<wxString>::const_iterator depItr = dependencies.begin(); depItr != dependencies.end(); ++depItr)
+        {
+            const wxString& dependency = PchHelper::NormalizePath(*depItr);
+            if (dependency != header)
+                entItr->dependencies[dependency] = wxFileModificationTime(dependency);
+        }
+        if (!success)
+        {
+            // retried once one of the headers changes
+            entItr->state = psFailed;
+            entItr->usedFlags.Empty();
+            return;
+        }
+        ++entItr->version;
+        entItr->state = psBuilt;
+        // quoted, the configuration folder may contain spaces
+        entItr->usedFlags = wxT(" -include-pch \"") + pchFile + wxT('"');
+        SaveManifest(*entItr);
+        // units are moved off the previous build now, the one before is certainly unused
+        if (entItr->version > 1 && wxFileExists(GetPchFile(*entItr, entItr->version - 2)))
+            wxRemoveFile(GetPchFile(*entItr, entItr->version - 2));
+        return;
+    }
+}
+
+wxString PchCache::GetIncludeFlags(const wxString& file)
+{
+    std::map<wxString, size_t>::const_iterator srcItr = m_Sources.find(PchHelper::NormalizePath(file));
+    if (srcItr == m_Sources.end() || !IsUsable(m_Entries[srcItr->second]))
+        return wxEmptyString;
+    return m_Entries[srcItr->second].usedFlags;
+}
+
+bool PchCache::FileChanged(const wxString& file, bool unsaved)
+{
+    wxString normFile;
+    if (unsaved)
+    {
+        // once per editing session; this is called for every keystroke
+        if (m_Unsaved.find(file) != m_Unsaved.end())
+            return false;
+        normFile = PchHelper::NormalizePath(file);
+        m_Unsaved[file] = normFile;
+    }
+    else
+    {
+        std::map<wxString, wxString>::iterator unsItr = m_Unsaved.find(file);
+        if (unsItr != m_Unsaved.end())
+        {
+            normFile = unsItr->second;
+            m_Unsaved.erase(unsItr);
+        }
+        else
+            normFile = PchHelper::NormalizePath(file);
+    }
+    bool affected = false;
+    for (std::vector<Entry>::iterator entItr = m_Entries.begin(); entItr != m_Entries.end(); ++entItr)
+    {
+        std::map<wxString, time_t>::const_iterator depItr = entItr->dependencies.find(normFile);
+        if (depItr == entItr->dependencies.end())
+            continue;
+        affected = true;
+        // a file closed without saving leaves the PCH as good as it was
+        if (!unsaved && entItr->state != psStale && wxFileModificationTime(normFile) != depItr->second)
+            entItr->state = psStale;
+    }
+    return affected;
+}
+
+void PchCache::GetFlagsChanges(std::vector<FlagsChange>& changes)
+{
+    for (size_t i = 0; i < m_Entries.size(); ++i)
+    {
+        Entry& entry = m_Entries[i];
+        const wxString& flags = (IsUsable(entry) ? entry.usedFlags : wxString());
+        if (flags == entry.attachedFlags)
+            continue;
+        changes.push_back(FlagsChange());
+        changes.back().oldFlags = entry.attachedFlags;
+        changes.back().newFlags = flags;
+        for (std::map<wxString, size_t>::const_iterator srcItr = m_Sources.begin(); srcItr != m_Sources.end(); ++srcItr)
+        {
+            if (srcItr->second == i)
+                changes.back().sources.push_back(srcItr->first);
+        }
+        entry.attachedFlags = flags;
+    }
+}
+
+void PchCache::ReadIncludePrefix(const wxString& file, std::vector<wxString>& includes)
+{
+    wxString text;
+    if (!PchHelper::ReadFile(file, text))
+        return;
+    const wxString& directory = wxFileName(file).GetPath(wxPATH_GET_VOLUME | wxPATH_GET_SEPARATOR);
+    bool inComment = false;
+    wxStringTokenizer lines(text, wxT("\r\n"));
+    while (lines.HasMoreTokens())
+    {
+        wxString line = lines.GetNextToken().Trim().Trim(false);
+        if (inComment)
+        {
+            if (line.Find(wxT("*/")) == wxNOT_FOUND)
+                continue;
+            line = line.Mid(line.Find(wxT("*/")) + 2).Trim(false);
+            inComment = false;
+        }
+        if (line.StartsWith(wxT("/*")))
+        {
+            if (line.Find(wxT("*/")) == wxNOT_FOUND)
+            {
+                inComment = true;
+                continue;
+            }
+            line = line.Mid(line.Find(wxT("*/")) + 2).Trim(false);
+        }
+        if (line.IsEmpty() || line.StartsWith(wxT("//")))
+            continue;
+
+        wxString afterHash, directive;
+        if (!line.StartsWith(wxT("#"), &afterHash) || !afterHash.Trim(false).StartsWith(wxT("include"), &directive))
+            break; // code, or a directive that may change what the includes mean
+        directive.Trim(false);
+        if (directive.StartsWith(wxT("<")) && directive.Find(wxT('>')) != wxNOT_FOUND)
+            includes.push_back(directive.BeforeFirst(wxT('>')) + wxT('>'));
+        else if (directive.StartsWith(wxT("\"")) && directive.Mid(1).Find(wxT('"')) != wxNOT_FOUND)
+        {
+            const wxString& name = directive.Mid(1).BeforeFirst(wxT('"'));
+            if (wxFileExists(directory + name))
+                includes.push_back(wxT('"') + PchHelper::NormalizePath(directory + name) + wxT('"'));
+            else
+                includes.push_back(wxT('"') + name + wxT('"'));
+        }
+        else
+            break; // computed include
+    }
+}
+
+wxString PchCache::GetPchFile(const Entry& entry, unsigned version) const
+{
+    return m_Directory + wxFILE_SEP_PATH + entry.baseName + wxString::Format(wxT("_%u.pch"), version);
+}
+
+bool PchCache::IsUnsaved(const Entry& entry) const
+{
+    for (std::map<wxString, wxString>::const_iterator unsItr = m_Unsaved.begin(); unsItr != m_Unsaved.end(); ++unsItr)
+    {
+        if (entry.dependencies.count(unsItr->second))
+            return true;
+    }
+    return false;
+}
+
+bool PchCache::IsUsable(Entry& entry)
+{
+    if (entry.state != psBuilt || IsUnsaved(entry))
+        return false;
+    for (std::map<wxString, time_t>::const_iterator depItr = entry.dependencies.begin();
+         depItr != entry.dependencies.end(); ++depItr)
+    {
+        if (wxFileModificationTime(depItr->first) != depItr->second) // changed outside the editors
+        {
+            entry.state = psStale;
+            return false;
+        }
+    }
+    return true;
+}
+
+void PchCache::LoadManifest(Entry& entry)
+{
+    wxString text;
+    if (!PchHelper::ReadFile(m_Directory + wxFILE_SEP_PATH + entry.baseName + wxT(".deps"), text))
+        return;
+    wxStringTokenizer lines(text, wxT("\n"));
+    unsigned long version;
+    if (!lines.GetNextToken().ToULong(&version))
+        return;
+    entry.version = version; // the next build gets a new name even if this one is stale
+    if (!wxFileExists(GetPchFile(entry, entry.version)))
+        return;
+    std::map<wxString, time_t> dependencies;
+    while (lines.HasMoreTokens())
+    {
+        const wxString& line = lines.GetNextToken();
+        long modTime;
+        const wxString& dependency = line.AfterFirst(wxT('\t'));
+        if (   !line.BeforeFirst(wxT('\t')).ToLong(&modTime) || !wxFileExists(dependency)
+            || wxFileModificationTime(dependency) != static_cast<time_t>(modTime) )
+        {
+            return; // rebuild
+        }
+        dependencies[dependency] = modTime;
+    }
+    entry.dependencies.swap(dependencies);
+    entry.state = psBuilt;
+    entry.usedFlags = wxT(" -include-pch \"") + GetPchFile(entry, entry.version) + wxT('"');
+}
+
+void PchCache::SaveManifest(const Entry& entry) const
+{
+    wxString text = wxString::Format(wxT("%u\n"), entry.version);
+    for (std::map<wxString, time_t>::const_iterator depItr = entry.dependencies.begin();
+         depItr != entry.dependencies.end(); ++depItr)
+    {
+        text += wxString::Format(wxT("%ld\t"), static_cast<long>(depItr->second)) + depItr->first + wxT('\n');
+    }
+    wxFFile file(m_Directory + wxFILE_SEP_PATH + entry.baseName + wxT(".deps"), wxT("w"));
+    if (file.IsOpened())
+        file.Write(text, wxConvUTF8);
+}
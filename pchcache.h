@@ -0,0 +1,111 @@
+#ifndef PCH_CACHE_H
+#define PCH_CACHE_H
+
+#include <ctime>
+#include <map>
+#include <vector>
+#include <wx/string.h>
+
+/**
+ * Precompiled headers shared by the sources of a project
+ *
+ * Sources are grouped by their compile flags; the leading includes most of a
+ * group has in common are written to a header, which is precompiled once and
+ * passed with -include-pch to every source of the group that starts with
+ * those includes. Built headers are kept (with the files they depend on) in a
+ * cache directory, so they survive between sessions.
+ */
+class PchCache
+{
+    public:
+        /// Where generated headers and PCHs are written
+        void SetDirectory(const wxString& directory) { m_Directory = directory; }
+        void Clear();
+        /**
+         * Group sources by flags, and find the include prefix shared by most of each group
+         *
+         * @param sources (file, flags) of each source
+         */
+        void Analyse(const std::vector< std::pair<wxString, wxString> >& sources);
+
+        /// Does a PCH wait to be (re)built?
+        bool HasStale() const;
+        /**
+         * Select the next PCH to build
+         *
+         * PCHs built from a file an editor modified wait until it is saved.
+         *
+         * @param[out] header The generated header listing the shared includes
+         * @param[out] flags Flags to build it with
+         * @param[out] pchFile Where to write it
+         * @return false if all are built (or failed)
+         */
+        bool GetStale(wxString& header, wxString& flags, wxString& pchFile) const;
+        /**
+         * Record the outcome of building a PCH returned by GetStale()
+         *
+         * @param dependencies Files the PCH was built from
+         */
+        void SetBuilt(const wxString& pchFile, bool success, const std::vector<wxString>& dependencies);
+        /**
+         * Flags selecting the shared PCH for a source (empty if it has none)
+         *
+         * A PCH is not used while one of the files it was built from is
+         * modified in an editor or newer than the PCH; libclang would reject it.
+         */
+        wxString GetIncludeFlags(const wxString& file);
+        /**
+         * A file was modified in an editor, or saved or closed
+         *
+         * @param unsaved The editor holds changes that are not on disk
+         * @return false if this cannot change which PCHs are usable
+         */
+        bool FileChanged(const wxString& file, bool unsaved);
+
+        struct FlagsChange
+        {
+            wxString oldFlags; // what units were given (empty if none)
+            wxString newFlags; // what they must use now (empty if none)
+            std::vector<wxString> sources;
+        };
+        /// Collect PCHs whose flags changed since the last call, after FileChanged() or SetBuilt()
+        void GetFlagsChanges(std::vector<FlagsChange>& changes);
+
+        /**
+         * Read the include directives a source starts with
+         *
+         * Quoted includes found beside the source are made absolute, so the
+         * prefix means the same in any directory.
+         */
+        static void ReadIncludePrefix(const wxString& file, std::vector<wxString>& includes);
+
+    private:
+        enum State { psStale, psBuilt, psFailed };
+        struct Entry
+        {
+            Entry() : version(0), state(psStale) {}
+
+            wxString flags;    // to build with
+            wxString baseName; // of the header, PCHs and manifest; a hash of flags and includes
+            unsigned version;  // the PCH file is versioned, as units may still use the previous one
+            State state;
+            wxString usedFlags; // what units may be given for the last successful build
+            wxString attachedFlags; // what units were given, as of the last GetFlagsChanges()
+            std::map<wxString, time_t> dependencies;
+        };
+
+        wxString GetPchFile(const Entry& entry, unsigned version) const;
+        bool IsUnsaved(const Entry& entry) const;
+        /// Built, and none of its dependencies changed since (marked stale otherwise)
+        bool IsUsable(Entry& entry);
+        /// Adopt the PCH of a previous session if none of its dependencies changed
+        void LoadManifest(Entry& entry);
+        void SaveManifest(const Entry& entry) const;
+
+        std::vector<Entry> m_Entries;
+        std::map<wxString, size_t> m_Sources; // entry of each source using a PCH
+        std::map<wxString, wxString> m_Unsaved; // normalized paths of files modified in editors, by editor filename
+        wxString m_Directory;
+};
+
+#endif // PCH_CACHE_H
@@ -4,25 +4,37 @@
 
 #include "tokendatabase.h"
 
+#include <wx/ffile.h>
+#include <wx/filefn.h>
 #include <wx/filename.h>
 #include <wx/string.h>
+#include <wx/thread.h>
+#include <wx/tokenzr.h>
 
 #include "treemap.h"
+#include "workerprotocol.h"
 
 TokenDatabase::TokenDatabase() :
+    m_pMutex(new wxMutex(wxMUTEX_RECURSIVE)),
     m_pTokens(new TreeMap<AbstractToken>()),
-    m_pFilenames(new TreeMap<wxString>())
+    m_pFilenames(new TreeMap<wxString>()),
+    m_pSignatures(new std::map<TokenId, Signature>()),
+    m_pJournal(nullptr)
 {
 }
 
 TokenDatabase::~TokenDatabase()
 {
+    delete m_pJournal;
+    delete m_pSignatures;
     delete m_pFilenames;
     delete m_pTokens;
+    delete m_pMutex;
 }
 
 FileId TokenDatabase::GetFilenameId(const wxString& filename)
 {
+    wxMutexLocker lock(*m_pMutex);
     wxFileName fln(filename);
     fln.Normalize(wxPATH_NORM_ALL & ~wxPATH_NORM_CASE);
     const wxString& normFile = fln.GetFullPath(wxPATH_UNIX);
@@ -34,19 +46,31 @@ FileId TokenDatabase::GetFilenameId(const wxString& filename)
 
 wxString TokenDatabase::GetFilename(FileId fId) const
 {
-    return m_pFilenames->GetValue(fId);
+    wxMutexLocker lock(*m_pMutex);
+    return wxString(m_pFilenames->GetValue(fId).c_str()); // deep copy, the caller may be another thread
 }
 
 TokenId TokenDatabase::InsertToken(const wxString& identifier, const AbstractToken& token)
 {
+    wxMutexLocker lock(*m_pMutex);
     TokenId tId = GetTokenId(identifier, token.tokenHash);
     if (tId == wxNOT_FOUND)
-        return m_pTokens->Insert(identifier, token);
+        tId = m_pTokens->Insert(wxString(identifier.c_str()), token); // never share a buffer with the caller
+    if (m_pJournal && m_JournalTokens.find(tId) == m_JournalTokens.end())
+    {
+        const AbstractToken& stored = m_pTokens->GetValue(tId);
+        const size_t fileIdx = JournalFile(stored.fileId);
+        m_JournalTokens.insert(std::make_pair(tId, m_JournalTokens.size()));
+        *m_pJournal += wxString::Format(wxT("T\t%lu\t%d\t%d\t%u\t"), static_cast<unsigned long>(fileIdx),
+                                        stored.line, stored.column, stored.tokenHash)
+                     + WorkerProtocol::Escape(identifier) + wxT('\n');
+    }
     return tId;
 }
 
 TokenId TokenDatabase::GetTokenId(const wxString& identifier, unsigned tokenHash) const
 {
+    wxMutexLocker lock(*m_pMutex);
     std::vector<int> ids = m_pTokens->GetIdSet(identifier);
     for (std::vector<int>::const_iterator itr = ids.begin();
          itr != ids.end(); ++itr)
@@ -57,18 +81,370 @@ TokenId TokenDatabase::GetTokenId(const wxString& identifier, unsigned tokenHash
     return wxNOT_FOUND;
 }
 
-AbstractToken& TokenDatabase::GetToken(TokenId tId) const
+AbstractToken TokenDatabase::GetToken(TokenId tId) const
 {
+    wxMutexLocker lock(*m_pMutex);
     return m_pTokens->GetValue(tId);
 }
 
 std::vector<TokenId> TokenDatabase::GetTokenMatches(const wxString& identifier) const
 {
+    wxMutexLocker lock(*m_pMutex);
     return m_pTokens->GetIdSet(identifier);
 }
 
+void TokenDatabase::SetSignature(TokenId tId, const std::vector<wxString>& signature)
+{
+    wxMutexLocker lock(*m_pMutex);
+    Signature& sig = (*m_pSignatures)[tId];
+    sig.generation = GetFileGeneration(m_pTokens->GetValue(tId).fileId);
+    wxString& joined = sig.pieces;
+    joined.Empty();
+    for (std::vector<wxString>::const_iterator sgItr = signature.begin(); sgItr != signature.end(); ++sgItr)
+    {
+        if (sgItr != signature.begin())
+            joined += wxT('\n');
+        joined += *sgItr;
+    }
+    joined.Shrink();
+    std::map<TokenId, size_t>::const_iterator jtItr = (m_pJournal ? m_JournalTokens.find(tId) : m_JournalTokens.end());
+    if (jtItr != m_JournalTokens.end())
+    {
+        *m_pJournal += wxString::Format(wxT("S\t%lu"), static_cast<unsigned long>(jtItr->second));
+        for (std::vector<wxString>::const_iterator sgItr = signature.begin(); sgItr != signature.end(); ++sgItr)
+            *m_pJournal += wxT('\t') + WorkerProtocol::Escape(*sgItr);
+        *m_pJournal += wxT('\n');
+    }
+}
+
+bool TokenDatabase::HasSignature(TokenId tId) const
+{
+    wxMutexLocker lock(*m_pMutex);
+    std::map<TokenId, Signature>::const_iterator sgItr = m_pSignatures->find(tId);
+    return (   sgItr != m_pSignatures->end()
+            && sgItr->second.generation == GetFileGeneration(m_pTokens->GetValue(tId).fileId) );
+}
+
+bool TokenDatabase::GetSignature(TokenId tId, std::vector<wxString>& signature) const
+{
+    wxMutexLocker lock(*m_pMutex);
+    if (!HasSignature(tId))
+        return false;
+    signature.clear();
+    const wxString& joined = m_pSignatures->find(tId)->second.pieces;
+    size_t start = 0;
+    for (size_t i = 0; i <= joined.Length(); ++i)
+    {
+        if (i == joined.Length() || joined[i] == wxT('\n'))
+        {
+            signature.push_back(joined.Mid(start, i - start));
+            start = i + 1;
+        }
+    }
+    return true;
+}
+
+void TokenDatabase::InvalidateFile(FileId fId)
+{
+    wxMutexLocker lock(*m_pMutex);
+    ++m_FileGenerations[fId];
+}
+
+unsigned TokenDatabase::GetFileGeneration(FileId fId) const
+{
+    std::map<FileId, unsigned>::const_iterator genItr = m_FileGenerations.find(fId);
+    return (genItr == m_FileGenerations.end() ? 0 : genItr->second);
+}
+
+void TokenDatabase::SetDefinition(const std::string& usr, FileId fId, int line, int column)
+{
+    wxMutexLocker lock(*m_pMutex);
+    Definition& def = m_Definitions[usr];
+    def.fileId = fId;
+    def.line = line;
+    def.column = column;
+    def.generation = GetFileGeneration(fId);
+    if (m_pJournal)
+    {
+        const size_t fileIdx = JournalFile(fId);
+        *m_pJournal += wxString::Format(wxT("D\t%lu\t%d\t%d\t"), static_cast<unsigned long>(fileIdx), line, column)
+                     + WorkerProtocol::Escape(wxString::FromUTF8(usr.c_str())) + wxT('\n');
+    }
+}
+
+bool TokenDatabase::GetDefinition(const std::string& usr, FileId& fId, int& line, int& column) const
+{
+    wxMutexLocker lock(*m_pMutex);
+    const Definition* def = FindDefinition(usr);
+    if (!def)
+        return false;
+    fId = def->fileId;
+    line = def->line;
+    column = def->column;
+    return true;
+}
+
+const TokenDatabase::Definition* TokenDatabase::FindDefinition(const std::string& usr) const
+{
+    std::map<std::string, Definition>::const_iterator defItr = m_Definitions.find(usr);
+    if (defItr == m_Definitions.end() || defItr->second.generation != GetFileGeneration(defItr->second.fileId))
+        return nullptr;
+    return &defItr->second;
+}
+
+static const wxChar* const g_DefinitionsHeader = wxT("ClangLib definitions 1");
+
+bool TokenDatabase::SaveDefinitions(const wxString& filename, const wxString& tag, const std::set<FileId>& files) const
+{
+    wxMutexLocker lock(*m_pMutex);
+    wxString text = wxString(g_DefinitionsHeader) + wxT('\n') + tag + wxT('\n');
+    std::map<FileId, size_t> fileIndices; // position in the file table written
+    for (std::map<std::string, Definition>::const_iterator defItr = m_Definitions.begin();
+         defItr != m_Definitions.end(); ++defItr)
+    {
+        const FileId fId = defItr->second.fileId;
+        if (!files.count(fId) || defItr->second.generation != GetFileGeneration(fId))
+            continue;
+        std::map<FileId, size_t>::const_iterator idxItr = fileIndices.find(fId);
+        if (idxItr == fileIndices.end())
+        {
+            const wxString& path = GetFilename(fId);
+            std::map< FileId, std::pair<time_t, unsigned> >::const_iterator flItr = m_IndexedFiles.find(fId);
+            const time_t modTime = (flItr != m_IndexedFiles.end() ? flItr->second.first : wxFileModificationTime(path));
+            text += wxString::Format(wxT("F\t%ld\t"), static_cast<long>(modTime)) + path + wxT('\n');
+            idxItr = fileIndices.insert(std::make_pair(fId, fileIndices.size())).first;
+        }
+        text += wxString::Format(wxT("D\t%lu\t%d\t%d\t"), static_cast<unsigned long>(idxItr->second),
+                                 defItr->second.line, defItr->second.column)
+              + wxString::FromUTF8(defItr->first.c_str()) + wxT('\n');
+    }
+    wxFFile file(filename, wxT("w"));
+    return file.IsOpened() && file.Write(text, wxConvUTF8);
+}
+
+bool TokenDatabase::LoadDefinitions(const wxString& filename, const wxString& tag)
+{
+    wxMutexLocker lock(*m_pMutex);
+    wxFFile file(filename);
+    wxString text;
+    if (!file.IsOpened() || !file.ReadAll(&text, wxConvUTF8))
+        return false;
+    wxStringTokenizer lines(text, wxT("\n"));
+    if (lines.GetNextToken() != g_DefinitionsHeader || lines.GetNextToken() != tag)
+        return false;
+    std::vector<FileId> fileIds; // wxNOT_FOUND for files modified since they were indexed
+    while (lines.HasMoreTokens())
+    {
+        wxStringTokenizer fields(lines.GetNextToken(), wxT("\t"), wxTOKEN_RET_EMPTY_ALL);
+        const wxString& kind = fields.GetNextToken();
+        if (kind == wxT("F"))
+        {
+            long modTime;
+            if (!fields.GetNextToken().ToLong(&modTime))
+                return false;
+            const wxString& path = fields.GetString();
+            if (wxFileExists(path) && wxFileModificationTime(path) == static_cast<time_t>(modTime))
+                fileIds.push_back(GetFilenameId(path));
+            else
+                fileIds.push_back(wxNOT_FOUND);
+        }
+        else if (kind == wxT("D"))
+        {
+            unsigned long fileIdx;
+            long line, column;
+            if (   !fields.GetNextToken().ToULong(&fileIdx) || fileIdx >= fileIds.size()
+                || !fields.GetNextToken().ToLong(&line) || !fields.GetNextToken().ToLong(&column) )
+            {
+                return false;
+            }
+            const std::string usr(fields.GetString().ToUTF8().data());
+            // what this session indexed is more recent
+            if (fileIds[fileIdx] != wxNOT_FOUND && !FindDefinition(usr))
+                SetDefinition(usr, fileIds[fileIdx], line, column);
+        }
+        else
+            return false;
+    }
+    return true;
+}
+
+size_t TokenDatabase::GetTokenCount() const
+{
+    wxMutexLocker lock(*m_pMutex);
+    return m_pTokens->GetCount();
+}
+
+size_t TokenDatabase::GetFilenameCount() const
+{
+    wxMutexLocker lock(*m_pMutex);
+    return m_pFilenames->GetCount();
+}
+
+unsigned long TokenDatabase::GetMemoryUsage() const
+{
+    wxMutexLocker lock(*m_pMutex);
+    size_t usage = m_pTokens->GetMemoryUsage() + m_pFilenames->GetMemoryUsage()
+                   + m_IndexedFiles.size() * (sizeof(FileId) + sizeof(std::pair<time_t, unsigned>) + 4 * sizeof(void*))
+                   + m_ClaimLog.capacity() * sizeof(FileId);
+    for (std::map<TokenId, Signature>::const_iterator sgItr = m_pSignatures->begin();
+         sgItr != m_pSignatures->end(); ++sgItr)
+    {
+        usage += sizeof(TokenId) + sizeof(Signature) + 4 * sizeof(void*) + sgItr->second.pieces.Length() * sizeof(wxChar);
+    }
+    usage += m_FileGenerations.size() * (sizeof(FileId) + sizeof(unsigned) + 4 * sizeof(void*));
+    for (std::map<std::string, Definition>::const_iterator defItr = m_Definitions.begin();
+         defItr != m_Definitions.end(); ++defItr)
+    {
+        usage += sizeof(std::string) + sizeof(Definition) + 4 * sizeof(void*) + defItr->first.capacity();
+    }
+    return usage / 1024;
+}
+
+bool TokenDatabase::IsFileIndexed(FileId fId, time_t modTime, unsigned flagsHash) const
+{
+    wxMutexLocker lock(*m_pMutex);
+    std::map< FileId, std::pair<time_t, unsigned> >::const_iterator flItr = m_IndexedFiles.find(fId);
+    return (   flItr != m_IndexedFiles.end()
+            && flItr->second.first == modTime
+            && flItr->second.second == flagsHash );
+}
+
+bool TokenDatabase::ClaimFileForIndexing(FileId fId, time_t modTime, unsigned flagsHash)
+{
+    wxMutexLocker lock(*m_pMutex);
+    std::map< FileId, std::pair<time_t, unsigned> >::iterator flItr = m_IndexedFiles.find(fId);
+    if (flItr == m_IndexedFiles.end())
+        m_IndexedFiles.insert(std::make_pair(fId, std::make_pair(modTime, flagsHash)));
+    else if (flItr->second.first == modTime && flItr->second.second == flagsHash)
+        return false;
+    else
+        flItr->second = std::make_pair(modTime, flagsHash);
+    ++m_FileGenerations[fId]; // what the last harvest of the file derived may be gone from it
+    m_ClaimLog.push_back(fId);
+    if (m_pJournal)
+    {
+        const size_t fileIdx = JournalFile(fId);
+        *m_pJournal += wxString::Format(wxT("I\t%lu\t%ld\t%u\n"), static_cast<unsigned long>(fileIdx),
+                                        static_cast<long>(modTime), flagsHash);
+    }
+    return true;
+}
+
+void TokenDatabase::StartJournal()
+{
+    wxMutexLocker lock(*m_pMutex);
+    if (!m_pJournal)
+        m_pJournal = new wxString();
+    m_pJournal->Empty();
+    m_JournalFiles.clear();
+    m_JournalTokens.clear();
+}
+
+wxString TokenDatabase::TakeJournal()
+{
+    wxMutexLocker lock(*m_pMutex);
+    if (!m_pJournal)
+        return wxEmptyString;
+    wxString journal;
+    journal.swap(*m_pJournal);
+    delete m_pJournal;
+    m_pJournal = nullptr;
+    m_JournalFiles.clear();
+    m_JournalTokens.clear();
+    return journal;
+}
+
+size_t TokenDatabase::JournalFile(FileId fId)
+{
+    std::map<FileId, size_t>::const_iterator jfItr = m_JournalFiles.find(fId);
+    if (jfItr != m_JournalFiles.end())
+        return jfItr->second;
+    *m_pJournal += wxT("F\t") + WorkerProtocol::Escape(m_pFilenames->GetValue(fId)) + wxT('\n');
+    return m_JournalFiles.insert(std::make_pair(fId, m_JournalFiles.size())).first->second;
+}
+
+bool TokenDatabase::ApplyJournal(const wxString& journal)
+{
+    wxMutexLocker lock(*m_pMutex);
+    std::vector<FileId> fileIds;
+    std::vector<bool> claimed;     // parallel to fileIds
+    std::vector<TokenId> tokenIds; // wxNOT_FOUND for the tokens of files not claimed
+    std::vector<wxString> fields;
+    wxString record;
+    size_t pos = 0;
+    while (WorkerProtocol::NextRecord(journal, pos, record))
+    {
+        WorkerProtocol::SplitRecord(record, fields);
+        const wxString& kind = fields[0];
+        unsigned long idx, hash;
+        long line, column;
+        if (kind == wxT("F"))
+        {
+            if (fields.size() != 2)
+                return false;
+            fileIds.push_back(GetFilenameId(fields[1]));
+            claimed.push_back(false);
+        }
+        else if (kind == wxT("I"))
+        {
+            long modTime;
+            if (   fields.size() != 4 || !fields[1].ToULong(&idx) || idx >= fileIds.size()
+                || !fields[2].ToLong(&modTime) || !fields[3].ToULong(&hash) )
+            {
+                return false;
+            }
+            claimed[idx] = ClaimFileForIndexing(fileIds[idx], modTime, hash);
+        }
+        else if (kind == wxT("T"))
+        {
+            if (   fields.size() != 6 || !fields[1].ToULong(&idx) || idx >= fileIds.size()
+                || !fields[2].ToLong(&line) || !fields[3].ToLong(&column) || !fields[4].ToULong(&hash) )
+            {
+                return false;
+            }
+            tokenIds.push_back(claimed[idx] ? InsertToken(fields[5], AbstractToken(fileIds[idx], line, column, hash))
+                                            : wxNOT_FOUND);
+        }
+        else if (kind == wxT("S"))
+        {
+            if (fields.size() < 2 || !fields[1].ToULong(&idx) || idx >= tokenIds.size())
+                return false;
+            if (tokenIds[idx] != wxNOT_FOUND && !HasSignature(tokenIds[idx]))
+                SetSignature(tokenIds[idx], std::vector<wxString>(fields.begin() + 2, fields.end()));
+        }
+        else if (kind == wxT("D"))
+        {
+            if (   fields.size() != 5 || !fields[1].ToULong(&idx) || idx >= fileIds.size()
+                || !fields[2].ToLong(&line) || !fields[3].ToLong(&column) )
+            {
+                return false;
+            }
+            if (claimed[idx])
+                SetDefinition(std::string(fields[4].ToUTF8().data()), fileIds[idx], line, column);
+        }
+    }
+    return true;
+}
+
+wxString TokenDatabase::GetIndexedFilesJournal(size_t& fromClaim) const
+{
+    wxMutexLocker lock(*m_pMutex);
+    wxString journal;
+    size_t fileIdx = 0;
+    for (; fromClaim < m_ClaimLog.size(); ++fromClaim, ++fileIdx)
+    {
+        const FileId fId = m_ClaimLog[fromClaim];
+        const std::pair<time_t, unsigned>& claim = m_IndexedFiles.find(fId)->second;
+        journal += wxT("F\t") + WorkerProtocol::Escape(m_pFilenames->GetValue(fId)) + wxT('\n');
+        journal += wxString::Format(wxT("I\t%lu\t%ld\t%u\n"), static_cast<unsigned long>(fileIdx),
+                                    static_cast<long>(claim.first), claim.second);
+    }
+    return journal;
+}
+
 void TokenDatabase::Shrink()
 {
+    wxMutexLocker lock(*m_pMutex);
     m_pFilenames->Shrink();
     m_pTokens->Shrink();
 }
@@ -1,9 +1,14 @@
 #ifndef TOKENDATABASE_H
 #define TOKENDATABASE_H
 
+#include <ctime>
+#include <map>
+#include <set>
+#include <string>
 #include <vector>
 
 template<typename _Tp> class TreeMap;
+class wxMutex;
 class wxString;
 typedef int FileId;
 typedef int TokenId;
@@ -19,6 +24,13 @@ struct AbstractToken
     unsigned tokenHash;
 };
 
+/**
+ * Tokens, filenames and definitions shared by all translation units
+ *
+ * Every method locks the database, so the background indexer can fill it
+ * while the UI thread reads. Strings handed out are never shared with the
+ * stored ones.
+ */
 class TokenDatabase
 {
     public:
@@ -30,14 +42,132 @@ class TokenDatabase
 
         TokenId InsertToken(const wxString& identifier, const AbstractToken& token); // duplicate tokens are discarded
         TokenId GetTokenId(const wxString& identifier, unsigned tokenHash) const; // returns wxNOT_FOUND on failure
-        AbstractToken& GetToken(TokenId tId) const;
+        AbstractToken GetToken(TokenId tId) const;
         std::vector<TokenId> GetTokenMatches(const wxString& identifier) const;
+        /**
+         * Record the call tip of a function-like token (rendered once, when indexed)
+         *
+         * @param signature The declaration up to the '(', each parameter, then ")"
+         */
+        void SetSignature(TokenId tId, const std::vector<wxString>& signature);
+        bool HasSignature(TokenId tId) const;
+        /// @return false if the token has no signature
+        bool GetSignature(TokenId tId, std::vector<wxString>& signature) const;
+        /**
+         * Forget what was derived from a file's tokens, because it is about to
+         * be harvested again
+         *
+         * The tokens themselves stay; signatures and definitions recorded
+         * before are ignored from now on.
+         */
+        void InvalidateFile(FileId fId);
+        /**
+         * Record where an entity is defined, so other units can jump there
+         * without parsing the file
+         *
+         * @param usr Unified symbol resolution of the entity (UTF-8)
+         */
+        void SetDefinition(const std::string& usr, FileId fId, int line, int column);
+        /// @return false if no definition of the entity was indexed
+        bool GetDefinition(const std::string& usr, FileId& fId, int& line, int& column) const;
+        /**
+         * Write the definition index to disk, by filename (file ids are not
+         * stable between sessions)
+         *
+         * @param filename File to write
+         * @param tag Identifies what the index belongs to (checked by LoadDefinitions())
+         * @param files Only write the definitions in these files
+         */
+        bool SaveDefinitions(const wxString& filename, const wxString& tag, const std::set<FileId>& files) const;
+        /**
+         * Add the definitions from a file written by SaveDefinitions()
+         *
+         * Entries of files modified since they were indexed are skipped.
+         *
+         * @return false if the file is missing, malformed or has a different tag
+         */
+        bool LoadDefinitions(const wxString& filename, const wxString& tag);
+        size_t GetTokenCount() const;
+        size_t GetFilenameCount() const;
+        /// Approximate memory (in kilobytes) held by the tokens and filenames
+        unsigned long GetMemoryUsage() const;
+
+        /**
+         * Check if the tokens of a file have already been recorded
+         *
+         * @param fId The file
+         * @param modTime Modification time of the file when it was parsed
+         * @param flagsHash Hash of the compile flags it was parsed with
+         * @return true if the file was indexed at the same time with the same flags
+         */
+        bool IsFileIndexed(FileId fId, time_t modTime, unsigned flagsHash) const;
+        /**
+         * Check and mark a file as indexed in one step, so only one of several
+         * units harvesting it records its tokens
+         *
+         * Invalidates the file (see InvalidateFile()) when it is claimed.
+         *
+         * @return false if the file was already indexed at the same time with the same flags
+         */
+        bool ClaimFileForIndexing(FileId fId, time_t modTime, unsigned flagsHash);
+
+        /**
+         * Log what is recorded from now on (files claimed, tokens, signatures
+         * and definitions), to be sent to the database of another process
+         */
+        void StartJournal();
+        /// The records logged since StartJournal(), see WorkerProtocol; logging stops
+        wxString TakeJournal();
+        /**
+         * Add what another database logged
+         *
+         * The records of each file are only taken if the file can be claimed
+         * here (see ClaimFileForIndexing()), so what this database already
+         * indexed the same way is kept. Records of other kinds are skipped.
+         *
+         * @return false if the journal is malformed (records before the fault are kept)
+         */
+        bool ApplyJournal(const wxString& journal);
+        /**
+         * The files claimed for indexing, as a journal; lets another database skip them
+         *
+         * @param[in,out] fromClaim Number of claims already sent (0 for all); set to the current count
+         */
+        wxString GetIndexedFilesJournal(size_t& fromClaim) const;
 
         void Shrink();
 
     private:
+        /// Number of times the file was invalidated
+        unsigned GetFileGeneration(FileId fId) const;
+        /// Index of the file in the journal, logged first if it is not in it yet
+        size_t JournalFile(FileId fId);
+
+        wxMutex* m_pMutex; // recursive
         TreeMap<AbstractToken>* m_pTokens;
         TreeMap<wxString>* m_pFilenames;
+        struct Signature
+        {
+            unsigned generation; // of the token's file
+            wxString pieces;     // joined by '\n'
+        };
+        std::map<TokenId, Signature>* m_pSignatures;
+        std::map<FileId, unsigned> m_FileGenerations;
+        struct Definition
+        {
+            FileId fileId;
+            int line;
+            int column;
+            unsigned generation; // of the file
+        };
+        /// @return nullptr if there is none, or it is out of date
+        const Definition* FindDefinition(const std::string& usr) const;
+        std::map<std::string, Definition> m_Definitions; // by USR
+        std::map< FileId, std::pair<time_t, unsigned> > m_IndexedFiles;
+        std::vector<FileId> m_ClaimLog; // each successful ClaimFileForIndexing(), in order
+        wxString* m_pJournal; // nullptr unless logging
+        std::map<FileId, size_t> m_JournalFiles;   // index of each file logged
+        std::map<TokenId, size_t> m_JournalTokens; // index of each token logged
 };
 
 #endif // TOKENDATABASE_H
@@ -6,52 +6,159 @@
 
 #include "translationunit.h"
 
+#include <wx/stopwatch.h>
+#ifdef __WXMSW__
+    #include <wx/msw/wrapwin.h> // for GetThreadTimes()
+#endif // __WXMSW__
+
 #ifndef CB_PRECOMP
     #include <cbexception.h> // for cbThrow()
 
     #include <algorithm>
+    #include <climits>
+    #include <cstring>
+    #include <ctime>
+    #include <map>
 #endif // CB_PRECOMP
 
+#include "compilationdatabase.h"
 #include "tokendatabase.h"
+#include "workerprotocol.h"
+
+namespace
+{
+    struct ClAST_VisitorData
+    {
+        ClAST_VisitorData(TokenDatabase* db, unsigned flags) :
+            database(db), flagsHash(flags), numCursors(0) {}
+
+        TokenDatabase* database;
+        unsigned flagsHash;
+        int numCursors;
+        // file id of each file seen (wxNOT_FOUND if it was already indexed)
+        std::map<CXFile, FileId> files;
+    };
+
+    struct ClInclusionVisitorData
+    {
+        ClInclusionVisitorData(TranslationUnit* tu, TokenDatabase* db) :
+            translUnit(tu), database(db) {}
+
+        TranslationUnit* translUnit;
+        TokenDatabase* database;
+        std::map<CXFile, FileId> fileIds; // each file is normalized only once
+    };
+
+    /// CPU time (milliseconds) used by the calling thread, or -1 if the platform does not tell
+    long GetThreadCpuTime()
+    {
+#if defined(__WXMSW__)
+        FILETIME creation, exit, kernel, user;
+        if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+            return -1;
+        const wxULongLong_t ticks = // 100 ns each
+              ((wxULongLong_t(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime)
+            + ((wxULongLong_t(user.dwHighDateTime) << 32) | user.dwLowDateTime);
+        return long(ticks / 10000);
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+        struct timespec ts;
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+            return -1;
+        return long(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+#else
+        return -1;
+#endif
+    }
+
+    // records wall and cpu time of consecutive phases; std::clock() would
+    // also count the other threads parsing at the same time
+    class PhaseTimer
+    {
+        public:
+            PhaseTimer(ClParseStats& stats) :
+                m_Stats(stats)
+            {
+                Restart();
+            }
+
+            void Finish(const wxString& phase)
+            {
+                const long cpuTime = GetThreadCpuTime();
+                m_Stats.phases.push_back(ClParsePhase(phase, m_Watch.Time(),
+                                                      (cpuTime < 0 || m_CpuTime < 0 ? -1 : cpuTime - m_CpuTime)));
+                Restart();
+            }
+
+        private:
+            void Restart()
+            {
+                m_CpuTime = GetThreadCpuTime();
+                m_Watch.Start();
+            }
+
+            ClParseStats& m_Stats;
+            wxStopWatch m_Watch;
+            long m_CpuTime; // milliseconds
+    };
+}
 
 static void ClInclusionVisitor(CXFile included_file, CXSourceLocation* inclusion_stack,
                                unsigned include_len, CXClientData client_data);
 
+static void ClDependencyVisitor(CXFile included_file, CXSourceLocation* inclusion_stack,
+                                unsigned include_len, CXClientData client_data);
+
 static CXChildVisitResult ClAST_Visitor(CXCursor cursor, CXCursor parent, CXClientData client_data);
 
-TranslationUnit::TranslationUnit(const wxString& filename, const std::vector<const char*>& args,
-                                 CXIndex clIndex, TokenDatabase* database) :
+static void ClIdxDeclaration(CXClientData client_data, const CXIdxDeclInfo* info);
+
+TranslationUnit::TranslationUnit(const wxString& filename, const wxString& commands) :
+    m_Filename(filename),
+    m_Commands(commands),
+    m_FileId(wxNOT_FOUND),
+    m_ClTranslUnit(nullptr),
     m_LastCC(nullptr),
+    m_TokenCacheGeneration(0),
+    m_Generation(0),
+    m_DiagGeneration(0),
+    m_FileHandleGeneration(0),
+    m_ReferenceGeneration(0),
+    m_SemanticGeneration(0),
+    m_MemoryUsage(0),
+    m_LastCCMemory(0),
+    m_LastAccess(0),
+    m_ErrorCode(0),
+    m_LoadFailures(0),
     m_LastPos(-1, -1)
 {
-    // TODO: check and handle error conditions
-    m_ClTranslUnit = clang_parseTranslationUnit( clIndex, filename.ToUTF8().data(), args.empty() ? nullptr : &args[0],
-                                                 args.size(), nullptr, 0,
-                                                   clang_defaultEditingTranslationUnitOptions()
-                                                 | CXTranslationUnit_IncludeBriefCommentsInCodeCompletion
-                                                 | CXTranslationUnit_DetailedPreprocessingRecord );
-    std::pair<TranslationUnit*, TokenDatabase*> visitorData = std::make_pair(this, database);
-    clang_getInclusions(m_ClTranslUnit, ClInclusionVisitor, &visitorData);
-    m_Files.reserve(1024);
-    m_Files.push_back(database->GetFilenameId(filename));
-    std::sort(m_Files.begin(), m_Files.end());
-    std::unique(m_Files.begin(), m_Files.end());
-#if __cplusplus >= 201103L
-    m_Files.shrink_to_fit();
-#else
-    std::vector<FileId>(m_Files).swap(m_Files);
-#endif
-    Reparse(0, nullptr); // seems to improve performance for some reason?
-
-    clang_visitChildren(clang_getTranslationUnitCursor(m_ClTranslUnit), ClAST_Visitor, database);
-    database->Shrink();
 }
 
 #if __cplusplus >= 201103L
 TranslationUnit::TranslationUnit(TranslationUnit&& other) :
+    m_Filename(other.m_Filename),
+    m_Commands(other.m_Commands),
+    m_FileId(other.m_FileId),
     m_Files(std::move(other.m_Files)),
+    m_IncludeEdges(std::move(other.m_IncludeEdges)),
+    m_IncludeDepths(std::move(other.m_IncludeDepths)),
+    m_UnsavedHashes(std::move(other.m_UnsavedHashes)),
+    m_DirectiveHashes(std::move(other.m_DirectiveHashes)),
+    m_ParsedLengths(std::move(other.m_ParsedLengths)),
     m_ClTranslUnit(other.m_ClTranslUnit),
     m_LastCC(nullptr),
+    m_TokenCacheGeneration(0),
+    m_Generation(other.m_Generation),
+    m_DiagGeneration(0),
+    m_FileHandleGeneration(0),
+    m_ReferenceGeneration(0),
+    m_SemanticGeneration(0),
+    m_MemoryUsage(other.m_MemoryUsage),
+    m_MemoryEntries(other.m_MemoryEntries),
+    m_LastCCMemory(0),
+    m_LastAccess(other.m_LastAccess),
+    m_ParseStats(other.m_ParseStats),
+    m_ErrorCode(other.m_ErrorCode),
+    m_LoadFailures(other.m_LoadFailures),
     m_LastPos(-1, -1)
 {
      other.m_ClTranslUnit = nullptr;
@@ -63,31 +170,377 @@ TranslationUnit::TranslationUnit(const TranslationUnit& WXUNUSED(other))
 }
 #else
 TranslationUnit::TranslationUnit(const TranslationUnit& other) :
+    m_Filename(other.m_Filename),
+    m_Commands(other.m_Commands),
+    m_FileId(other.m_FileId),
     m_ClTranslUnit(other.m_ClTranslUnit),
     m_LastCC(nullptr),
+    m_TokenCacheGeneration(0),
+    m_Generation(other.m_Generation),
+    m_DiagGeneration(0),
+    m_FileHandleGeneration(0),
+    m_ReferenceGeneration(0),
+    m_SemanticGeneration(0),
+    m_MemoryUsage(other.m_MemoryUsage),
+    m_MemoryEntries(other.m_MemoryEntries),
+    m_LastCCMemory(0),
+    m_LastAccess(other.m_LastAccess),
+    m_ParseStats(other.m_ParseStats),
+    m_ErrorCode(other.m_ErrorCode),
+    m_LoadFailures(other.m_LoadFailures),
     m_LastPos(-1, -1)
 {
     m_Files.swap(const_cast<TranslationUnit&>(other).m_Files);
+    m_IncludeEdges.swap(const_cast<TranslationUnit&>(other).m_IncludeEdges);
+    m_IncludeDepths.swap(const_cast<TranslationUnit&>(other).m_IncludeDepths);
+    m_UnsavedHashes.swap(const_cast<TranslationUnit&>(other).m_UnsavedHashes);
+    m_DirectiveHashes.swap(const_cast<TranslationUnit&>(other).m_DirectiveHashes);
+    m_ParsedLengths.swap(const_cast<TranslationUnit&>(other).m_ParsedLengths);
     const_cast<TranslationUnit&>(other).m_ClTranslUnit = nullptr;
 }
 #endif
 
 TranslationUnit::~TranslationUnit()
+{
+    Dispose();
+}
+
+void TranslationUnit::Load(CXIndex clIndex, CXIndexAction clIndexAction, TokenDatabase* database,
+                           struct CXUnsavedFile* unsaved_files, unsigned num_unsaved_files)
+{
+    Dispose();
+    m_ParseStats = ClParseStats();
+    const unsigned options =   clang_defaultEditingTranslationUnitOptions()
+                             | CXTranslationUnit_IncludeBriefCommentsInCodeCompletion
+                             | CXTranslationUnit_DetailedPreprocessingRecord;
+    if (!Parse(clIndex, options, unsaved_files, num_unsaved_files))
+    {
+        ++m_LoadFailures; // keep the old file list, so the unit can still be found
+        return;
+    }
+    PhaseTimer timer(m_ParseStats);
+    UpdateFiles(database);
+    m_ParseStats.numFiles = m_Files.size();
+    timer.Finish(wxT("inclusions"));
+    if (!Reparse(num_unsaved_files, unsaved_files)) // seems to improve performance for some reason?
+    {
+        ++m_LoadFailures;
+        return;
+    }
+    m_LoadFailures = 0;
+    timer.Finish(wxT("reparse"));
+    Harvest(clIndexAction, database);
+}
+
+void TranslationUnit::Index(CXIndex clIndex, CXIndexAction clIndexAction, TokenDatabase* database)
+{
+    Dispose();
+    m_ParseStats = ClParseStats();
+    // nothing will be edited or completed; skip building the preamble and completion caches
+    if (!Parse(clIndex, CXTranslationUnit_DetailedPreprocessingRecord, nullptr, 0))
+    {
+        ++m_LoadFailures;
+        return;
+    }
+    m_LoadFailures = 0;
+    PhaseTimer timer(m_ParseStats);
+    UpdateFiles(database);
+    m_ParseStats.numFiles = m_Files.size();
+    timer.Finish(wxT("inclusions"));
+    Harvest(clIndexAction, database);
+    Dispose();
+}
+
+wxString TranslationUnit::WriteIndexed(const TokenDatabase* database) const
+{
+    wxString records = wxString::Format(wxT("R\t%d\t%d\t%d\t%d\n"), m_ErrorCode, m_ParseStats.numFiles,
+                                        m_ParseStats.numCursors, m_ParseStats.numTokens);
+    for (std::vector<ClParsePhase>::const_iterator phItr = m_ParseStats.phases.begin();
+         phItr != m_ParseStats.phases.end(); ++phItr)
+    {
+        records += wxString::Format(wxT("P\t%ld\t%ld\t"), phItr->wallTime, phItr->cpuTime)
+                 + WorkerProtocol::Escape(phItr->name) + wxT('\n');
+    }
+    for (std::vector<FileId>::const_iterator flItr = m_Files.begin(); flItr != m_Files.end(); ++flItr)
+    {
+        records += wxString::Format(wxT("U\t%u\t"), GetIncludeDepth(*flItr))
+                 + WorkerProtocol::Escape(database->GetFilename(*flItr)) + wxT('\n');
+    }
+    // edges refer to files by their position in the list above (both are sorted)
+    for (std::vector< std::pair<FileId, FileId> >::const_iterator edItr = m_IncludeEdges.begin();
+         edItr != m_IncludeEdges.end(); ++edItr)
+    {
+        records += wxString::Format(wxT("E\t%lu\t%lu\n"),
+                                    static_cast<unsigned long>(std::lower_bound(m_Files.begin(), m_Files.end(),
+                                                                                edItr->first) - m_Files.begin()),
+                                    static_cast<unsigned long>(std::lower_bound(m_Files.begin(), m_Files.end(),
+                                                                                edItr->second) - m_Files.begin()));
+    }
+    return records;
+}
+
+bool TranslationUnit::ReadIndexed(const wxString& records, TokenDatabase* database)
+{
+    Dispose();
+    m_ParseStats = ClParseStats();
+    m_ErrorCode = 1; // CXError_Failure, unless the records are complete and report otherwise
+    m_Files.clear();
+    m_IncludeEdges.clear();
+    m_IncludeDepths.clear();
+    long errorCode = 1;
+    std::vector<FileId> fileIds;
+    std::vector<wxString> fields;
+    wxString record;
+    size_t pos = 0;
+    while (WorkerProtocol::NextRecord(records, pos, record))
+    {
+        WorkerProtocol::SplitRecord(record, fields);
+        const wxString& kind = fields[0];
+        long values[4];
+        unsigned long idx[2];
+        if (kind == wxT("R"))
+        {
+            if (fields.size() != 5)
+                return false;
+            for (int i = 0; i < 4; ++i)
+            {
+                if (!fields[i + 1].ToLong(&values[i]))
+                    return false;
+            }
+            errorCode = values[0];
+            m_ParseStats.numFiles = values[1];
+            m_ParseStats.numCursors = values[2];
+            m_ParseStats.numTokens = values[3];
+        }
+        else if (kind == wxT("P"))
+        {
+            if (fields.size() != 4 || !fields[1].ToLong(&values[0]) || !fields[2].ToLong(&values[1]))
+                return false;
+            m_ParseStats.phases.push_back(ClParsePhase(fields[3], values[0], values[1]));
+        }
+        else if (kind == wxT("U"))
+        {
+            if (fields.size() != 3 || !fields[1].ToULong(&idx[0]))
+                return false;
+            fileIds.push_back(database->GetFilenameId(fields[2]));
+            AddInclude(fileIds.back(), wxNOT_FOUND, idx[0]);
+        }
+        else if (kind == wxT("E"))
+        {
+            if (   fields.size() != 3 || !fields[1].ToULong(&idx[0]) || idx[0] >= fileIds.size()
+                || !fields[2].ToULong(&idx[1]) || idx[1] >= fileIds.size() )
+            {
+                return false;
+            }
+            m_IncludeEdges.push_back(std::make_pair(fileIds[idx[0]], fileIds[idx[1]]));
+        }
+    }
+    m_FileId = database->GetFilenameId(m_Filename);
+    CompactFiles();
+    m_ErrorCode = errorCode;
+    if (m_ErrorCode == 0)
+        m_LoadFailures = 0;
+    else
+        ++m_LoadFailures;
+    return true;
+}
+
+bool TranslationUnit::Precompile(CXIndex clIndex, const wxString& header, const wxString& commands,
+                                 const wxString& pchFile, std::vector<wxString>& dependencies)
+{
+    wxArrayString switches;
+    CompilationDatabase::SplitCommand(commands, switches);
+    std::vector<wxCharBuffer> argsBuffer;
+    std::vector<const char*> args;
+    for (size_t i = 0; i < switches.GetCount(); ++i)
+    {
+        argsBuffer.push_back(switches[i].ToUTF8());
+        args.push_back(argsBuffer.back().data());
+    }
+    CXTranslationUnit clTranslUnit = clang_parseTranslationUnit(clIndex, header.ToUTF8().data(),
+                                                                args.empty() ? nullptr : &args[0], args.size(),
+                                                                nullptr, 0,   CXTranslationUnit_ForSerialization
+                                                                            | CXTranslationUnit_Incomplete);
+    if (!clTranslUnit)
+        return false;
+    clang_getInclusions(clTranslUnit, ClDependencyVisitor, &dependencies);
+    bool success = true;
+    const unsigned numDiags = clang_getNumDiagnostics(clTranslUnit);
+    for (unsigned i = 0; i < numDiags && success; ++i)
+    {
+        CXDiagnostic diag = clang_getDiagnostic(clTranslUnit, i);
+        success = (clang_getDiagnosticSeverity(diag) < CXDiagnostic_Error);
+        clang_disposeDiagnostic(diag);
+    }
+    if (success)
+    {
+        success = (clang_saveTranslationUnit(clTranslUnit, pchFile.ToUTF8().data(),
+                                             clang_defaultSaveOptions(clTranslUnit)) == CXSaveError_None);
+    }
+    clang_disposeTranslationUnit(clTranslUnit);
+    return success;
+}
+
+bool TranslationUnit::Parse(CXIndex clIndex, unsigned options,
+                            struct CXUnsavedFile* unsaved_files, unsigned num_unsaved_files)
+{
+    wxArrayString switches; // quoted paths (of a PCH, say) may contain spaces
+    CompilationDatabase::SplitCommand(m_Commands, switches);
+    if (!m_Filename.EndsWith(wxT(".c"))) // force language reduces chance of error on STL headers
+    {
+        switches.Add(wxT("-x"));
+        switches.Add(wxT("c++"));
+    }
+    std::vector<wxString> unknownOptions;
+    unknownOptions.push_back(wxT("-Wno-unused-local-typedefs"));
+    unknownOptions.push_back(wxT("-Wzero-as-null-pointer-constant"));
+    std::sort(unknownOptions.begin(), unknownOptions.end());
+    std::vector<wxCharBuffer> argsBuffer;
+    std::vector<const char*> args;
+    for (size_t i = 0; i < switches.GetCount(); ++i)
+    {
+        const wxString& compilerSwitch = switches[i];
+        if (std::binary_search(unknownOptions.begin(), unknownOptions.end(), compilerSwitch))
+            continue;
+        argsBuffer.push_back(compilerSwitch.ToUTF8());
+        args.push_back(argsBuffer.back().data());
+    }
+
+    PhaseTimer timer(m_ParseStats);
+#if CINDEX_VERSION_MINOR >= 27
+    m_ErrorCode = clang_parseTranslationUnit2( clIndex, m_Filename.ToUTF8().data(), args.empty() ? nullptr : &args[0],
+                                               args.size(), unsaved_files, num_unsaved_files, options, &m_ClTranslUnit );
+#else
+    m_ClTranslUnit = clang_parseTranslationUnit( clIndex, m_Filename.ToUTF8().data(), args.empty() ? nullptr : &args[0],
+                                                 args.size(), unsaved_files, num_unsaved_files, options );
+    m_ErrorCode = (m_ClTranslUnit ? 0 : 1); // CXError_Failure
+#endif
+    timer.Finish(wxT("parse"));
+    if (!m_ClTranslUnit)
+        return false;
+    RecordParsedLengths(num_unsaved_files, unsaved_files);
+    return true;
+}
+
+void TranslationUnit::Harvest(CXIndexAction clIndexAction, TokenDatabase* database)
+{
+    PhaseTimer timer(m_ParseStats);
+    // whether a shared PCH is used does not change the tokens
+    wxArrayString switches;
+    CompilationDatabase::SplitCommand(m_Commands, switches);
+    unsigned flagsHash = 2166136261u;
+    for (size_t i = 0; i < switches.GetCount(); ++i)
+    {
+        if (switches[i] == wxT("-include-pch"))
+        {
+            ++i;
+            continue;
+        }
+        const wxCharBuffer flag = switches[i].ToUTF8();
+        for (const char* pCh = flag.data(); *pCh; ++pCh)
+        {
+            flagsHash ^= *pCh;
+            flagsHash *= 16777619u;
+        }
+        flagsHash ^= ' ';
+        flagsHash *= 16777619u;
+    }
+    ClAST_VisitorData astData(database, flagsHash);
+    const size_t numTokens = database->GetTokenCount();
+    if (clIndexAction)
+    {
+        IndexerCallbacks callbacks;
+        memset(&callbacks, 0, sizeof(callbacks));
+        callbacks.indexDeclaration = ClIdxDeclaration;
+        clang_indexTranslationUnit(clIndexAction, &astData, &callbacks, sizeof(callbacks),
+                                   CXIndexOpt_None, m_ClTranslUnit);
+    }
+    else
+        clang_visitChildren(clang_getTranslationUnitCursor(m_ClTranslUnit), ClAST_Visitor, &astData);
+    m_ParseStats.numCursors = astData.numCursors;
+    m_ParseStats.numTokens = database->GetTokenCount() - numTokens;
+    timer.Finish(clIndexAction ? wxT("index") : wxT("visit"));
+    database->Shrink();
+    timer.Finish(wxT("shrink"));
+}
+
+void TranslationUnit::Dispose()
 {
     if (m_LastCC)
         clang_disposeCodeCompleteResults(m_LastCC);
+    m_LastCC = nullptr;
+    m_CCMatcher.Clear();
+    m_CCAccess.clear();
+    m_LastCCMemory = 0;
+    m_LastPos.Set(-1, -1);
+    m_AccessCache.clear();
+    m_DocCache.clear();
     if (m_ClTranslUnit)
         clang_disposeTranslationUnit(m_ClTranslUnit);
+    m_ClTranslUnit = nullptr;
+    m_MemoryUsage = 0;
+    m_MemoryEntries.clear();
+    m_FileHandles.clear();
+    m_ReferenceMaps.clear();
+    m_SemanticCache.clear();
+    m_UnsavedHashes.clear(); // the caller of the next Load() records the buffers it passes
+    m_DirectiveHashes.clear();
+    m_ParsedLengths.clear();
+    m_DiagBuckets.clear();
+    m_ExpandedDiags.clear();
+    m_DiagGeneration = 0;
 }
 
-void TranslationUnit::AddInclude(FileId fId)
+void TranslationUnit::UpdateFiles(TokenDatabase* database)
+{
+    m_Files.clear();
+    m_Files.reserve(1024);
+    m_IncludeEdges.clear();
+    m_IncludeDepths.clear();
+    ClInclusionVisitorData visitorData(this, database);
+    clang_getInclusions(m_ClTranslUnit, ClInclusionVisitor, &visitorData);
+    m_FileId = database->GetFilenameId(m_Filename);
+    AddInclude(m_FileId, wxNOT_FOUND, 0);
+    CompactFiles();
+}
+
+void TranslationUnit::CompactFiles()
+{
+    std::sort(m_Files.begin(), m_Files.end());
+    m_Files.erase(std::unique(m_Files.begin(), m_Files.end()), m_Files.end());
+    std::sort(m_IncludeEdges.begin(), m_IncludeEdges.end());
+    m_IncludeEdges.erase(std::unique(m_IncludeEdges.begin(), m_IncludeEdges.end()), m_IncludeEdges.end());
+#if __cplusplus >= 201103L
+    m_Files.shrink_to_fit();
+    m_IncludeEdges.shrink_to_fit();
+#else
+    std::vector<FileId>(m_Files).swap(m_Files);
+    std::vector< std::pair<FileId, FileId> >(m_IncludeEdges).swap(m_IncludeEdges);
+#endif
+}
+
+void TranslationUnit::AddInclude(FileId fId, FileId includerId, unsigned depth)
 {
     m_Files.push_back(fId);
+    if (includerId != wxNOT_FOUND)
+        m_IncludeEdges.push_back(std::make_pair(includerId, fId));
+    std::map<FileId, unsigned>::iterator dpItr = m_IncludeDepths.find(fId);
+    if (dpItr == m_IncludeDepths.end())
+        m_IncludeDepths.insert(std::make_pair(fId, depth));
+    else if (depth < dpItr->second)
+        dpItr->second = depth;
 }
 
-bool TranslationUnit::Contains(FileId fId)
+unsigned TranslationUnit::GetIncludeDepth(FileId fId) const
+{
+    std::map<FileId, unsigned>::const_iterator dpItr = m_IncludeDepths.find(fId);
+    if (dpItr == m_IncludeDepths.end())
+        return static_cast<unsigned>(-1);
+    return dpItr->second;
+}
+
+bool TranslationUnit::Contains(FileId fId) const
 {
-    //return std::binary_search(m_Files.begin(), m_Files.begin() + std::min(fId + 1, m_Files.size()), fId);
     return std::binary_search(m_Files.begin(), m_Files.end(), fId);
 }
 
@@ -105,6 +558,36 @@ CXCodeCompleteResults* TranslationUnit::CodeCompleteAt( const char* complete_fil
                                     | CXCodeComplete_IncludeCodePatterns
                                     | CXCodeComplete_IncludeBriefComments);
     m_LastPos.Set(complete_line, complete_column);
+    m_LastCCMemory = 0;
+    m_CCMatcher.Clear();
+    m_CCAccess.clear();
+    if (m_LastCC)
+    {
+        m_CCAccess.resize(m_LastCC->NumResults, -1);
+        // filtering reuses this for every keystroke until completion is invoked at a new position
+        for (unsigned i = 0; i < m_LastCC->NumResults; ++i)
+        {
+            CXCompletionString token = m_LastCC->Results[i].CompletionString;
+            const unsigned numChunks = clang_getNumCompletionChunks(token);
+            unsigned chunkIdx = 0;
+            while (chunkIdx < numChunks && clang_getCompletionChunkKind(token, chunkIdx) != CXCompletionChunk_TypedText)
+                ++chunkIdx;
+            if (chunkIdx == numChunks)
+            {
+                m_CCMatcher.AddCandidate(""); // keep indices aligned; never matches a pattern
+                continue;
+            }
+            CXString typedText = clang_getCompletionChunkText(token, chunkIdx);
+            m_CCMatcher.AddCandidate(clang_getCString(typedText));
+            clang_disposeString(typedText);
+        }
+        // libclang does not report this; estimate from the result and chunk counts
+        // (a chunk is a kind plus a pointer, strings are interned in a shared allocator)
+        size_t usage = m_LastCC->NumResults * sizeof(CXCompletionResult);
+        for (unsigned i = 0; i < m_LastCC->NumResults; ++i)
+            usage += clang_getNumCompletionChunks(m_LastCC->Results[i].CompletionString) * 2 * sizeof(void*);
+        m_LastCCMemory = usage / 1024;
+    }
     return m_LastCC;
 }
 
@@ -115,23 +598,356 @@ const CXCompletionResult* TranslationUnit::GetCCResult(unsigned index)
     return nullptr;
 }
 
+int TranslationUnit::GetCCAccess(unsigned index) const
+{
+    return (index < m_CCAccess.size() ? m_CCAccess[index] : -1);
+}
+
+void TranslationUnit::SetCCAccess(unsigned index, int access)
+{
+    if (index < m_CCAccess.size())
+        m_CCAccess[index] = access;
+}
+
+bool TranslationUnit::GetCachedAccess(unsigned tokenHash, int& access)
+{
+    CheckTokenCaches();
+    std::map<unsigned, int>::const_iterator acItr = m_AccessCache.find(tokenHash);
+    if (acItr == m_AccessCache.end())
+        return false;
+    access = acItr->second;
+    return true;
+}
+
+bool TranslationUnit::GetCachedDocumentation(const wxString& docKey, wxString& html)
+{
+    CheckTokenCaches();
+    std::map<wxString, wxString>::const_iterator dcItr = m_DocCache.find(docKey);
+    if (dcItr == m_DocCache.end())
+        return false;
+    html = dcItr->second;
+    return true;
+}
+
+void TranslationUnit::SetCachedDocumentation(const wxString& docKey, const wxString& html)
+{
+    CheckTokenCaches();
+    if (m_DocCache.size() >= 2048) // rather start over than grow without bound
+        m_DocCache.clear();
+    m_DocCache[docKey] = html;
+}
+
 CXCursor TranslationUnit::GetTokensAt(const wxString& filename, int line, int column)
 {
     return clang_getCursor(m_ClTranslUnit, clang_getLocation(m_ClTranslUnit, GetFileHandle(filename), line, column));
 }
 
-void TranslationUnit::Reparse(unsigned num_unsaved_files, struct CXUnsavedFile* unsaved_files)
+CXCursor TranslationUnit::GetTokensAt(FileId fId, int line, int column, const TokenDatabase* database)
+{
+    const CXSourceLocation loc = GetLocation(fId, line, column, database);
+    if (clang_equalLocations(loc, clang_getNullLocation()))
+        return clang_getNullCursor();
+    return clang_getCursor(m_ClTranslUnit, loc);
+}
+
+CXSourceLocation TranslationUnit::GetLocation(FileId fId, int line, int column, const TokenDatabase* database)
+{
+    const CXFile file = GetFileHandle(fId, database);
+    if (!file)
+        return clang_getNullLocation();
+    return clang_getLocation(m_ClTranslUnit, file, line, column);
+}
+
+bool TranslationUnit::Reparse(unsigned num_unsaved_files, struct CXUnsavedFile* unsaved_files)
+{
+    m_ErrorCode = clang_reparseTranslationUnit(m_ClTranslUnit, num_unsaved_files,
+                                               unsaved_files, clang_defaultReparseOptions(m_ClTranslUnit));
+    ++m_Generation;
+    if (m_ErrorCode != 0)
+    {
+        // libclang leaves the unit in an unusable state; it must be disposed
+        Dispose();
+        return false;
+    }
+    RecordParsedLengths(num_unsaved_files, unsaved_files);
+    UpdateMemoryUsage();
+    return true;
+}
+
+void TranslationUnit::GetDiagnostics(FileId fId, TokenDatabase* database, std::vector<ClDiagnostic>& diagnostics)
+{
+    if (!m_ClTranslUnit)
+        return;
+    if (m_DiagGeneration != m_Generation) // sort the diagnostics of this parse by file
+    {
+        m_DiagBuckets.clear();
+        m_ExpandedDiags.clear();
+        std::map<CXFile, FileId> fileIds; // each file is looked up in the database once
+        const unsigned numDiags = clang_getNumDiagnostics(m_ClTranslUnit);
+        for (unsigned i = 0; i < numDiags; ++i)
+        {
+            CXDiagnostic diag = clang_getDiagnostic(m_ClTranslUnit, i);
+            CXFile file;
+            clang_getSpellingLocation(clang_getDiagnosticLocation(diag), &file, nullptr, nullptr, nullptr);
+            clang_disposeDiagnostic(diag);
+            if (!file)
+                continue; // no location (command line problems) to display it at
+            std::map<CXFile, FileId>::const_iterator idItr = fileIds.find(file);
+            if (idItr == fileIds.end())
+            {
+                CXString str = clang_getFileName(file);
+                const wxString& flName = wxString::FromUTF8(clang_getCString(str));
+                clang_disposeString(str);
+                idItr = fileIds.insert(std::make_pair(file, database->GetFilenameId(flName))).first;
+            }
+            m_DiagBuckets[idItr->second].push_back(i);
+        }
+        m_DiagGeneration = m_Generation;
+    }
+    std::map< FileId, std::vector<ClDiagnostic> >::const_iterator expItr = m_ExpandedDiags.find(fId);
+    if (expItr == m_ExpandedDiags.end()) // only do the expensive work for files that are displayed
+    {
+        std::vector<ClDiagnostic>& expanded = m_ExpandedDiags[fId];
+        std::map< FileId, std::vector<unsigned> >::const_iterator bktItr = m_DiagBuckets.find(fId);
+        if (bktItr != m_DiagBuckets.end())
+            ExpandDiagnostics(bktItr->second, expanded);
+        expItr = m_ExpandedDiags.find(fId);
+    }
+    diagnostics = expItr->second;
+}
+
+void TranslationUnit::GetOccurrencesOf(const wxString& filename, int line, int column,
+                                       std::vector< std::pair<int, int> >& results)
+{
+    const CXFile file = GetFileHandle(filename);
+    if (!file)
+        return;
+    if (m_ReferenceGeneration != m_Generation)
+    {
+        m_ReferenceMaps.clear();
+        m_ReferenceGeneration = m_Generation;
+    }
+    std::map<CXFile, ReferenceMap>::iterator rmItr = m_ReferenceMaps.find(file);
+    if (rmItr == m_ReferenceMaps.end())
+    {
+        rmItr = m_ReferenceMaps.insert(std::make_pair(file, ReferenceMap())).first;
+        BuildReferenceMap(file, rmItr->second);
+    }
+    const ReferenceMap& refMap = rmItr->second;
+
+    unsigned offset;
+    clang_getSpellingLocation(clang_getLocation(m_ClTranslUnit, file, line, column), nullptr, nullptr, nullptr, &offset);
+    // the last identifier starting at or before the offset
+    std::vector< std::pair<std::pair<unsigned, unsigned>, unsigned> >::const_iterator tknItr
+        = std::upper_bound(refMap.tokens.begin(), refMap.tokens.end(),
+                           std::make_pair(std::make_pair(offset, UINT_MAX), UINT_MAX));
+    if (tknItr == refMap.tokens.begin())
+        return;
+    --tknItr;
+    if (offset >= tknItr->first.second)
+        return;
+    results = refMap.occurrences[tknItr->second];
+}
+
+void TranslationUnit::RecordParsedLengths(unsigned num_unsaved_files, struct CXUnsavedFile* unsaved_files)
+{
+    m_ParsedLengths.clear();
+    for (unsigned i = 0; i < num_unsaved_files; ++i)
+    {
+        const CXFile file = clang_getFile(m_ClTranslUnit, unsaved_files[i].Filename);
+        if (file)
+            m_ParsedLengths[file] = unsaved_files[i].Length;
+    }
+}
+
+unsigned TranslationUnit::GetParsedLength(CXFile file) const
+{
+    // clang_getLocationForOffset() does not check the offset, so the end must be known
+    std::map<CXFile, unsigned>::const_iterator lenItr = m_ParsedLengths.find(file);
+    if (lenItr != m_ParsedLengths.end())
+        return lenItr->second;
+    // read from disk; its size now is the parsed one only if it was not modified since
+    CXString str = clang_getFileName(file);
+    const wxString& filename = wxString::FromUTF8(clang_getCString(str));
+    clang_disposeString(str);
+    if (!wxFileExists(filename) || wxFileModificationTime(filename) != clang_getFileTime(file))
+        return 0;
+    const wxULongLong size = wxFileName::GetSize(filename);
+    return (size == wxInvalidSize || size.GetHi() != 0 ? 0 : size.GetLo());
+}
+
+void TranslationUnit::BuildReferenceMap(CXFile file, ReferenceMap& refMap)
 {
-    // TODO: check and handle error conditions
-    clang_reparseTranslationUnit(m_ClTranslUnit, num_unsaved_files,
-                                 unsaved_files, clang_defaultReparseOptions(m_ClTranslUnit));
+    CXSourceRange range = clang_getRange(clang_getLocationForOffset(m_ClTranslUnit, file, 0),
+                                         clang_getLocationForOffset(m_ClTranslUnit, file, GetParsedLength(file)));
+    CXToken* tokens = nullptr;
+    unsigned numTokens = 0;
+    clang_tokenize(m_ClTranslUnit, range, &tokens, &numTokens);
+    if (!tokens)
+        return;
+    std::vector<CXCursor> cursors(numTokens);
+    clang_annotateTokens(m_ClTranslUnit, tokens, numTokens, cursors.empty() ? nullptr : &cursors[0]);
+    std::multimap<unsigned, unsigned> declIndices; // by hash; distinct cursors may collide
+    for (unsigned i = 0; i < numTokens; ++i)
+    {
+        if (clang_getTokenKind(tokens[i]) != CXToken_Identifier)
+            continue;
+        // declarations reference themselves; the canonical cursor unifies declarations with definitions
+        CXCursor decl = clang_getCursorReferenced(cursors[i]);
+        if (clang_Cursor_isNull(decl) || clang_isInvalid(decl.kind))
+            continue;
+        const CXCursor canonical = clang_getCanonicalCursor(decl);
+        const CXSourceRange extent = clang_getTokenExtent(m_ClTranslUnit, tokens[i]);
+        unsigned rgStart, rgEnd;
+        clang_getSpellingLocation(clang_getRangeStart(extent), nullptr, nullptr, nullptr, &rgStart);
+        clang_getSpellingLocation(clang_getRangeEnd(extent), nullptr, nullptr, nullptr, &rgEnd);
+        if (rgStart == rgEnd)
+            continue;
+        const unsigned hash = clang_hashCursor(canonical);
+        std::multimap<unsigned, unsigned>::const_iterator idxItr = declIndices.lower_bound(hash);
+        while (   idxItr != declIndices.end() && idxItr->first == hash
+               && !clang_equalCursors(refMap.decls[idxItr->second], canonical) )
+        {
+            ++idxItr;
+        }
+        unsigned declIdx;
+        if (idxItr != declIndices.end() && idxItr->first == hash)
+            declIdx = idxItr->second;
+        else
+        {
+            declIdx = refMap.decls.size();
+            refMap.decls.push_back(canonical);
+            refMap.occurrences.resize(declIdx + 1);
+            declIndices.insert(std::make_pair(hash, declIdx));
+        }
+        refMap.tokens.push_back(std::make_pair(std::make_pair(rgStart, rgEnd), declIdx));
+        refMap.occurrences[declIdx].push_back(std::make_pair(int(rgStart), int(rgEnd - rgStart)));
+    }
+    clang_disposeTokens(m_ClTranslUnit, tokens, numTokens);
+    std::sort(refMap.tokens.begin(), refMap.tokens.end()); // should already be in order
+}
+
+/// The colour class of the declaration an identifier refers to; false if it keeps the lexer's style
+static bool ClassifySemanticDecl(CXCursor decl, SemanticCategory& category)
+{
+    switch (decl.kind)
+    {
+        case CXCursor_StructDecl:
+        case CXCursor_UnionDecl:
+        case CXCursor_ClassDecl:
+        case CXCursor_EnumDecl:
+        case CXCursor_TypedefDecl:
+        case CXCursor_TypeAliasDecl:
+        case CXCursor_ClassTemplate:
+        case CXCursor_ClassTemplatePartialSpecialization:
+        case CXCursor_TemplateTypeParameter:
+        case CXCursor_TemplateTemplateParameter:
+            category = scType;
+            return true;
+
+        case CXCursor_FieldDecl:
+            category = scMember;
+            return true;
+
+        case CXCursor_ParmDecl:
+            category = scParameter;
+            return true;
+
+        case CXCursor_MacroDefinition:
+            category = scMacro;
+            return true;
+
+        case CXCursor_EnumConstantDecl:
+            category = scEnumConstant;
+            return true;
+
+        case CXCursor_VarDecl:
+        {
+            // the semantic parent of a block scope variable is its function
+            switch (clang_getCursorSemanticParent(decl).kind)
+            {
+                case CXCursor_FunctionDecl:
+                case CXCursor_CXXMethod:
+                case CXCursor_Constructor:
+                case CXCursor_Destructor:
+                case CXCursor_ConversionFunction:
+                case CXCursor_FunctionTemplate:
+                    category = scLocal;
+                    return true;
+
+                case CXCursor_StructDecl:
+                case CXCursor_UnionDecl:
+                case CXCursor_ClassDecl:
+                case CXCursor_ClassTemplate:
+                    category = scMember; // static data member
+                    return true;
+
+                default:
+                    return false;
+            }
+        }
+
+        default:
+            return false;
+    }
 }
 
-void TranslationUnit::GetDiagnostics(std::vector<ClDiagnostic>& diagnostics)
+void TranslationUnit::GetSemanticTokens(const wxString& filename, unsigned startOffset, unsigned endOffset,
+                                        std::vector<ClSemanticToken>& results)
 {
-    CXDiagnosticSet diagSet = clang_getDiagnosticSetFromTU(m_ClTranslUnit);
-    ExpandDiagnosticSet(diagSet, diagnostics);
-    clang_disposeDiagnosticSet(diagSet);
+    const CXFile file = GetFileHandle(filename);
+    if (!file || endOffset <= startOffset)
+        return;
+    if (m_SemanticGeneration != m_Generation)
+    {
+        m_SemanticCache.clear();
+        m_SemanticGeneration = m_Generation;
+    }
+    const std::pair< CXFile, std::pair<unsigned, unsigned> > key(file, std::make_pair(startOffset, endOffset));
+    std::map< std::pair< CXFile, std::pair<unsigned, unsigned> >, std::vector<ClSemanticToken> >::const_iterator
+        cacheItr = m_SemanticCache.find(key);
+    if (cacheItr != m_SemanticCache.end())
+    {
+        results = cacheItr->second;
+        return;
+    }
+
+    std::vector<ClSemanticToken>& semTokens = m_SemanticCache[key];
+    CXSourceRange range = clang_getRange(clang_getLocationForOffset(m_ClTranslUnit, file, startOffset),
+                                         clang_getLocationForOffset(m_ClTranslUnit, file, endOffset));
+    CXToken* tokens = nullptr;
+    unsigned numTokens = 0;
+    clang_tokenize(m_ClTranslUnit, range, &tokens, &numTokens);
+    if (!tokens)
+        return;
+    std::vector<CXCursor> cursors(numTokens);
+    clang_annotateTokens(m_ClTranslUnit, tokens, numTokens, cursors.empty() ? nullptr : &cursors[0]);
+    std::map<unsigned, int> categories; // by declaration hash; -1 if not coloured
+    for (unsigned i = 0; i < numTokens; ++i)
+    {
+        if (clang_getTokenKind(tokens[i]) != CXToken_Identifier)
+            continue;
+        const CXSourceRange extent = clang_getTokenExtent(m_ClTranslUnit, tokens[i]);
+        unsigned rgStart, rgEnd;
+        clang_getSpellingLocation(clang_getRangeStart(extent), nullptr, nullptr, nullptr, &rgStart);
+        clang_getSpellingLocation(clang_getRangeEnd(extent), nullptr, nullptr, nullptr, &rgEnd);
+        if (rgStart < startOffset || rgStart >= endOffset || rgStart == rgEnd)
+            continue;
+        CXCursor decl = clang_getCursorReferenced(cursors[i]);
+        if (clang_Cursor_isNull(decl) || clang_isInvalid(decl.kind))
+            continue;
+        const unsigned declHash = clang_hashCursor(decl);
+        std::map<unsigned, int>::const_iterator catItr = categories.find(declHash);
+        if (catItr == categories.end())
+        {
+            SemanticCategory category;
+            catItr = categories.insert(std::make_pair(declHash, ClassifySemanticDecl(decl, category) ? int(category) : -1)).first;
+        }
+        if (catItr->second >= 0)
+            semTokens.push_back(ClSemanticToken(rgStart, rgEnd - rgStart, SemanticCategory(catItr->second)));
+    }
+    clang_disposeTokens(m_ClTranslUnit, tokens, numTokens);
+    results = semTokens;
 }
 
 CXFile TranslationUnit::GetFileHandle(const wxString& filename) const
@@ -139,6 +955,50 @@ CXFile TranslationUnit::GetFileHandle(const wxString& filename) const
     return clang_getFile(m_ClTranslUnit, filename.ToUTF8().data());
 }
 
+CXFile TranslationUnit::GetFileHandle(FileId fId, const TokenDatabase* database)
+{
+    if (!m_ClTranslUnit || fId == wxNOT_FOUND)
+        return nullptr;
+    if (m_FileHandleGeneration != m_Generation) // handles may not survive a reparse
+    {
+        m_FileHandles.clear();
+        m_FileHandleGeneration = m_Generation;
+    }
+    std::map<FileId, CXFile>::const_iterator fhItr = m_FileHandles.find(fId);
+    if (fhItr != m_FileHandles.end())
+        return fhItr->second;
+    // files this unit does not include are remembered as well (as nullptr)
+    const CXFile file = GetFileHandle(database->GetFilename(fId));
+    m_FileHandles.insert(std::make_pair(fId, file));
+    return file;
+}
+
+void TranslationUnit::CheckTokenCaches()
+{
+    if (m_TokenCacheGeneration == m_Generation)
+        return;
+    m_AccessCache.clear();
+    m_DocCache.clear();
+    m_TokenCacheGeneration = m_Generation;
+}
+
+void TranslationUnit::UpdateMemoryUsage()
+{
+    m_MemoryUsage = 0;
+    m_MemoryEntries.clear();
+    if (!m_ClTranslUnit)
+        return;
+    CXTUResourceUsage usage = clang_getCXTUResourceUsage(m_ClTranslUnit);
+    for (unsigned i = 0; i < usage.numEntries; ++i)
+    {
+        const unsigned long amount = usage.entries[i].amount / 1024;
+        m_MemoryUsage += amount;
+        m_MemoryEntries.push_back(ClMemoryEntry(wxString::FromUTF8(clang_getTUResourceUsageName(usage.entries[i].kind)),
+                                                amount));
+    }
+    clang_disposeCXTUResourceUsage(usage);
+}
+
 static void RangeToColumns(CXSourceRange range, unsigned& rgStart, unsigned& rgEnd)
 {
     CXSourceLocation rgLoc = clang_getRangeStart(range);
@@ -147,13 +1007,12 @@ static void RangeToColumns(CXSourceRange range, unsigned& rgStart, unsigned& rgE
     clang_getSpellingLocation(rgLoc, nullptr, nullptr, &rgEnd, nullptr);
 }
 
-void TranslationUnit::ExpandDiagnosticSet(CXDiagnosticSet diagSet, std::vector<ClDiagnostic>& diagnostics)
+void TranslationUnit::ExpandDiagnostics(const std::vector<unsigned>& diagIds, std::vector<ClDiagnostic>& diagnostics)
 {
-    size_t numDiags = clang_getNumDiagnosticsInSet(diagSet);
-    for (size_t i = 0; i < numDiags; ++i)
+    for (std::vector<unsigned>::const_iterator idItr = diagIds.begin();
+         idItr != diagIds.end(); ++idItr)
     {
-        CXDiagnostic diag = clang_getDiagnosticInSet(diagSet, i);
-        //ExpandDiagnosticSet(clang_getChildDiagnostics(diag), diagnostics);
+        CXDiagnostic diag = clang_getDiagnostic(m_ClTranslUnit, *idItr);
         size_t numRnges = clang_getDiagnosticNumRanges(diag);
         unsigned rgStart = 0;
         unsigned rgEnd = 0;
@@ -219,22 +1078,178 @@ unsigned HashToken(CXCompletionString token, wxString& identifier)
     return hVal;
 }
 
-static void ClInclusionVisitor(CXFile included_file, CXSourceLocation* WXUNUSED(inclusion_stack),
-                               unsigned WXUNUSED(include_len), CXClientData client_data)
+static FileId GetInclusionFileId(ClInclusionVisitorData* data, CXFile file)
 {
-    CXString filename = clang_getFileName(included_file);
+    std::map<CXFile, FileId>::const_iterator idItr = data->fileIds.find(file);
+    if (idItr != data->fileIds.end())
+        return idItr->second;
+    FileId fId = wxNOT_FOUND;
+    CXString filename = clang_getFileName(file);
     wxFileName inclFile(wxString::FromUTF8(clang_getCString(filename)));
     if (inclFile.MakeAbsolute())
+        fId = data->database->GetFilenameId(inclFile.GetFullPath());
+    clang_disposeString(filename);
+    data->fileIds.insert(std::make_pair(file, fId));
+    return fId;
+}
+
+static void ClInclusionVisitor(CXFile included_file, CXSourceLocation* inclusion_stack,
+                               unsigned include_len, CXClientData client_data)
+{
+    ClInclusionVisitorData* data = static_cast<ClInclusionVisitorData*>(client_data);
+    const FileId fId = GetInclusionFileId(data, included_file);
+    if (fId == wxNOT_FOUND)
+        return;
+    FileId includerId = wxNOT_FOUND;
+    if (include_len > 0) // the top of the stack is the #include directive of the direct includer
     {
-        std::pair<TranslationUnit*, TokenDatabase*>* clTranslUnit
-            = static_cast<std::pair<TranslationUnit*, TokenDatabase*>*>(client_data);
-        clTranslUnit->first->AddInclude(clTranslUnit->second->GetFilenameId(inclFile.GetFullPath()));
+        CXFile includer;
+        clang_getSpellingLocation(inclusion_stack[0], &includer, nullptr, nullptr, nullptr);
+        if (includer)
+            includerId = GetInclusionFileId(data, includer);
     }
-    clang_disposeString(filename);
+    data->translUnit->AddInclude(fId, includerId, include_len);
+}
+
+static void ClDependencyVisitor(CXFile included_file, CXSourceLocation* WXUNUSED(inclusion_stack),
+                                unsigned WXUNUSED(include_len), CXClientData client_data)
+{
+    CXString str = clang_getFileName(included_file);
+    static_cast<std::vector<wxString>*>(client_data)->push_back(wxString::FromUTF8(clang_getCString(str)));
+    clang_disposeString(str);
+}
+
+// parameters (including defaulted ones) from the placeholders of a completion string
+static void AppendSignatureParams(CXCompletionString token, unsigned firstChunk, std::vector<wxString>& signature)
+{
+    const unsigned numChunks = clang_getNumCompletionChunks(token);
+    for (unsigned chunkIdx = firstChunk; chunkIdx < numChunks; ++chunkIdx)
+    {
+        switch (clang_getCompletionChunkKind(token, chunkIdx))
+        {
+            case CXCompletionChunk_Placeholder:
+            case CXCompletionChunk_CurrentParameter:
+            {
+                CXString str = clang_getCompletionChunkText(token, chunkIdx);
+                signature.push_back(wxString::FromUTF8(clang_getCString(str)));
+                clang_disposeString(str);
+                break;
+            }
+
+            case CXCompletionChunk_Optional:
+                AppendSignatureParams(clang_getCompletionChunkCompletionString(token, chunkIdx), 0, signature);
+                break;
+
+            case CXCompletionChunk_RightParen:
+                return;
+
+            default:
+                break;
+        }
+    }
+}
+
+bool RenderSignature(CXCompletionString token, std::vector<wxString>& signature)
+{
+    wxString head;
+    const unsigned numChunks = clang_getNumCompletionChunks(token);
+    for (unsigned chunkIdx = 0; chunkIdx < numChunks; ++chunkIdx)
+    {
+        CXCompletionChunkKind kind = clang_getCompletionChunkKind(token, chunkIdx);
+        if (kind == CXCompletionChunk_TypedText)
+        {
+            CXString str = clang_getCompletionParent(token, nullptr);
+            wxString parent = wxString::FromUTF8(clang_getCString(str));
+            if (!parent.IsEmpty())
+                head += parent + wxT("::");
+            clang_disposeString(str);
+        }
+        else if (kind == CXCompletionChunk_LeftParen && !head.EndsWith(wxT("operator")))
+        {
+            signature.clear();
+            signature.push_back(head + wxT('('));
+            AppendSignatureParams(token, chunkIdx + 1, signature);
+            signature.push_back(wxT(")"));
+            return true;
+        }
+        CXString str = clang_getCompletionChunkText(token, chunkIdx);
+        head += wxString::FromUTF8(clang_getCString(str));
+        if (kind == CXCompletionChunk_ResultType)
+        {
+            if (head.Length() > 2 && head[head.Length() - 2] == wxT(' '))
+                head.RemoveLast(2) += head.Last();
+            head += wxT(' ');
+        }
+        clang_disposeString(str);
+    }
+    return false;
+}
+
+// returns false if the cursor's file was already indexed
+static bool InsertCursorToken(ClAST_VisitorData* data, CXCursor cursor, CXFile clFile, unsigned line, unsigned col)
+{
+    // resolve each file only once per visit, and skip those another unit already indexed
+    std::map<CXFile, FileId>::iterator flItr = data->files.find(clFile);
+    if (flItr == data->files.end())
+    {
+        CXString str = clang_getFileName(clFile);
+        wxString filename = wxString::FromUTF8(clang_getCString(str));
+        clang_disposeString(str);
+        FileId fId = wxNOT_FOUND;
+        if (!filename.IsEmpty())
+        {
+            fId = data->database->GetFilenameId(filename);
+            // a unit harvesting concurrently (or earlier) may have taken the file
+            if (!data->database->ClaimFileForIndexing(fId, clang_getFileTime(clFile), data->flagsHash))
+                fId = wxNOT_FOUND;
+        }
+        flItr = data->files.insert(std::make_pair(clFile, fId)).first;
+    }
+    if (flItr->second == wxNOT_FOUND)
+        return false;
+
+    CXCompletionString token = clang_getCursorCompletionString(cursor);
+    wxString identifier;
+    unsigned tokenHash = HashToken(token, identifier);
+    if (identifier.IsEmpty())
+        return true;
+    const TokenId tId = data->database->InsertToken(identifier, AbstractToken(flItr->second, line, col, tokenHash));
+    if (clang_isCursorDefinition(cursor))
+    {
+        // lets units that only see the declaration jump here
+        CXString usr = clang_getCursorUSR(cursor);
+        const char* usrStr = clang_getCString(usr);
+        if (usrStr && *usrStr)
+            data->database->SetDefinition(usrStr, flItr->second, line, col);
+        clang_disposeString(usr);
+    }
+    switch (cursor.kind)
+    {
+        case CXCursor_Constructor:
+            if (clang_getCXXAccessSpecifier(cursor) == CX_CXXPrivate)
+                break;
+            // fall through
+        case CXCursor_FunctionDecl:
+        case CXCursor_CXXMethod:
+        case CXCursor_FunctionTemplate:
+        {
+            // rendered here once, so call tips need not touch libclang
+            std::vector<wxString> signature;
+            if (!data->database->HasSignature(tId) && RenderSignature(token, signature))
+                data->database->SetSignature(tId, signature);
+            break;
+        }
+
+        default:
+            break;
+    }
+    return true;
 }
 
 static CXChildVisitResult ClAST_Visitor(CXCursor cursor, CXCursor WXUNUSED(parent), CXClientData client_data)
 {
+    ClAST_VisitorData* data = static_cast<ClAST_VisitorData*>(client_data);
+    ++data->numCursors;
     CXChildVisitResult ret = CXChildVisit_Break; // should never happen
     switch (cursor.kind)
     {
@@ -269,19 +1284,60 @@ static CXChildVisitResult ClAST_Visitor(CXCursor cursor, CXCursor WXUNUSED(paren
     CXFile clFile;
     unsigned line, col;
     clang_getSpellingLocation(loc, &clFile, &line, &col, nullptr);
-    CXString str = clang_getFileName(clFile);
-    wxString filename = wxString::FromUTF8(clang_getCString(str));
-    clang_disposeString(str);
-    if (filename.IsEmpty())
+    if (!clFile)
         return ret;
+    if (!InsertCursorToken(data, cursor, clFile, line, col))
+        return CXChildVisit_Continue;
+    return ret;
+}
 
-    CXCompletionString token = clang_getCursorCompletionString(cursor);
-    wxString identifier;
-    unsigned tokenHash = HashToken(token, identifier);
-    if (!identifier.IsEmpty())
+static void ClIdxDeclaration(CXClientData client_data, const CXIdxDeclInfo* info)
+{
+    ClAST_VisitorData* data = static_cast<ClAST_VisitorData*>(client_data);
+    ++data->numCursors;
+    if (info->isImplicit)
+        return;
+    switch (info->cursor.kind)
     {
-        TokenDatabase* database = static_cast<TokenDatabase*>(client_data);
-        database->InsertToken(identifier, AbstractToken(database->GetFilenameId(filename), line, col, tokenHash));
+        case CXCursor_StructDecl:
+        case CXCursor_UnionDecl:
+        case CXCursor_ClassDecl:
+        case CXCursor_EnumDecl:
+        case CXCursor_Namespace:
+        case CXCursor_ClassTemplate:
+        case CXCursor_FieldDecl:
+        case CXCursor_EnumConstantDecl:
+        case CXCursor_FunctionDecl:
+        case CXCursor_VarDecl:
+        case CXCursor_ParmDecl:
+        case CXCursor_TypedefDecl:
+        case CXCursor_CXXMethod:
+        case CXCursor_Constructor:
+        case CXCursor_Destructor:
+        case CXCursor_FunctionTemplate:
+            break;
+
+        default:
+            return;
     }
-    return ret;
+    if (info->semanticContainer) // only collect what the AST visitor can reach (ignore function locals)
+    {
+        switch (info->semanticContainer->cursor.kind)
+        {
+            case CXCursor_FunctionDecl:
+            case CXCursor_CXXMethod:
+            case CXCursor_Constructor:
+            case CXCursor_Destructor:
+            case CXCursor_FunctionTemplate:
+                return;
+
+            default:
+                break;
+        }
+    }
+    CXFile clFile;
+    unsigned line, col;
+    clang_indexLoc_getFileLocation(info->loc, nullptr, &clFile, &line, &col, nullptr);
+    if (clFile)
+        InsertCursorToken(data, info->cursor, clFile, line, col);
 }
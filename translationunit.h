@@ -3,14 +3,22 @@
 
 #include <clang-c/Index.h>
 #include "clangproxy.h"
+#include "fuzzymatcher.h"
 
 unsigned HashToken(CXCompletionString token, wxString& identifier);
+/**
+ * Render the call tip of a function-like declaration
+ *
+ * @param[out] signature The declaration up to the '(', each parameter, then ")"
+ * @return false if the completion string has no parameter list
+ */
+bool RenderSignature(CXCompletionString token, std::vector<wxString>& signature);
 
 class TranslationUnit
 {
     public:
-        TranslationUnit(const wxString& filename, const std::vector<const char*>& args,
-                        CXIndex clIndex, TokenDatabase* database);
+        /// The unit is not parsed until Load()
+        TranslationUnit(const wxString& filename, const wxString& commands);
         // move ctor
 #if __cplusplus >= 201103L
         TranslationUnit(TranslationUnit&& other);
@@ -19,18 +27,143 @@ class TranslationUnit
 #endif
         ~TranslationUnit();
 
-        void AddInclude(FileId fId);
-        bool Contains(FileId fId);
+        /**
+         * (Re)parse the file this unit was created with, and record its tokens
+         *
+         * @param clIndex The index to create the translation unit in
+         * @param clIndexAction Indexing session to collect tokens with, or nullptr to walk the AST instead
+         * @param database The database to insert tokens into
+         * @param unsaved_files Contents of modified editors, to parse instead of the files on disk
+         */
+        void Load(CXIndex clIndex, CXIndexAction clIndexAction, TokenDatabase* database,
+                  struct CXUnsavedFile* unsaved_files = nullptr, unsigned num_unsaved_files = 0);
+        /**
+         * Parse the file only to record its tokens and includes, then dispose the unit
+         *
+         * Safe on a worker thread, given an index no other thread uses.
+         */
+        void Index(CXIndex clIndex, CXIndexAction clIndexAction, TokenDatabase* database);
+        /**
+         * What Index() found (outcome, statistics and include graph), as
+         * WorkerProtocol records, for another process to ReadIndexed()
+         */
+        wxString WriteIndexed(const TokenDatabase* database) const;
+        /**
+         * Take over the outcome of Index() in another process
+         *
+         * @param records See WriteIndexed(); records of other kinds are skipped
+         * @return false if the records are malformed
+         */
+        bool ReadIndexed(const wxString& records, TokenDatabase* database);
+        /**
+         * Precompile a header for use with -include-pch
+         *
+         * Safe on a worker thread, given an index no other thread uses.
+         *
+         * @param commands Compile flags, including the language (-x c++-header)
+         * @param[out] dependencies Files the header includes (itself included)
+         * @return false if the header has errors or could not be written
+         */
+        static bool Precompile(CXIndex clIndex, const wxString& header, const wxString& commands,
+                               const wxString& pchFile, std::vector<wxString>& dependencies);
+        /// Release all libclang resources held, retaining only the information required to Load() again
+        void Dispose();
+        bool IsLoaded() const { return m_ClTranslUnit != nullptr; }
+        const wxString& GetFilename() const { return m_Filename; }
+        const wxString& GetCommands() const { return m_Commands; }
+        /// Takes effect at the next Load()
+        void SetCommands(const wxString& commands) { m_Commands = commands; }
+        FileId GetFileId() const { return m_FileId; }
+        const ClParseStats& GetParseStats() const { return m_ParseStats; }
+        /// Incremented each time the unit is (re)parsed
+        unsigned GetGeneration() const { return m_Generation; }
+        /// CXErrorCode of the last parse or reparse (0 on success)
+        int GetErrorCode() const { return m_ErrorCode; }
+        /// Consecutive calls to Load() that did not produce a usable unit
+        unsigned GetLoadFailures() const { return m_LoadFailures; }
+        void ResetLoadFailures() { m_LoadFailures = 0; }
+
+        /// Rebuild the (sorted) list of files this unit includes, and its include graph
+        void UpdateFiles(TokenDatabase* database);
+        void AddInclude(FileId fId, FileId includerId, unsigned depth);
+        bool Contains(FileId fId) const;
+        const std::vector<FileId>& GetFiles() const { return m_Files; }
+        /// Sorted (includer, included) pairs
+        const std::vector< std::pair<FileId, FileId> >& GetIncludeEdges() const { return m_IncludeEdges; }
+        /// Shortest include chain length from the main file (0) to the given file ((unsigned)-1 if not included)
+        unsigned GetIncludeDepth(FileId fId) const;
 
         // note that complete_line and complete_column are 1 index, not 0 index!
         CXCodeCompleteResults* CodeCompleteAt( const char* complete_filename, unsigned complete_line,
                                                unsigned complete_column, struct CXUnsavedFile* unsaved_files,
                                                unsigned num_unsaved_files );
         const CXCompletionResult* GetCCResult(unsigned index);
+        /// Typed text of the last code completion results, candidate indices match result indices
+        const FuzzyMatcher& GetCCMatcher() const { return m_CCMatcher; }
+        /// Memoised C++ access specifier behind a code completion result, or -1 if not looked up yet
+        int GetCCAccess(unsigned index) const;
+        void SetCCAccess(unsigned index, int access);
+        /**
+         * Memoised C++ access specifier of the declaration a token hash resolved to
+         *
+         * Entries are dropped when the unit is reparsed.
+         *
+         * @param tokenHash See HashToken()
+         * @return false if the hash was not looked up yet
+         */
+        bool GetCachedAccess(unsigned tokenHash, int& access);
+        void SetCachedAccess(unsigned tokenHash, int access) { m_AccessCache[tokenHash] = access; }
+        /**
+         * Rendered documentation of a completion token, dropped when the unit is reparsed
+         *
+         * @param docKey Identifies the token (its kind and scoped signature), see ClangProxy::DocumentCCToken()
+         * @return false if it was not rendered yet
+         */
+        bool GetCachedDocumentation(const wxString& docKey, wxString& html);
+        void SetCachedDocumentation(const wxString& docKey, const wxString& html);
         CXCursor GetTokensAt(const wxString& filename, int line, int column);
-        void Reparse(unsigned num_unsaved_files, struct CXUnsavedFile* unsaved_files);
-        void GetDiagnostics(std::vector<ClDiagnostic>& diagnostics);
+        CXCursor GetTokensAt(FileId fId, int line, int column, const TokenDatabase* database);
+        /// Location in a file of this unit, without converting the filename (null if the file is not included)
+        CXSourceLocation GetLocation(FileId fId, int line, int column, const TokenDatabase* database);
+        /// @return false if libclang failed (or crashed); the unit is then disposed
+        bool Reparse(unsigned num_unsaved_files, struct CXUnsavedFile* unsaved_files);
+        /// Diagnostics located in the given file (cached until the next reparse)
+        void GetDiagnostics(FileId fId, TokenDatabase* database, std::vector<ClDiagnostic>& diagnostics);
+        /**
+         * Ranges in a file that refer to the same declaration as the identifier at a position
+         *
+         * All references in the file are mapped on first use (until the next reparse),
+         * so further queries are a lookup. Offsets are into the buffer last parsed.
+         *
+         * @param[out] results (offset, length) of each occurrence
+         */
+        void GetOccurrencesOf(const wxString& filename, int line, int column,
+                              std::vector< std::pair<int, int> >& results);
+        /// Classified identifiers starting in [startOffset, endOffset) of a file (cached until the next reparse)
+        void GetSemanticTokens(const wxString& filename, unsigned startOffset, unsigned endOffset,
+                               std::vector<ClSemanticToken>& results);
         CXFile GetFileHandle(const wxString& filename) const;
+        /// Cached until the next reparse; nullptr if the unit does not include the file
+        CXFile GetFileHandle(FileId fId, const TokenDatabase* database);
+
+        /// Content hashes of the unsaved buffers (by file) the unit was last parsed with
+        const std::map<FileId, unsigned>& GetUnsavedHashes() const { return m_UnsavedHashes; }
+        /// Directives hashes (see HashDirectives()) of the same buffers
+        const std::map<FileId, unsigned>& GetDirectiveHashes() const { return m_DirectiveHashes; }
+        void SetUnsavedHashes(const std::map<FileId, unsigned>& hashes, const std::map<FileId, unsigned>& directiveHashes)
+        {
+            m_UnsavedHashes = hashes;
+            m_DirectiveHashes = directiveHashes;
+        }
+
+        /// Memory (in kilobytes) libclang reported for this unit at the last (re)parse
+        unsigned long GetMemoryUsage() const { return m_MemoryUsage; }
+        /// Breakdown of GetMemoryUsage() by libclang resource kind
+        const std::vector<ClMemoryEntry>& GetMemoryEntries() const { return m_MemoryEntries; }
+        /// Estimated memory (in kilobytes) of the cached code completion results
+        unsigned long GetCCMemoryUsage() const { return m_LastCCMemory; }
+        unsigned long GetLastAccess() const { return m_LastAccess; }
+        void SetLastAccess(unsigned long tick) { m_LastAccess = tick; }
 
     private:
 #if __cplusplus >= 201103L
@@ -38,11 +171,66 @@ class TranslationUnit
         TranslationUnit(const TranslationUnit& other);
 #endif
 
-        void ExpandDiagnosticSet(CXDiagnosticSet diagSet, std::vector<ClDiagnostic>& diagnostics);
+        /// Parse the file on disk (or its given buffer) with the compile commands; false on failure
+        bool Parse(CXIndex clIndex, unsigned options, struct CXUnsavedFile* unsaved_files, unsigned num_unsaved_files);
+        /// Record the tokens of the files not yet in the database
+        void Harvest(CXIndexAction clIndexAction, TokenDatabase* database);
+        /// Sort the files and include edges collected with AddInclude(), dropping duplicates
+        void CompactFiles();
+        void ExpandDiagnostics(const std::vector<unsigned>& diagIds, std::vector<ClDiagnostic>& diagnostics);
+        void UpdateMemoryUsage();
+        /// Drop the per token caches if the unit was reparsed since they were filled
+        void CheckTokenCaches();
+
+        struct ReferenceMap
+        {
+            /// (start offset, end offset) of each identifier (sorted), and the index of its declaration
+            std::vector< std::pair<std::pair<unsigned, unsigned>, unsigned> > tokens;
+            /// Canonical cursor of each declaration referred to
+            std::vector<CXCursor> decls;
+            /// (offset, length) of the identifiers referring to each declaration; parallel to decls
+            std::vector< std::vector< std::pair<int, int> > > occurrences;
+        };
+        void BuildReferenceMap(CXFile file, ReferenceMap& refMap);
+        /// Remember the length of each unsaved buffer the unit was (re)parsed from
+        void RecordParsedLengths(unsigned num_unsaved_files, struct CXUnsavedFile* unsaved_files);
+        /// Size of the buffer a file was parsed from (0 if the file has since changed on disk)
+        unsigned GetParsedLength(CXFile file) const;
 
+        wxString m_Filename;
+        wxString m_Commands;
+        FileId m_FileId;
         std::vector<FileId> m_Files;
+        std::vector< std::pair<FileId, FileId> > m_IncludeEdges;
+        std::map<FileId, unsigned> m_IncludeDepths;
+        std::map<FileId, unsigned> m_UnsavedHashes;
+        std::map<FileId, unsigned> m_DirectiveHashes;
+        std::map<CXFile, unsigned> m_ParsedLengths; // of the unsaved buffers of the last parse
         CXTranslationUnit m_ClTranslUnit;
         CXCodeCompleteResults* m_LastCC;
+        FuzzyMatcher m_CCMatcher;
+        std::vector<int> m_CCAccess; // parallel to the results of m_LastCC
+        std::map<unsigned, int> m_AccessCache;
+        std::map<wxString, wxString> m_DocCache;
+        unsigned m_TokenCacheGeneration; // generation of m_AccessCache and m_DocCache
+        unsigned m_Generation;
+        unsigned m_DiagGeneration; // generation of m_DiagBuckets
+        std::map< FileId, std::vector<unsigned> > m_DiagBuckets; // indices of the diagnostics in each file
+        std::map< FileId, std::vector<ClDiagnostic> > m_ExpandedDiags;
+        unsigned m_FileHandleGeneration; // generation of m_FileHandles
+        std::map<FileId, CXFile> m_FileHandles;
+        unsigned m_ReferenceGeneration; // generation of m_ReferenceMaps
+        std::map<CXFile, ReferenceMap> m_ReferenceMaps;
+        unsigned m_SemanticGeneration; // generation of m_SemanticCache
+        /// By file and (start offset, end offset) of the range
+        std::map< std::pair< CXFile, std::pair<unsigned, unsigned> >, std::vector<ClSemanticToken> > m_SemanticCache;
+        unsigned long m_MemoryUsage;
+        std::vector<ClMemoryEntry> m_MemoryEntries;
+        unsigned long m_LastCCMemory;
+        unsigned long m_LastAccess;
+        ClParseStats m_ParseStats;
+        int m_ErrorCode;
+        unsigned m_LoadFailures;
 
         struct FilePos
         {
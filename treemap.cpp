@@ -84,6 +84,19 @@ struct TreeNode
 
     std::vector<int> GetLeaves(const wxString& key) const;
 
+    size_t GetMemoryUsage() const
+    {
+        size_t usage = sizeof(TreeNode) + value.capacity() * sizeof(wxChar)
+                       + leaves.capacity() * sizeof(int)
+                       + (children.capacity() - children.size()) * sizeof(TreeNode);
+        for (std::vector<TreeNode>::const_iterator itr = children.begin();
+             itr != children.end(); ++itr)
+        {
+            usage += itr->GetMemoryUsage();
+        }
+        return usage;
+    }
+
 #if 0
     void Dump(wxString& out, wxString prefix = wxT("\n"))
     {
@@ -154,6 +167,19 @@ std::vector<int> TreeNode::GetLeaves(const wxString& key) const
 
 struct TreeNode
 {
+    size_t GetMemoryUsage() const
+    {
+        // rough per node overhead of a red-black tree: colour, parent, left and right
+        const size_t nodeOverhead = 4 * sizeof(void*);
+        size_t usage = sizeof(TreeNode);
+        for (std::multimap<wxString, int>::const_iterator itr = leaves.begin();
+             itr != leaves.end(); ++itr)
+        {
+            usage += nodeOverhead + sizeof(*itr) + itr->first.capacity() * sizeof(wxChar);
+        }
+        return usage;
+    }
+
     std::multimap<wxString, int> leaves;
 };
 #endif // USE_TREE_MAP
@@ -204,6 +230,11 @@ std::vector<int> TreeMap<int>::GetIdSet(const wxString& key) const
 #endif // USE_TREE_MAP
 }
 
+size_t TreeMap<int>::GetMemoryUsage() const
+{
+    return m_Root->GetMemoryUsage();
+}
+
 int TreeMap<int>::GetValue(int id) const
 {
     return id;
@@ -17,6 +17,7 @@ class TreeMap<int>
         void Shrink();
         std::vector<int> GetIdSet(const wxString& key) const;
         int GetValue(int id) const; // returns id
+        size_t GetMemoryUsage() const; // approximate, in bytes
     private:
         TreeNode* m_Root;
 };
@@ -52,6 +53,17 @@ class TreeMap
             return m_Data[id];
         }
 
+        size_t GetCount() const
+        {
+            return m_Data.size();
+        }
+
+        // approximate, in bytes (excludes memory owned by the values themselves)
+        size_t GetMemoryUsage() const
+        {
+            return m_Tree.GetMemoryUsage() + m_Data.capacity() * sizeof(_Tp);
+        }
+
     private:
         TreeMap<int> m_Tree;
         std::vector<_Tp> m_Data;
@@ -0,0 +1,66 @@
+/*
+ * Record format shared by the plugin and its parse worker process
+ */
+
+#include "workerprotocol.h"
+
+const char* const WorkerProtocol::EndOfMessage = "end";
+
+wxString WorkerProtocol::Escape(const wxString& field)
+{
+    wxString escaped;
+    escaped.reserve(field.Length());
+    for (size_t i = 0; i < field.Length(); ++i)
+    {
+        const wxChar ch = field[i];
+        switch (ch)
+        {
+            case wxT('\\'): escaped += wxT("\\\\"); break;
+            case wxT('\t'): escaped += wxT("\\t");  break;
+            case wxT('\n'): escaped += wxT("\\n");  break;
+            case wxT('\r'): escaped += wxT("\\r");  break;
+            default:        escaped += ch;          break;
+        }
+    }
+    return escaped;
+}
+
+void WorkerProtocol::SplitRecord(const wxString& record, std::vector<wxString>& fields)
+{
+    fields.clear();
+    fields.push_back(wxEmptyString);
+    for (size_t i = 0; i < record.Length(); ++i)
+    {
+        wxChar ch = record[i];
+        if (ch == wxT('\t'))
+        {
+            fields.push_back(wxEmptyString);
+            continue;
+        }
+        if (ch == wxT('\\') && i + 1 < record.Length())
+        {
+            ch = record[++i];
+            if (ch == wxT('t'))
+                ch = wxT('\t');
+            else if (ch == wxT('n'))
+                ch = wxT('\n');
+            else if (ch == wxT('r'))
+                ch = wxT('\r');
+        }
+        fields.back() += ch;
+    }
+}
+
+bool WorkerProtocol::NextRecord(const wxString& text, size_t& pos, wxString& record)
+{
+    if (pos >= text.Length())
+        return false;
+    size_t lineEnd = text.find(wxT('\n'), pos);
+    if (lineEnd == wxString::npos)
+        lineEnd = text.Length();
+    record = text.Mid(pos, lineEnd - pos);
+    if (!record.IsEmpty() && record.Last() == wxT('\r'))
+        record.RemoveLast();
+    pos = lineEnd + 1;
+    return true;
+}
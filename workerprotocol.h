@@ -0,0 +1,32 @@
+#ifndef WORKER_PROTOCOL_H
+#define WORKER_PROTOCOL_H
+
+#include <vector>
+#include <wx/string.h>
+
+/**
+ * Text exchanged with the parse worker process (clangworker)
+ *
+ * A message is a sequence of records, one per line, ended by a line holding
+ * only "end". A record is its kind followed by tab separated fields, each
+ * escaped with Escape() so it cannot contain a tab or a line break.
+ */
+namespace WorkerProtocol
+{
+    /// Marks the end of a message
+    extern const char* const EndOfMessage;
+
+    /// Backslash escape tabs, line breaks and backslashes
+    wxString Escape(const wxString& field);
+    /// Split a record into its (unescaped) kind and fields
+    void SplitRecord(const wxString& record, std::vector<wxString>& fields);
+    /**
+     * Step through the lines of a message
+     *
+     * @param[in,out] pos Where the next line starts; advanced past it
+     * @return false when there are no more lines
+     */
+    bool NextRecord(const wxString& text, size_t& pos, wxString& record);
+}
+
+#endif // WORKER_PROTOCOL_H